@@ -1,19 +1,62 @@
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <bit>
+#include <charconv>
 #include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <cstdio>
+#include <cstring>
+#include <deque>
 #include <filesystem>
 #include <format>
+#include <functional>
 #include <limits>
 #include <memory>
+#include <mutex>
+#include <numeric>
 #include <optional>
+#include <regex>
+#include <span>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/cn_proc.h>
+#include <linux/connector.h>
+#include <linux/inet_diag.h>
+#include <linux/io_uring.h>
+#include <linux/netlink.h>
+#include <linux/sock_diag.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <pwd.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+// needs linking with zlib (-lz)
+#include <zlib.h>
 
 enum class ExitReason : uint8_t
 {
 	UnknownArgument = 1,
 	MissingArgumentValue = 2,
 	TooManyReportFiles = 3,
+	CouldNotReadReport = 4,
+	InvalidConfig = 5,
 };
 
 // need this while compilers align on how they support C++23 features
@@ -76,402 +119,8297 @@ std::optional<int> parseInt(const char* str, const int base)
 	return static_cast<int>(l);
 }
 
-void stopExecution(ExitReason reason)
+uint64_t getMonotonicTimeNs() noexcept
 {
-	exit(static_cast<int>(reason));
+	return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
 }
 
-bool readCommandOutput(std::string_view cmd, std::string& outResult) noexcept
+// tracing of internal stages, flushed in Chrome trace JSON format (can be opened in ui.perfetto.dev or chrome://tracing)
+// set once on startup, before any other threads are started
+bool gIsTracingEnabled = false;
+
+struct TraceEvent
 {
-	std::array<char, 128> buffer;
-	auto pipe = FilePipe{popen(cmd.data(), "r"), [](FILE* f){ pclose(f); }};
-	if (!pipe) {
-		return false;
+	// should point to a string with static lifetime
+	const char* name = nullptr;
+	uint64_t beginNs = 0;
+	uint64_t endNs = 0;
+};
+
+// single-producer single-consumer ring, the owning thread writes, the flushing thread reads
+class TraceBuffer
+{
+public:
+	static constexpr size_t Capacity = 4096;
+
+	explicit TraceBuffer(int threadId) noexcept
+		: mThreadId(threadId)
+	{
 	}
 
-	while (fgets(buffer.data(), static_cast<int>(buffer.size()), *pipe) != nullptr) {
-		outResult += buffer.data();
+	void push(const TraceEvent& event) noexcept
+	{
+		const size_t head = mHead.load(std::memory_order_relaxed);
+		if (head - mTail.load(std::memory_order_acquire) >= Capacity)
+		{
+			mDroppedCount.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		mEvents[head % Capacity] = event;
+		mHead.store(head + 1, std::memory_order_release);
 	}
 
-	return true;
-}
+	template<typename Func>
+	void consume(Func&& func) noexcept
+	{
+		const size_t head = mHead.load(std::memory_order_acquire);
+		size_t tail = mTail.load(std::memory_order_relaxed);
+		for (; tail != head; ++tail)
+		{
+			func(mEvents[tail % Capacity]);
+		}
+		mTail.store(tail, std::memory_order_release);
+	}
 
-bool saveCommandOutput(std::string_view cmd, const std::string_view& filePath) noexcept
-{
-	std::array<char, 128> buffer;
-	auto pipe = FilePipe{popen(cmd.data(), "r"), [](FILE* f){ pclose(f); }};
-	if (!pipe) {
-		return false;
+	size_t takeDroppedCount() noexcept
+	{
+		return mDroppedCount.exchange(0, std::memory_order_relaxed);
 	}
 
-	auto outFilePipe = FilePipe{fopen(filePath.data(), "w"), [](FILE* f){ fclose(f); }};
+	int getThreadId() const noexcept { return mThreadId; }
+	const char* getThreadName() const noexcept { return mThreadName.load(std::memory_order_acquire); }
+	void setThreadName(const char* name) noexcept { mThreadName.store(name, std::memory_order_release); }
+
+	// intrusive list of all the buffers ever created, buffers are never destroyed
+	TraceBuffer* next = nullptr;
 
-	while (fgets(buffer.data(), static_cast<int>(buffer.size()), *pipe) != nullptr) {
-		const int bytesWritten = fputs(buffer.data(), *outFilePipe);
-		if (bytesWritten == EOF)
+private:
+	std::array<TraceEvent, Capacity> mEvents;
+	std::atomic<size_t> mHead = 0;
+	std::atomic<size_t> mTail = 0;
+	std::atomic<size_t> mDroppedCount = 0;
+	std::atomic<const char*> mThreadName = "thread";
+	const int mThreadId;
+};
+
+std::atomic<TraceBuffer*> gTraceBuffers = nullptr;
+
+TraceBuffer& getThreadTraceBuffer() noexcept
+{
+	thread_local TraceBuffer* buffer = nullptr;
+	if (buffer == nullptr)
+	{
+		static std::atomic<int> lastThreadId = 0;
+		buffer = new TraceBuffer(++lastThreadId);
+		buffer->next = gTraceBuffers.load(std::memory_order_relaxed);
+		while (!gTraceBuffers.compare_exchange_weak(buffer->next, buffer, std::memory_order_release, std::memory_order_relaxed))
 		{
-			return false;
 		}
-		// maybe we should also check if we wrote less bytes than read?
 	}
-
-	return true;
+	return *buffer;
 }
 
-struct Args
+// the name should have static lifetime
+void setTraceThreadName(const char* name) noexcept
 {
-	// [0.0, 100.0)
-	float memThresholdPct = 70.0f;
-	// [0.0, 100.0)
-	float cpuThresholdPct = 70.0f;
-	size_t timeBetweenChecksSec = 60;
-	std::string runCustomScript;
-	size_t notificationThrottleSec = 20 * 60;
-	size_t limitReportFiles = 1000;
-};
+	if (gIsTracingEnabled)
+	{
+		getThreadTraceBuffer().setThreadName(name);
+	}
+}
 
-struct AppState
+class TraceSpan
 {
-	std::chrono::time_point<std::chrono::system_clock> lastMemAlertSentTime;
-	std::chrono::time_point<std::chrono::system_clock> lastCpuAlertSentTime;
+public:
+	explicit TraceSpan(const char* name) noexcept
+		: mName(name)
+		, mBeginNs(gIsTracingEnabled ? getMonotonicTimeNs() : 0)
+	{
+	}
+
+	~TraceSpan() noexcept
+	{
+		if (gIsTracingEnabled)
+		{
+			getThreadTraceBuffer().push(TraceEvent{mName, mBeginNs, getMonotonicTimeNs()});
+		}
+	}
+
+	TraceSpan(const TraceSpan&) = delete;
+	TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+	const char* mName;
+	const uint64_t mBeginNs;
 };
 
-template<typename T>
-bool readArgValue(T& dest, int argc, char** argv, int& i)
+class TraceWriter
 {
-	if (i + 1 >= argc || argv[i + 1][0] == '-')
+public:
+	explicit TraceWriter(const std::string& filePath) noexcept
+		: mFile(fopen(filePath.c_str(), "w"))
 	{
-		return false;
+		if (mFile == nullptr)
+		{
+			fprintf(stderr, "Could not open trace file '%s'\n", filePath.c_str());
+			return;
+		}
+		// JSON array format, the closing bracket is optional so the file stays valid if we get killed
+		fputs("[\n", mFile);
 	}
 
-	if constexpr (std::is_integral_v<T>)
+	~TraceWriter() noexcept
 	{
-		std::optional<int> value = parseInt(argv[i + 1], 10);
-		if (!value.has_value())
+		if (mFile)
 		{
-			return false;
+			flush();
+			fputs("\n]\n", mFile);
+			fclose(mFile);
 		}
+	}
 
-		if constexpr (std::is_unsigned_v<T>)
+	TraceWriter(const TraceWriter&) = delete;
+	TraceWriter& operator=(const TraceWriter&) = delete;
+
+	void flush() noexcept
+	{
+		if (mFile == nullptr)
 		{
-			if (*value < 0)
-			{
-				return false;
-			}
+			return;
 		}
 
-		if constexpr (sizeof(T) < sizeof(int))
+		const int pid = getpid();
+		for (TraceBuffer* buffer = gTraceBuffers.load(std::memory_order_acquire); buffer != nullptr; buffer = buffer->next)
 		{
-			if (*value < 0)
+			const int tid = buffer->getThreadId();
+			if (tid >= int(mKnownThreads.size()) || !mKnownThreads[tid])
 			{
-				if (*value < std::numeric_limits<T>::lowest())
+				if (tid >= int(mKnownThreads.size()))
 				{
-					return false;
+					mKnownThreads.resize(tid + 1, false);
 				}
+				mKnownThreads[tid] = true;
+				writeSeparator();
+				fprintf(mFile, R"({"name":"thread_name","ph":"M","pid":%d,"tid":%d,"args":{"name":"%s %d"}})", pid, tid, buffer->getThreadName(), tid);
 			}
-			else
+
+			buffer->consume([this, pid, tid](const TraceEvent& event) {
+				writeSeparator();
+				fprintf(mFile, R"({"name":"%s","ph":"X","ts":%.3f,"dur":%.3f,"pid":%d,"tid":%d})", event.name, double(event.beginNs) / 1000.0, double(event.endNs - event.beginNs) / 1000.0, pid, tid);
+			});
+
+			if (const size_t droppedCount = buffer->takeDroppedCount(); droppedCount > 0)
 			{
-				if (*value > std::numeric_limits<T>::max())
-				{
-					return false;
-				}
+				writeSeparator();
+				fprintf(mFile, R"({"name":"dropped_events","ph":"i","s":"t","ts":%.3f,"pid":%d,"tid":%d,"args":{"count":%zu}})", double(getMonotonicTimeNs()) / 1000.0, pid, tid, droppedCount);
 			}
 		}
+		fflush(mFile);
+	}
 
-		dest = T(*value);
-		++i;
-		return true;
+private:
+	void writeSeparator() noexcept
+	{
+		if (mHasWrittenEvents)
+		{
+			fputs(",\n", mFile);
+		}
+		mHasWrittenEvents = true;
 	}
-	else if constexpr (std::is_floating_point_v<T>)
+
+private:
+	FILE* mFile = nullptr;
+	bool mHasWrittenEvents = false;
+	std::vector<bool> mKnownThreads;
+};
+
+void stopExecution(ExitReason reason)
+{
+	exit(static_cast<int>(reason));
+}
+
+struct CommandResult
+{
+	bool hasStarted = false;
+	bool hasTimedOut = false;
+	// -1 if the command didn't finish normally
+	int exitCode = -1;
+};
+
+// children that were killed but didn't exit in time (e.g. stuck in D state), reaped on later runs
+std::vector<pid_t> gAbandonedChildren;
+
+void reapAbandonedChildren() noexcept
+{
+	std::erase_if(gAbandonedChildren, [](pid_t pid) {
+		return waitpid(pid, nullptr, WNOHANG) != 0;
+	});
+}
+
+void killProcessGroup(pid_t pid) noexcept
+{
+	kill(-pid, SIGKILL);
+	// give the kernel a moment to deliver the signal, but never block on a child that can't die right now
+	for (int i = 0; i < 10; ++i)
 	{
-		std::optional<int> value = parseInt(argv[i + 1], 10);
-		if (value.has_value())
+		if (waitpid(pid, nullptr, WNOHANG) != 0)
 		{
-			dest = T(*value);
-			++i;
-			return true;
+			return;
 		}
+		usleep(1000);
 	}
-	else if constexpr (std::is_same_v<T, std::string>)
+	gAbandonedChildren.push_back(pid);
+}
+
+// starts the command with /bin/sh in its own process group
+// returns the non-blocking read end of the command's stdout or -1 if the command couldn't be started
+int spawnShellCommand(std::string_view cmd, pid_t& outPid) noexcept
+{
+	std::array<int, 2> pipeFds;
+	if (pipe2(pipeFds.data(), O_CLOEXEC) != 0)
 	{
-		dest = std::string(argv[i + 1]);
-		++i;
-		return true;
+		return -1;
 	}
 
-	return false;
+	posix_spawn_file_actions_t fileActions;
+	posix_spawn_file_actions_init(&fileActions);
+	posix_spawn_file_actions_adddup2(&fileActions, pipeFds[1], STDOUT_FILENO);
+
+	posix_spawnattr_t spawnAttributes;
+	posix_spawnattr_init(&spawnAttributes);
+	posix_spawnattr_setflags(&spawnAttributes, POSIX_SPAWN_SETPGROUP);
+	posix_spawnattr_setpgroup(&spawnAttributes, 0);
+
+	std::string cmdString(cmd);
+	std::array<char*, 4> childArgv{const_cast<char*>("sh"), const_cast<char*>("-c"), cmdString.data(), nullptr};
+	pid_t pid = 0;
+	const int spawnError = posix_spawn(&pid, "/bin/sh", &fileActions, &spawnAttributes, childArgv.data(), environ);
+	posix_spawn_file_actions_destroy(&fileActions);
+	posix_spawnattr_destroy(&spawnAttributes);
+	close(pipeFds[1]);
+
+	if (spawnError != 0)
+	{
+		close(pipeFds[0]);
+		return -1;
+	}
+
+	fcntl(pipeFds[0], F_SETFL, fcntl(pipeFds[0], F_GETFL) | O_NONBLOCK);
+	outPid = pid;
+	return pipeFds[0];
 }
 
-Args readArgs(int argc, char** argv)
+// runs the command and reads its stdout without blocking
+// the whole process group is killed when the deadline is reached, zero timeout means no deadline
+// onOutput receives every chunk that was read, so partial output is delivered even if the command times out
+CommandResult runCommand(std::string_view cmd, std::chrono::milliseconds timeout, const std::function<bool(std::string_view)>& onOutput) noexcept
 {
-	if (argc == 1)
+	TraceSpan span("runCommand");
+	reapAbandonedChildren();
+
+	CommandResult result;
+	pid_t pid = 0;
+	const int outputFd = spawnShellCommand(cmd, pid);
+	if (outputFd < 0)
 	{
-		return {};
+		return result;
 	}
+	result.hasStarted = true;
 
-	Args args;
-	for (int i = 1; i < argc; ++i)
-	{
-		bool isFound = false;
-		bool isMissingValue = false;
-		if (argv[i][0] == '-' && argv[i][1] != '\0')
+	const auto deadline = std::chrono::steady_clock::now() + timeout;
+	auto getRemainingMs = [&deadline, timeout]() -> int {
+		if (timeout.count() == 0)
 		{
-			// one letter args
-			if (argv[i][2] == '\0')
-			{
-				switch (argv[i][1])
-				{
-				case 'm':
-					isMissingValue = !readArgValue(args.memThresholdPct, argc, argv, i);
-					isFound = true;
-					break;
-				case 'c':
-					isMissingValue = !readArgValue(args.cpuThresholdPct, argc, argv, i);
-					isFound = true;
-					break;
-				case 't':
-					isMissingValue = !readArgValue(args.timeBetweenChecksSec, argc, argv, i);
-					isFound = true;
-					break;
-				case 'r':
-					isMissingValue = !readArgValue(args.runCustomScript, argc, argv, i);
-					isFound = true;
-					break;
-				case 'n':
-					isMissingValue = !readArgValue(args.notificationThrottleSec, argc, argv, i);
-					isFound = true;
-					break;
-				case 'l':
-					isMissingValue = !readArgValue(args.limitReportFiles, argc, argv, i);
-					isFound = true;
-					break;
-				}
-			}
+			return -1;
 		}
+		const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+		return int(std::max<std::chrono::milliseconds::rep>(remaining.count(), 0));
+	};
 
-		if (!isFound)
+	std::array<char, 4096> buffer;
+	bool isReading = true;
+	while (isReading)
+	{
+		const int remainingMs = getRemainingMs();
+		if (remainingMs == 0)
 		{
-			fprintf(stderr, "Unknown argument '%s'\n", argv[i]);
-			stopExecution(ExitReason::UnknownArgument);
+			result.hasTimedOut = true;
+			break;
 		}
 
-		if (isMissingValue)
+		pollfd pollFd{outputFd, POLLIN, 0};
+		const int pollResult = poll(&pollFd, 1, remainingMs);
+		if (pollResult < 0 && errno != EINTR)
 		{
-			fprintf(stderr, "Argument '%s' did not have a valid value\n", argv[i]);
-			stopExecution(ExitReason::MissingArgumentValue);
+			break;
 		}
-	}
-
-	return args;
-}
 
-void trySendNotification(const Args& args, auto& lastSendTime, std::string_view errorTitle, float consumptionPct)
-{
-	if (!args.runCustomScript.empty())
-	{
-		const auto timeNow = std::chrono::system_clock::now();
-		if (timeNow > lastSendTime + std::chrono::seconds(args.notificationThrottleSec))
+		while (true)
 		{
-			const std::string command = std::format("{} '{}. Consumption is {:.2f}%'", args.runCustomScript, errorTitle, consumptionPct);
-			const int resultCode = std::system(command.data());
-			if (resultCode != 0)
+			const ssize_t bytesRead = read(outputFd, buffer.data(), buffer.size());
+			if (bytesRead > 0)
+			{
+				if (!onOutput(std::string_view(buffer.data(), size_t(bytesRead))))
+				{
+					isReading = false;
+					break;
+				}
+				continue;
+			}
+
+			if (bytesRead == 0 || (errno != EAGAIN && errno != EINTR))
 			{
-				fprintf(stderr, "Notification script exited with non-zero code %d\n", resultCode);
+				// EOF or a broken pipe
+				isReading = false;
 			}
-			lastSendTime = timeNow;
+			break;
 		}
 	}
-}
-
-int getFreePartValue(std::string& buffer, size_t partIndex)
-{
-	// free -L prints 4 blocks of the same size (usually 20 characters long each) + a '\n'
-	// the size of the longest header + one space after
-	const size_t longestHeaderLen = 8 + 1;
-	const size_t startOffset = (buffer.size() - 1) / 4 * partIndex + longestHeaderLen;
-	const size_t maxNumberLen = (buffer.size() - 1) / 4 - longestHeaderLen;
+	close(outputFd);
 
-	const size_t end = std::min(startOffset + maxNumberLen, buffer.size());
-	size_t numberStart = startOffset;
-	size_t numberLen = maxNumberLen;
-	for (size_t i = startOffset; i < end ; ++i)
+	// the output can be closed before the command finishes, so waiting for the exit also respects the deadline
+	while (!result.hasTimedOut)
 	{
-		--numberLen;
-		if (buffer[i] != ' ')
+		int status = 0;
+		const pid_t waitResult = waitpid(pid, &status, WNOHANG);
+		if (waitResult == pid)
 		{
-			numberStart = i;
+			result.exitCode = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+			return result;
+		}
+		if (waitResult < 0)
+		{
+			return result;
+		}
+		if (getRemainingMs() == 0)
+		{
+			result.hasTimedOut = true;
 			break;
 		}
+		usleep(1000);
 	}
 
-	// unfortunate allocation because we want a null-terminated string without butchering the original string
-	const std::string numberPart = buffer.substr(numberStart, numberLen);
-	std::optional<int> parsedNumber = parseInt(numberPart.data(), 10);
-	if (!parsedNumber.has_value())
+	killProcessGroup(pid);
+	return result;
+}
+
+bool readCommandOutput(std::string_view cmd, std::chrono::milliseconds timeout, std::string& outResult) noexcept
+{
+	TraceSpan span("readCommandOutput");
+	const CommandResult result = runCommand(cmd, timeout, [&outResult](std::string_view output) {
+		outResult += output;
+		return true;
+	});
+
+	if (result.hasTimedOut)
 	{
-		fprintf(stderr, "Failed to parse number '%s' from 'free -L' output '%s'\n", numberPart.data(), buffer.data());
-		return 0;
+		fprintf(stderr, "Command '%.*s' timed out and was killed\n", int(cmd.size()), cmd.data());
 	}
 
-	return *parsedNumber;
+	return result.hasStarted && !result.hasTimedOut;
 }
 
-float checkMemory(std::string& buffer)
+// keeps one long-lived sar or vmstat process in continuous mode and parses its output incrementally
+// the process is restarted with a backoff if it dies
+class StreamingCpuReader
 {
-	buffer.clear();
-	const bool hasExecuted = readCommandOutput("free -L", buffer);
-	if (!hasExecuted)
+public:
+	enum class Tool
 	{
-		fprintf(stderr, "Could not execute 'free -L'\n");
-	}
+		Vmstat,
+		Sar,
+	};
 
-	const int usedValue = getFreePartValue(buffer, 2);
-	const int freeValue = getFreePartValue(buffer, 3);
+	explicit StreamingCpuReader(Tool tool) noexcept
+		: mTool(tool)
+	{
+		start();
+	}
 
-	const float usedFraction = float(usedValue) / (float(freeValue) + float(usedValue));
+	~StreamingCpuReader() noexcept
+	{
+		stop();
+	}
 
-	return usedFraction * 100.0;
-}
+	StreamingCpuReader(const StreamingCpuReader&) = delete;
+	StreamingCpuReader& operator=(const StreamingCpuReader&) = delete;
 
-bool isSubstr(std::string_view string, std::string_view substring, size_t position)
-{
-	if (position + substring.size() >= string.size())
+	static std::optional<Tool> parseTool(std::string_view name) noexcept
 	{
-		return false;
+		if (name == "vmstat")
+		{
+			return Tool::Vmstat;
+		}
+		if (name == "sar")
+		{
+			return Tool::Sar;
+		}
+		return std::nullopt;
 	}
 
-	for (size_t i = 0, size = substring.size(); i < size; ++i)
+	// -1 while the process is not running
+	int getFd() const noexcept { return mFd; }
+
+	// returns the last sample if it's not older than maxAge
+	std::optional<float> getLatestCpuPct(std::chrono::steady_clock::duration maxAge) const noexcept
 	{
-		if (string[position + i] != substring[i])
+		if (!mLatestCpuPct.has_value() || std::chrono::steady_clock::now() - mLatestSampleTime > maxAge)
 		{
-			return false;
+			return std::nullopt;
+		}
+		return mLatestCpuPct;
+	}
+
+	// reads everything that is available without blocking and restarts the process if needed
+	void update() noexcept
+	{
+		if (mFd < 0)
+		{
+			if (std::chrono::steady_clock::now() >= mNextStartTime)
+			{
+				start();
+			}
+			return;
+		}
+
+		TraceSpan span("streamingCpuRead");
+		std::array<char, 4096> buffer;
+		while (true)
+		{
+			const ssize_t bytesRead = read(mFd, buffer.data(), buffer.size());
+			if (bytesRead > 0)
+			{
+				consumeOutput(std::string_view(buffer.data(), size_t(bytesRead)));
+				continue;
+			}
+
+			if (bytesRead == 0 || (errno != EAGAIN && errno != EINTR))
+			{
+				fprintf(stderr, "Streaming '%s' process stopped, restarting it in %d seconds\n", getCommand(), int(mRestartBackoff.count()));
+				stop();
+				mNextStartTime = std::chrono::steady_clock::now() + mRestartBackoff;
+				mRestartBackoff = std::min(mRestartBackoff * 2, std::chrono::seconds(60));
+			}
+			break;
+		}
+	}
+
+private:
+	const char* getCommand() const noexcept
+	{
+		switch (mTool)
+		{
+		case Tool::Vmstat:
+			return "LC_ALL=C vmstat -n 1";
+		case Tool::Sar:
+			return "LC_ALL=C sar -u 1";
+		}
+		return "";
+	}
+
+	std::string_view getIdleColumnName() const noexcept
+	{
+		return mTool == Tool::Vmstat ? "id" : "%idle";
+	}
+
+	void start() noexcept
+	{
+		reapAbandonedChildren();
+		mFd = spawnShellCommand(getCommand(), mPid);
+		if (mFd < 0)
+		{
+			fprintf(stderr, "Could not start '%s'\n", getCommand());
+			mNextStartTime = std::chrono::steady_clock::now() + mRestartBackoff;
+			return;
+		}
+		mPendingLine.clear();
+		mIdleColumn = -1;
+		// the first line of vmstat contains averages since boot
+		mShouldSkipNextSample = (mTool == Tool::Vmstat);
+	}
+
+	void stop() noexcept
+	{
+		if (mFd >= 0)
+		{
+			close(mFd);
+			mFd = -1;
+			killProcessGroup(mPid);
+		}
+	}
+
+	void consumeOutput(std::string_view output) noexcept
+	{
+		size_t lineStart = 0;
+		for (size_t i = 0; i < output.size(); ++i)
+		{
+			if (output[i] == '\n')
+			{
+				if (mPendingLine.empty())
+				{
+					parseLine(output.substr(lineStart, i - lineStart));
+				}
+				else
+				{
+					mPendingLine += output.substr(lineStart, i - lineStart);
+					parseLine(mPendingLine);
+					mPendingLine.clear();
+				}
+				lineStart = i + 1;
+			}
+		}
+		mPendingLine += output.substr(lineStart);
+	}
+
+	void parseLine(std::string_view line) noexcept
+	{
+		std::array<std::string_view, 32> tokens;
+		size_t tokenCount = 0;
+		for (size_t i = 0; i < line.size() && tokenCount < tokens.size();)
+		{
+			while (i < line.size() && (line[i] == ' ' || line[i] == '\t'))
+			{
+				++i;
+			}
+			const size_t tokenStart = i;
+			while (i < line.size() && line[i] != ' ' && line[i] != '\t')
+			{
+				++i;
+			}
+			if (i > tokenStart)
+			{
+				tokens[tokenCount++] = line.substr(tokenStart, i - tokenStart);
+			}
+		}
+
+		for (size_t i = 0; i < tokenCount; ++i)
+		{
+			if (tokens[i] == getIdleColumnName())
+			{
+				mIdleColumn = int(i);
+				mColumnCount = tokenCount;
+				return;
+			}
+		}
+
+		if (mIdleColumn < 0 || tokenCount != mColumnCount)
+		{
+			return;
+		}
+
+		const std::string_view idleToken = tokens[size_t(mIdleColumn)];
+		float idlePct = 0.0f;
+		const auto [ptr, error] = std::from_chars(idleToken.data(), idleToken.data() + idleToken.size(), idlePct);
+		if (error != std::errc() || ptr != idleToken.data() + idleToken.size())
+		{
+			return;
+		}
+
+		if (mShouldSkipNextSample)
+		{
+			mShouldSkipNextSample = false;
+			return;
+		}
+
+		mLatestCpuPct = 100.0f - idlePct;
+		mLatestSampleTime = std::chrono::steady_clock::now();
+		mRestartBackoff = std::chrono::seconds(1);
+	}
+
+private:
+	const Tool mTool;
+	pid_t mPid = 0;
+	int mFd = -1;
+	std::string mPendingLine;
+	int mIdleColumn = -1;
+	size_t mColumnCount = 0;
+	bool mShouldSkipNextSample = false;
+	std::optional<float> mLatestCpuPct;
+	std::chrono::steady_clock::time_point mLatestSampleTime;
+	std::chrono::steady_clock::time_point mNextStartTime;
+	std::chrono::seconds mRestartBackoff{1};
+};
+
+// reads a whole small file (e.g. from /proc) into the buffer, returns false if the file couldn't be read
+bool readSmallFile(int dirFd, const char* path, std::string& outBuffer) noexcept
+{
+	outBuffer.clear();
+	const int fd = openat(dirFd, path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		return false;
+	}
+
+	std::array<char, 4096> chunk;
+	while (true)
+	{
+		const ssize_t bytesRead = read(fd, chunk.data(), chunk.size());
+		if (bytesRead <= 0)
+		{
+			close(fd);
+			return bytesRead == 0;
+		}
+		outBuffer.append(chunk.data(), size_t(bytesRead));
+	}
+}
+
+// parses an unsigned number at the position and moves the position past it
+uint64_t parseUnsigned(std::string_view text, size_t& position) noexcept
+{
+	while (position < text.size() && text[position] == ' ')
+	{
+		++position;
+	}
+
+	uint64_t value = 0;
+	const auto [ptr, error] = std::from_chars(text.data() + position, text.data() + text.size(), value);
+	position = size_t(ptr - text.data());
+	return error == std::errc() ? value : 0;
+}
+
+// moves the position to the start of the next space-separated field
+void skipFields(std::string_view text, size_t& position, int fieldCount) noexcept
+{
+	for (int i = 0; i < fieldCount; ++i)
+	{
+		while (position < text.size() && text[position] == ' ')
+		{
+			++position;
+		}
+		while (position < text.size() && text[position] != ' ')
+		{
+			++position;
+		}
+	}
+}
+
+// a minimal io_uring, without liburing, to batch many small reads into few syscalls
+class IoRing
+{
+public:
+	explicit IoRing(unsigned entryCount) noexcept
+	{
+		io_uring_params params{};
+		mFd = int(syscall(__NR_io_uring_setup, entryCount, &params));
+		if (mFd < 0)
+		{
+			return;
+		}
+
+		mSqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		mCqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		const bool isSingleMmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+		if (isSingleMmap)
+		{
+			mSqRingSize = mCqRingSize = std::max(mSqRingSize, mCqRingSize);
+		}
+
+		void* sqRing = mmap(nullptr, mSqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_SQ_RING);
+		mSqRing = (sqRing == MAP_FAILED) ? nullptr : sqRing;
+		void* cqRing = isSingleMmap ? sqRing : mmap(nullptr, mCqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_CQ_RING);
+		mCqRing = (cqRing == MAP_FAILED) ? nullptr : cqRing;
+		mSqesSize = params.sq_entries * sizeof(io_uring_sqe);
+		void* sqes = mmap(nullptr, mSqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_SQES);
+		mSqes = (sqes == MAP_FAILED) ? nullptr : static_cast<io_uring_sqe*>(sqes);
+		if (mSqRing == nullptr || mCqRing == nullptr || mSqes == nullptr)
+		{
+			reset();
+			return;
+		}
+
+		char* sqRingBytes = static_cast<char*>(mSqRing);
+		char* cqRingBytes = static_cast<char*>(mCqRing);
+		mSqTail = reinterpret_cast<unsigned*>(sqRingBytes + params.sq_off.tail);
+		mSqMask = *reinterpret_cast<unsigned*>(sqRingBytes + params.sq_off.ring_mask);
+		mCqHead = reinterpret_cast<unsigned*>(cqRingBytes + params.cq_off.head);
+		mCqTail = reinterpret_cast<unsigned*>(cqRingBytes + params.cq_off.tail);
+		mCqMask = *reinterpret_cast<unsigned*>(cqRingBytes + params.cq_off.ring_mask);
+		mCqes = reinterpret_cast<io_uring_cqe*>(cqRingBytes + params.cq_off.cqes);
+		mEntryCount = params.sq_entries;
+
+		// the entries are always submitted in order, so the indirection array maps every slot to itself
+		unsigned* sqArray = reinterpret_cast<unsigned*>(sqRingBytes + params.sq_off.array);
+		for (unsigned i = 0; i < mEntryCount; ++i)
+		{
+			sqArray[i] = i;
+		}
+		mSqTailLocal = *mSqTail;
+	}
+
+	~IoRing()
+	{
+		reset();
+	}
+
+	IoRing(const IoRing&) = delete;
+	IoRing& operator=(const IoRing&) = delete;
+
+	bool isValid() const noexcept { return mFd >= 0; }
+	// the most entries that can be queued between two submits
+	unsigned getCapacity() const noexcept { return mEntryCount; }
+
+	// queues an operation, the fields specific to the opcode can be set in the returned entry
+	io_uring_sqe& addEntry(uint8_t opcode, int fd, const void* address, uint32_t length, uint64_t offset, uint64_t userData) noexcept
+	{
+		io_uring_sqe& sqe = mSqes[mSqTailLocal & mSqMask];
+		std::memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode = opcode;
+		sqe.fd = fd;
+		sqe.addr = reinterpret_cast<uint64_t>(address);
+		sqe.len = length;
+		sqe.off = offset;
+		sqe.user_data = userData;
+		++mSqTailLocal;
+		++mPendingCount;
+		return sqe;
+	}
+
+	// submits the queued entries and waits for all of them, the function is called with the user data and the result of each
+	// returns false if the ring failed, it's reset in that case
+	template<typename Func>
+	bool submitAndWait(Func&& onCompletion) noexcept
+	{
+		std::atomic_ref<unsigned>(*mSqTail).store(mSqTailLocal, std::memory_order_release);
+		const unsigned pendingCount = std::exchange(mPendingCount, 0);
+		unsigned submittedCount = 0;
+		unsigned completedCount = 0;
+		while (completedCount < pendingCount)
+		{
+			const long result = syscall(__NR_io_uring_enter, mFd, pendingCount - submittedCount, pendingCount - completedCount, IORING_ENTER_GETEVENTS, nullptr, 0);
+			if (result < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+				reset();
+				return false;
+			}
+			submittedCount += unsigned(result);
+
+			unsigned head = *mCqHead;
+			const unsigned tail = std::atomic_ref<unsigned>(*mCqTail).load(std::memory_order_acquire);
+			for (; head != tail; ++head, ++completedCount)
+			{
+				const io_uring_cqe& cqe = mCqes[head & mCqMask];
+				onCompletion(cqe.user_data, cqe.res);
+			}
+			std::atomic_ref<unsigned>(*mCqHead).store(head, std::memory_order_release);
+		}
+		return true;
+	}
+
+	// closes the ring, it's not valid after that
+	void reset() noexcept
+	{
+		if (mSqes != nullptr)
+		{
+			munmap(mSqes, mSqesSize);
+		}
+		if (mCqRing != nullptr && mCqRing != mSqRing)
+		{
+			munmap(mCqRing, mCqRingSize);
+		}
+		if (mSqRing != nullptr)
+		{
+			munmap(mSqRing, mSqRingSize);
+		}
+		if (mFd >= 0)
+		{
+			close(mFd);
+		}
+		mSqes = nullptr;
+		mSqRing = nullptr;
+		mCqRing = nullptr;
+		mFd = -1;
+	}
+
+private:
+	int mFd = -1;
+	void* mSqRing = nullptr;
+	void* mCqRing = nullptr;
+	size_t mSqRingSize = 0;
+	size_t mCqRingSize = 0;
+	size_t mSqesSize = 0;
+	io_uring_sqe* mSqes = nullptr;
+	unsigned* mSqTail = nullptr;
+	unsigned mSqMask = 0;
+	unsigned* mCqHead = nullptr;
+	unsigned* mCqTail = nullptr;
+	unsigned mCqMask = 0;
+	io_uring_cqe* mCqes = nullptr;
+	unsigned mEntryCount = 0;
+	unsigned mSqTailLocal = 0;
+	unsigned mPendingCount = 0;
+};
+
+struct ProcessRecord
+{
+	pid_t pid = 0;
+	pid_t parentPid = 0;
+	uid_t uid = 0;
+	char state = '?';
+	int threadCount = 0;
+	// utime + stime
+	uint64_t cpuTimeTicks = 0;
+	uint64_t startTimeTicks = 0;
+	uint64_t virtualMemoryKb = 0;
+	uint64_t residentMemoryKb = 0;
+	// bytes the process caused to be fetched from or sent to storage, from /proc/[pid]/io
+	uint64_t ioReadBytes = 0;
+	uint64_t ioWriteBytes = 0;
+	// proportional and unique set sizes from /proc/[pid]/smaps_rollup, zero for the processes that weren't candidates
+	uint64_t proportionalMemoryKb = 0;
+	uint64_t uniqueMemoryKb = 0;
+	std::string command;
+	std::string commandLine;
+	// the cgroup v2 path, or the path of the first v1 hierarchy, empty if not read
+	std::string cgroup;
+};
+
+// the optional files read for every process, each one is one more file per process
+struct ProcessReadOptions
+{
+	// /proc/[pid]/io needs the same rights as ptrace
+	bool shouldReadIo = false;
+	bool shouldReadCgroup = false;
+};
+
+// state of all the processes collected in one pass over /proc, so all the views of one report are consistent
+struct ProcessSnapshot
+{
+	std::chrono::system_clock::time_point time;
+	double uptimeSec = 0.0;
+	uint64_t memoryTotalKb = 0;
+	long clockTicksPerSec = 100;
+	// /proc/[pid]/io is only read when the report needs it, it's an extra file per process and needs the same rights as ptrace
+	bool hasIoStats = false;
+	// the PSS and USS are read only for the processes with the highest RSS
+	bool hasProportionalMemory = false;
+	bool hasCgroups = false;
+	std::vector<ProcessRecord> processes;
+};
+
+// same meaning as %CPU of ps: CPU time divided by the lifetime of the process
+float getLifetimeCpuPct(const ProcessSnapshot& snapshot, const ProcessRecord& process) noexcept
+{
+	const double lifetimeSec = snapshot.uptimeSec - double(process.startTimeTicks) / double(snapshot.clockTicksPerSec);
+	if (lifetimeSec <= 0.0)
+	{
+		return 0.0f;
+	}
+	return float(double(process.cpuTimeTicks) / double(snapshot.clockTicksPerSec) / lifetimeSec * 100.0);
+}
+
+float getMemoryPct(const ProcessSnapshot& snapshot, const ProcessRecord& process) noexcept
+{
+	return snapshot.memoryTotalKb == 0 ? 0.0f : float(double(process.residentMemoryKb) / double(snapshot.memoryTotalKb) * 100.0);
+}
+
+// bytes per second of storage I/O over the lifetime of the process, the same way as getLifetimeCpuPct
+double getLifetimeIoBytesPerSec(const ProcessSnapshot& snapshot, const ProcessRecord& process) noexcept
+{
+	const double lifetimeSec = snapshot.uptimeSec - double(process.startTimeTicks) / double(snapshot.clockTicksPerSec);
+	if (lifetimeSec <= 0.0)
+	{
+		return 0.0;
+	}
+	return double(process.ioReadBytes + process.ioWriteBytes) / lifetimeSec;
+}
+
+// fills the fields from /proc/[pid]/stat, returns false if the text is malformed
+bool parseProcessStat(std::string_view text, ProcessRecord& outRecord) noexcept
+{
+	// comm can contain spaces and parentheses, so look for the last closing parenthesis
+	const size_t commStart = text.find('(');
+	const size_t commEnd = text.rfind(')');
+	if (commStart == std::string_view::npos || commEnd == std::string_view::npos || commEnd + 2 >= text.size())
+	{
+		return false;
+	}
+
+	outRecord.command.assign(text, commStart + 1, commEnd - commStart - 1);
+	size_t position = 0;
+	outRecord.pid = pid_t(parseUnsigned(text, position));
+	// fields are numbered as in proc(5), position is at field 3 (state)
+	position = commEnd + 2;
+	outRecord.state = text[position];
+	position += 1;
+	outRecord.parentPid = pid_t(parseUnsigned(text, position));
+	// skip to field 14 (utime)
+	skipFields(text, position, 9);
+	outRecord.cpuTimeTicks = parseUnsigned(text, position);
+	outRecord.cpuTimeTicks += parseUnsigned(text, position);
+	// skip to field 20 (num_threads)
+	skipFields(text, position, 4);
+	outRecord.threadCount = int(parseUnsigned(text, position));
+	skipFields(text, position, 1);
+	outRecord.startTimeTicks = parseUnsigned(text, position);
+	outRecord.virtualMemoryKb = parseUnsigned(text, position) / 1024;
+	static const uint64_t pageSizeKb = uint64_t(sysconf(_SC_PAGESIZE)) / 1024;
+	outRecord.residentMemoryKb = parseUnsigned(text, position) * pageSizeKb;
+	return true;
+}
+
+// sets the printable command line from the raw /proc/[pid]/cmdline, the command has to be set already
+void setProcessCommandLine(std::string_view rawCommandLine, ProcessRecord& outRecord)
+{
+	while (!rawCommandLine.empty() && rawCommandLine.back() == '\0')
+	{
+		rawCommandLine.remove_suffix(1);
+	}
+
+	if (rawCommandLine.empty())
+	{
+		// kernel threads and zombies don't have a command line, ps shows them in brackets
+		outRecord.commandLine = std::format("[{}]", outRecord.command);
+		return;
+	}
+
+	outRecord.commandLine = rawCommandLine;
+	// arguments are separated by zeroes, and control characters would break the report layout
+	for (char& c : outRecord.commandLine)
+	{
+		if (c == '\0')
+		{
+			c = ' ';
+		}
+		else if (static_cast<unsigned char>(c) < 0x20)
+		{
+			c = '?';
+		}
+	}
+}
+
+// fills the I/O fields from /proc/[pid]/io
+void parseProcessIo(std::string_view text, ProcessRecord& outRecord) noexcept
+{
+	// "cancelled_write_bytes:" comes after and also ends with "write_bytes:"
+	const size_t readPosition = text.find("\nread_bytes:");
+	const size_t writePosition = text.find("\nwrite_bytes:");
+	if (readPosition != std::string_view::npos && writePosition != std::string_view::npos)
+	{
+		size_t position = readPosition + 12;
+		outRecord.ioReadBytes = parseUnsigned(text, position);
+		position = writePosition + 13;
+		outRecord.ioWriteBytes = parseUnsigned(text, position);
+	}
+}
+
+// sets the cgroup from /proc/[pid]/cgroup, the lines are "hierarchy-ID:controllers:path" and cgroup v2 is "0::path"
+void setProcessCgroup(std::string_view text, ProcessRecord& outRecord)
+{
+	outRecord.cgroup.clear();
+	for (size_t lineStart = 0; lineStart < text.size();)
+	{
+		const size_t lineEnd = std::min(text.find('\n', lineStart), text.size());
+		const std::string_view line = text.substr(lineStart, lineEnd - lineStart);
+		lineStart = lineEnd + 1;
+
+		const size_t firstColon = line.find(':');
+		const size_t secondColon = (firstColon == std::string_view::npos) ? std::string_view::npos : line.find(':', firstColon + 1);
+		if (secondColon == std::string_view::npos)
+		{
+			continue;
+		}
+		if (outRecord.cgroup.empty() || line.starts_with("0::"))
+		{
+			outRecord.cgroup = line.substr(secondColon + 1);
+		}
+		if (line.starts_with("0::"))
+		{
+			return;
+		}
+	}
+}
+
+bool readProcessRecord(int procDirFd, const char* pidString, ProcessReadOptions options, std::string& buffer, ProcessRecord& outRecord) noexcept
+{
+	const int processDirFd = openat(procDirFd, pidString, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (processDirFd < 0)
+	{
+		return false;
+	}
+
+	// the owner of the /proc/[pid] directory is the effective uid of the process
+	struct stat dirStat;
+	const bool hasStat = fstat(processDirFd, &dirStat) == 0;
+
+	if (!hasStat || !readSmallFile(processDirFd, "stat", buffer) || !parseProcessStat(buffer, outRecord))
+	{
+		close(processDirFd);
+		return false;
+	}
+	outRecord.uid = dirStat.st_uid;
+
+	setProcessCommandLine(readSmallFile(processDirFd, "cmdline", buffer) ? std::string_view(buffer) : std::string_view(), outRecord);
+
+	outRecord.ioReadBytes = 0;
+	outRecord.ioWriteBytes = 0;
+	// not readable for other users' processes without root, these are reported as zero
+	if (options.shouldReadIo && readSmallFile(processDirFd, "io", buffer))
+	{
+		parseProcessIo(buffer, outRecord);
+	}
+
+	setProcessCgroup((options.shouldReadCgroup && readSmallFile(processDirFd, "cgroup", buffer)) ? std::string_view(buffer) : std::string_view(), outRecord);
+
+	close(processDirFd);
+	return true;
+}
+
+// set by the first reader that finds that io_uring can't open files, the readers of later snapshots and other threads don't try again
+std::atomic<bool> gIsIoRingOpenUnsupported = false;
+
+// reads the records of many processes, the opens, reads and closes of a batch of processes go through io_uring
+// with a few syscalls for the whole batch, and through plain syscalls if io_uring is not available
+// setting up the ring costs a few syscalls and mmaps, so there is one reader per thread, see getThreadProcessBatchReader()
+class ProcessBatchReader
+{
+public:
+	ProcessBatchReader() noexcept
+		: mRing(RingEntryCount)
+		, mSlots(BatchSize)
+	{
+	}
+
+	ProcessBatchReader(const ProcessBatchReader&) = delete;
+	ProcessBatchReader& operator=(const ProcessBatchReader&) = delete;
+
+	// appends the records of the processes that could be read
+	void read(int procDirFd, ProcessReadOptions options, std::span<const pid_t> pids, std::vector<ProcessRecord>& outRecords)
+	{
+		mProcDirFd = procDirFd;
+		mOptions = options;
+		for (size_t batchStart = 0; batchStart < pids.size(); batchStart += BatchSize)
+		{
+			const std::span<const pid_t> batch = pids.subspan(batchStart, std::min(BatchSize, pids.size() - batchStart));
+			for (size_t i = 0; i < batch.size(); ++i)
+			{
+				*std::to_chars(mSlots[i].pidString.data(), mSlots[i].pidString.data() + mSlots[i].pidString.size() - 1, batch[i]).ptr = '\0';
+			}
+
+			if (!mRing.isValid() || gIsIoRingOpenUnsupported.load(std::memory_order_relaxed) || !readBatchWithRing(batch.size(), outRecords))
+			{
+				readBatchWithSyscalls(batch.size(), outRecords);
+			}
+		}
+	}
+
+private:
+	static constexpr size_t BatchSize = 64;
+
+	enum FileKind : size_t
+	{
+		StatFile,
+		CommandLineFile,
+		IoFile,
+		CgroupFile,
+		FileKindCount,
+	};
+	static constexpr std::array<std::string_view, FileKindCount> FileNames{"stat", "cmdline", "io", "cgroup"};
+
+	// the owner of the /proc/[pid] directory and the opening of every file take one entry each, the kernel wants a power of two
+	static constexpr unsigned RingEntryCount = std::bit_ceil(unsigned(BatchSize * (1 + FileKindCount)));
+
+	struct Slot
+	{
+		std::array<char, 16> pidString;
+		std::array<std::array<char, 32>, FileKindCount> paths;
+		struct statx dirStat;
+		bool hasDirStat = false;
+		std::array<int, FileKindCount> fds;
+		std::array<int, FileKindCount> sizes;
+		// long command lines are cut here and the rest is read separately
+		std::array<char, 1024> statText;
+		std::array<char, 4096> commandLineText;
+		std::array<char, 1024> ioText;
+		std::array<char, 1024> cgroupText;
+
+		std::span<char> getBuffer(size_t kind) noexcept
+		{
+			switch (kind)
+			{
+			case StatFile:
+				return statText;
+			case CommandLineFile:
+				return commandLineText;
+			case IoFile:
+				return ioText;
+			default:
+				return cgroupText;
+			}
+		}
+	};
+
+	static uint64_t getUserData(size_t slotIndex, size_t kind) noexcept
+	{
+		return uint64_t(slotIndex) * (FileKindCount + 1) + kind;
+	}
+
+	bool isFileRead(size_t kind) const noexcept
+	{
+		return (kind != IoFile || mOptions.shouldReadIo) && (kind != CgroupFile || mOptions.shouldReadCgroup);
+	}
+
+	// returns false if the batch has to be read without the ring, the slots are cleaned up in that case
+	bool readBatchWithRing(size_t slotCount, std::vector<ProcessRecord>& outRecords)
+	{
+		// an old kernel doesn't know the newer opcodes and fails them with EINVAL
+		bool isSupported = true;
+		auto onCompletion = [this, &isSupported](uint64_t userData, int result) {
+			Slot& slot = mSlots[userData / (FileKindCount + 1)];
+			const size_t kind = userData % (FileKindCount + 1);
+			isSupported = isSupported && result != -EINVAL;
+			if (kind == FileKindCount)
+			{
+				slot.hasDirStat = result == 0;
+			}
+			else if (slot.fds[kind] < 0)
+			{
+				slot.fds[kind] = result;
+			}
+			else
+			{
+				slot.sizes[kind] = result;
+			}
+		};
+
+		for (size_t i = 0; i < slotCount; ++i)
+		{
+			Slot& slot = mSlots[i];
+			slot.hasDirStat = false;
+			slot.fds.fill(-1);
+			slot.sizes.fill(-1);
+			mRing.addEntry(IORING_OP_STATX, mProcDirFd, slot.pidString.data(), STATX_UID, reinterpret_cast<uint64_t>(&slot.dirStat), getUserData(i, FileKindCount));
+			for (size_t kind = 0; kind < FileKindCount; ++kind)
+			{
+				if (!isFileRead(kind))
+				{
+					continue;
+				}
+				*std::format_to_n(slot.paths[kind].data(), slot.paths[kind].size() - 1, "{}/{}", slot.pidString.data(), FileNames[kind]).out = '\0';
+				mRing.addEntry(IORING_OP_OPENAT, mProcDirFd, slot.paths[kind].data(), 0, 0, getUserData(i, kind)).open_flags = O_RDONLY | O_CLOEXEC;
+			}
+		}
+		bool isRingWorking = mRing.submitAndWait(onCompletion);
+
+		if (isRingWorking && isSupported)
+		{
+			for (size_t i = 0; i < slotCount; ++i)
+			{
+				Slot& slot = mSlots[i];
+				for (size_t kind = 0; kind < FileKindCount; ++kind)
+				{
+					if (slot.fds[kind] >= 0)
+					{
+						const std::span<char> buffer = slot.getBuffer(kind);
+						mRing.addEntry(IORING_OP_READ, slot.fds[kind], buffer.data(), uint32_t(buffer.size()), 0, getUserData(i, kind));
+					}
+				}
+			}
+			isRingWorking = mRing.submitAndWait(onCompletion);
+		}
+
+		for (size_t i = 0; i < slotCount; ++i)
+		{
+			Slot& slot = mSlots[i];
+			// the command line didn't fit, the rest is read while the file is still open
+			const std::span<char> commandLineBuffer = slot.getBuffer(CommandLineFile);
+			mLongCommandLine.clear();
+			if (isRingWorking && isSupported && slot.sizes[CommandLineFile] == int(commandLineBuffer.size()))
+			{
+				mLongCommandLine.assign(commandLineBuffer.data(), commandLineBuffer.size());
+				std::array<char, 4096> chunk;
+				ssize_t bytesRead = 0;
+				while ((bytesRead = pread(slot.fds[CommandLineFile], chunk.data(), chunk.size(), off_t(mLongCommandLine.size()))) > 0)
+				{
+					mLongCommandLine.append(chunk.data(), size_t(bytesRead));
+				}
+			}
+
+			for (size_t kind = 0; kind < FileKindCount; ++kind)
+			{
+				if (slot.fds[kind] < 0)
+				{
+					continue;
+				}
+				if (isRingWorking)
+				{
+					mRing.addEntry(IORING_OP_CLOSE, slot.fds[kind], nullptr, 0, 0, getUserData(i, kind));
+				}
+				else
+				{
+					close(slot.fds[kind]);
+				}
+			}
+
+			if (isRingWorking && isSupported)
+			{
+				appendRecord(slot, outRecords);
+			}
+		}
+		if (isRingWorking)
+		{
+			// the close results are not needed, the files are only read
+			isRingWorking = mRing.submitAndWait([](uint64_t, int) {});
+		}
+
+		if (!isSupported && mRing.isValid())
+		{
+			if (!gIsIoRingOpenUnsupported.exchange(true, std::memory_order_relaxed))
+			{
+				fprintf(stderr, "io_uring doesn't support opening files on this kernel, /proc is read with plain syscalls\n");
+			}
+			mRing.reset();
+		}
+		return isRingWorking && isSupported;
+	}
+
+	void appendRecord(const Slot& slot, std::vector<ProcessRecord>& outRecords)
+	{
+		// the process can exit at any moment, so failing to read it is normal
+		if (!slot.hasDirStat || slot.sizes[StatFile] <= 0)
+		{
+			return;
+		}
+
+		ProcessRecord& record = outRecords.emplace_back();
+		if (!parseProcessStat(std::string_view(slot.statText.data(), size_t(slot.sizes[StatFile])), record))
+		{
+			outRecords.pop_back();
+			return;
+		}
+		record.uid = slot.dirStat.stx_uid;
+
+		const std::string_view commandLine = !mLongCommandLine.empty() ? std::string_view(mLongCommandLine)
+			: std::string_view(slot.commandLineText.data(), size_t(std::max(slot.sizes[CommandLineFile], 0)));
+		setProcessCommandLine(commandLine, record);
+
+		// not readable for other users' processes without root, these are reported as zero
+		if (mOptions.shouldReadIo && slot.sizes[IoFile] > 0)
+		{
+			parseProcessIo(std::string_view(slot.ioText.data(), size_t(slot.sizes[IoFile])), record);
+		}
+		setProcessCgroup(std::string_view(slot.cgroupText.data(), size_t(std::max(slot.sizes[CgroupFile], 0))), record);
+	}
+
+	void readBatchWithSyscalls(size_t slotCount, std::vector<ProcessRecord>& outRecords)
+	{
+		ProcessRecord record;
+		for (size_t i = 0; i < slotCount; ++i)
+		{
+			if (readProcessRecord(mProcDirFd, mSlots[i].pidString.data(), mOptions, mBuffer, record))
+			{
+				outRecords.push_back(std::move(record));
+			}
+		}
+	}
+
+private:
+	int mProcDirFd = -1;
+	ProcessReadOptions mOptions;
+	IoRing mRing;
+	// too big for the stack of a thread
+	std::vector<Slot> mSlots;
+	std::string mLongCommandLine;
+	std::string mBuffer;
+};
+
+ProcessBatchReader& getThreadProcessBatchReader()
+{
+	thread_local ProcessBatchReader reader;
+	return reader;
+}
+
+// the threads that read the ranges of a snapshot after the first one
+// they live as long as the process, so each one keeps its ring between snapshots
+class ProcessReadThreads
+{
+public:
+	ProcessReadThreads() = default;
+
+	~ProcessReadThreads()
+	{
+		{
+			std::lock_guard lock(mMutex);
+			mIsStopping = true;
+		}
+		mJobStarted.notify_all();
+		for (std::thread& thread : mThreads)
+		{
+			thread.join();
+		}
+	}
+
+	ProcessReadThreads(const ProcessReadThreads&) = delete;
+	ProcessReadThreads& operator=(const ProcessReadThreads&) = delete;
+
+	// thread i reads ranges[i] into outRecords[i], both have to stay alive until wait() returns
+	void start(int procDirFd, ProcessReadOptions options, std::span<const std::span<const pid_t>> ranges, std::span<std::vector<ProcessRecord>> outRecords)
+	{
+		if (ranges.empty())
+		{
+			return;
+		}
+		// no job is running, so the job index doesn't change while the new threads start
+		while (mThreads.size() < ranges.size())
+		{
+			mThreads.emplace_back([this, threadIndex = mThreads.size(), jobIndex = mJobIndex]() { run(threadIndex, jobIndex); });
+		}
+
+		{
+			std::lock_guard lock(mMutex);
+			mProcDirFd = procDirFd;
+			mOptions = options;
+			mRanges = ranges;
+			mOutRecords = outRecords;
+			mPendingCount = ranges.size();
+			++mJobIndex;
+		}
+		mJobStarted.notify_all();
+	}
+
+	void wait()
+	{
+		std::unique_lock lock(mMutex);
+		mJobFinished.wait(lock, [this]() { return mPendingCount == 0; });
+	}
+
+private:
+	void run(size_t threadIndex, uint64_t jobIndex)
+	{
+		std::unique_lock lock(mMutex);
+		while (true)
+		{
+			mJobStarted.wait(lock, [this, jobIndex]() { return mIsStopping || mJobIndex != jobIndex; });
+			if (mIsStopping)
+			{
+				return;
+			}
+			// a job can't start before all the threads it needs finished the previous one, so none is missed
+			jobIndex = mJobIndex;
+			if (threadIndex >= mRanges.size())
+			{
+				continue;
+			}
+
+			const int procDirFd = mProcDirFd;
+			const ProcessReadOptions options = mOptions;
+			const std::span<const pid_t> range = mRanges[threadIndex];
+			std::vector<ProcessRecord>& records = mOutRecords[threadIndex];
+			lock.unlock();
+			getThreadProcessBatchReader().read(procDirFd, options, range, records);
+			lock.lock();
+			if (--mPendingCount == 0)
+			{
+				mJobFinished.notify_one();
+			}
+		}
+	}
+
+private:
+	std::vector<std::thread> mThreads;
+	std::mutex mMutex;
+	std::condition_variable mJobStarted;
+	std::condition_variable mJobFinished;
+	uint64_t mJobIndex = 0;
+	size_t mPendingCount = 0;
+	bool mIsStopping = false;
+	int mProcDirFd = -1;
+	ProcessReadOptions mOptions;
+	std::span<const std::span<const pid_t>> mRanges;
+	std::span<std::vector<ProcessRecord>> mOutRecords;
+};
+
+uint64_t readMemoryTotalKb(std::string& buffer) noexcept
+{
+	if (!readSmallFile(AT_FDCWD, "/proc/meminfo", buffer))
+	{
+		return 0;
+	}
+
+	const size_t keyPosition = buffer.find("MemTotal:");
+	if (keyPosition == std::string::npos)
+	{
+		return 0;
+	}
+	size_t position = keyPosition + 9;
+	return parseUnsigned(buffer, position);
+}
+
+// fills everything except the processes
+void collectSnapshotSystemInfo(ProcessSnapshot& outSnapshot, ProcessReadOptions options, std::string& buffer)
+{
+	outSnapshot.time = std::chrono::system_clock::now();
+	outSnapshot.clockTicksPerSec = sysconf(_SC_CLK_TCK);
+	outSnapshot.hasIoStats = options.shouldReadIo;
+	outSnapshot.hasCgroups = options.shouldReadCgroup;
+	outSnapshot.memoryTotalKb = readMemoryTotalKb(buffer);
+	outSnapshot.uptimeSec = readSmallFile(AT_FDCWD, "/proc/uptime", buffer) ? std::strtod(buffer.c_str(), nullptr) : 0.0;
+}
+
+void collectProcessSnapshot(ProcessSnapshot& outSnapshot, ProcessReadOptions options)
+{
+	TraceSpan span("collectProcessSnapshot");
+	std::string buffer;
+	buffer.reserve(4096);
+	collectSnapshotSystemInfo(outSnapshot, options, buffer);
+
+	outSnapshot.processes.clear();
+	DIR* procDir = opendir("/proc");
+	if (procDir == nullptr)
+	{
+		fprintf(stderr, "Could not open /proc\n");
+		return;
+	}
+
+	const int procDirFd = dirfd(procDir);
+	std::vector<pid_t> pids;
+	while (const dirent* entry = readdir(procDir))
+	{
+		if (entry->d_name[0] >= '0' && entry->d_name[0] <= '9')
+		{
+			pids.push_back(pid_t(std::strtol(entry->d_name, nullptr, 10)));
+		}
+	}
+
+	// the first range is read on this thread, the others on the read threads and appended in order
+	// the read threads don't record trace spans
+	static constexpr size_t MinProcessesPerThread = 1024;
+	static constexpr size_t MaxThreadCount = 8;
+	const size_t threadCount = std::clamp<size_t>(pids.size() / MinProcessesPerThread, 1, std::min<size_t>(std::max(std::thread::hardware_concurrency(), 1u), MaxThreadCount));
+	const size_t processesPerThread = (pids.size() + threadCount - 1) / threadCount;
+	auto getRange = [&pids, processesPerThread](size_t threadIndex) {
+		const size_t rangeStart = std::min(threadIndex * processesPerThread, pids.size());
+		return std::span<const pid_t>(pids).subspan(rangeStart, std::min(processesPerThread, pids.size() - rangeStart));
+	};
+
+	std::vector<std::span<const pid_t>> threadRanges;
+	for (size_t i = 1; i < threadCount; ++i)
+	{
+		threadRanges.push_back(getRange(i));
+	}
+	std::vector<std::vector<ProcessRecord>> threadRecords(threadRanges.size());
+	// only used from the checking thread
+	static ProcessReadThreads readThreads;
+	readThreads.start(procDirFd, options, threadRanges, threadRecords);
+	getThreadProcessBatchReader().read(procDirFd, options, getRange(0), outSnapshot.processes);
+	readThreads.wait();
+
+	for (std::vector<ProcessRecord>& records : threadRecords)
+	{
+		std::ranges::move(records, std::back_inserter(outSnapshot.processes));
+	}
+
+	closedir(procDir);
+}
+
+// keeps /proc/[pid]/stat open for the processes that are sampled over and over, so a new sample is a single pread
+// when the cache is full the descriptor read the longest time ago is closed
+class ProcessStatCache
+{
+public:
+	ProcessStatCache(int procDirFd, size_t capacity) noexcept
+		: mProcDirFd(procDirFd)
+		, mCapacity(capacity)
+	{
+		// raise the soft descriptor limit if the cache needs it, a few hundred are left for the rest of the app
+		static constexpr rlim_t ReservedFdCount = 256;
+		rlimit fileLimit;
+		if (getrlimit(RLIMIT_NOFILE, &fileLimit) != 0)
+		{
+			return;
+		}
+		if (fileLimit.rlim_cur < rlim_t(mCapacity) + ReservedFdCount && fileLimit.rlim_cur < fileLimit.rlim_max)
+		{
+			const rlim_t currentLimit = fileLimit.rlim_cur;
+			fileLimit.rlim_cur = std::min(fileLimit.rlim_max, rlim_t(mCapacity) + ReservedFdCount);
+			if (setrlimit(RLIMIT_NOFILE, &fileLimit) != 0)
+			{
+				fileLimit.rlim_cur = currentLimit;
+			}
+		}
+		mCapacity = std::min(mCapacity, size_t(fileLimit.rlim_cur > ReservedFdCount ? fileLimit.rlim_cur - ReservedFdCount : 0));
+	}
+
+	~ProcessStatCache() noexcept
+	{
+		for (const auto& [pid, slotIndex] : mSlotIndices)
+		{
+			close(mSlots[slotIndex].fd);
+		}
+	}
+
+	ProcessStatCache(const ProcessStatCache&) = delete;
+	ProcessStatCache& operator=(const ProcessStatCache&) = delete;
+
+	// only the processes read with shouldKeepOpen get a descriptor in the cache, the others are opened for every read,
+	// so a full pass over all the processes doesn't evict the ones that are sampled often
+	bool read(pid_t pid, bool shouldKeepOpen, ProcessRecord& outRecord)
+	{
+		if (const auto it = mSlotIndices.find(pid); it != mSlotIndices.end())
+		{
+			const SlotIndex slotIndex = it->second;
+			// stat is generated on every read, so reading from the start of the same descriptor gives the current values
+			const ssize_t size = pread(mSlots[slotIndex].fd, mStatText.data(), mStatText.size(), 0);
+			if (size > 0 && parseProcessStat(std::string_view(mStatText.data(), size_t(size)), outRecord))
+			{
+				if (shouldKeepOpen)
+				{
+					unlink(slotIndex);
+					linkFront(slotIndex);
+				}
+				else
+				{
+					remove(pid);
+				}
+				return true;
+			}
+
+			// the descriptor stays bound to the process it was opened for, a new process with the same pid needs a new one
+			remove(pid);
+		}
+
+		std::array<char, 32> path;
+		*std::format_to_n(path.data(), path.size() - 1, "{}/stat", pid).out = '\0';
+		const int fd = openat(mProcDirFd, path.data(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+		{
+			return false;
+		}
+		const ssize_t size = pread(fd, mStatText.data(), mStatText.size(), 0);
+		if (size <= 0 || !parseProcessStat(std::string_view(mStatText.data(), size_t(size)), outRecord))
+		{
+			close(fd);
+			return false;
+		}
+
+		if (!shouldKeepOpen || mCapacity == 0)
+		{
+			close(fd);
+			return true;
+		}
+		if (mSlotIndices.size() >= mCapacity)
+		{
+			remove(mSlots[mTail].pid);
+		}
+		insert(pid, fd);
+		return true;
+	}
+
+	void remove(pid_t pid) noexcept
+	{
+		const auto it = mSlotIndices.find(pid);
+		if (it == mSlotIndices.end())
+		{
+			return;
+		}
+
+		const SlotIndex slotIndex = it->second;
+		mSlotIndices.erase(it);
+		close(mSlots[slotIndex].fd);
+		unlink(slotIndex);
+		mSlots[slotIndex].next = mFreeSlots;
+		mFreeSlots = slotIndex;
+	}
+
+private:
+	using SlotIndex = uint32_t;
+	static constexpr SlotIndex InvalidSlot = std::numeric_limits<SlotIndex>::max();
+
+	// slots are linked from the most recently read to the least recently read
+	struct Slot
+	{
+		pid_t pid = 0;
+		int fd = -1;
+		SlotIndex previous = InvalidSlot;
+		SlotIndex next = InvalidSlot;
+	};
+
+	void insert(pid_t pid, int fd)
+	{
+		SlotIndex slotIndex = mFreeSlots;
+		if (slotIndex != InvalidSlot)
+		{
+			mFreeSlots = mSlots[slotIndex].next;
+		}
+		else
+		{
+			slotIndex = SlotIndex(mSlots.size());
+			mSlots.emplace_back();
+		}
+
+		Slot& slot = mSlots[slotIndex];
+		slot.pid = pid;
+		slot.fd = fd;
+		linkFront(slotIndex);
+		mSlotIndices.emplace(pid, slotIndex);
+	}
+
+	void linkFront(SlotIndex slotIndex) noexcept
+	{
+		Slot& slot = mSlots[slotIndex];
+		slot.previous = InvalidSlot;
+		slot.next = mHead;
+		if (mHead != InvalidSlot)
+		{
+			mSlots[mHead].previous = slotIndex;
+		}
+		mHead = slotIndex;
+		if (mTail == InvalidSlot)
+		{
+			mTail = slotIndex;
+		}
+	}
+
+	void unlink(SlotIndex slotIndex) noexcept
+	{
+		Slot& slot = mSlots[slotIndex];
+		(slot.previous != InvalidSlot ? mSlots[slot.previous].next : mHead) = slot.next;
+		(slot.next != InvalidSlot ? mSlots[slot.next].previous : mTail) = slot.previous;
+	}
+
+private:
+	const int mProcDirFd;
+	size_t mCapacity;
+	std::vector<Slot> mSlots;
+	std::unordered_map<pid_t, SlotIndex> mSlotIndices;
+	SlotIndex mHead = InvalidSlot;
+	SlotIndex mTail = InvalidSlot;
+	SlotIndex mFreeSlots = InvalidSlot;
+	std::array<char, 1024> mStatText;
+};
+
+// keeps the list of processes up to date from the fork, exec and exit events of the kernel proc connector,
+// so a snapshot doesn't list /proc, the top consumers and the watched processes keep their stat file open
+// needs CAP_NET_ADMIN, /proc is still listed from time to time in case some events were lost
+class ProcessEventTable
+{
+public:
+	ProcessEventTable(std::chrono::seconds fullRescanInterval, size_t statCacheSize) noexcept
+		: mFullRescanInterval(fullRescanInterval)
+		, mProcDirFd(open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC))
+		, mStatCache(mProcDirFd, statCacheSize)
+	{
+		mSocketFd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+		if (mProcDirFd < 0 || mSocketFd < 0 || !subscribe())
+		{
+			fprintf(stderr, "Could not subscribe to the process events of the kernel, /proc is listed for every report\n");
+			if (mSocketFd >= 0)
+			{
+				close(mSocketFd);
+				mSocketFd = -1;
+			}
+		}
+	}
+
+	~ProcessEventTable() noexcept
+	{
+		if (mSocketFd >= 0)
+		{
+			close(mSocketFd);
+		}
+		if (mProcDirFd >= 0)
+		{
+			close(mProcDirFd);
+		}
+	}
+
+	ProcessEventTable(const ProcessEventTable&) = delete;
+	ProcessEventTable& operator=(const ProcessEventTable&) = delete;
+
+	bool isValid() const noexcept { return mSocketFd >= 0; }
+	int getFd() const noexcept { return mSocketFd; }
+
+	// applies the events received so far without blocking
+	// needs to be called often enough for the socket buffer to not overflow, otherwise the next snapshot lists /proc
+	void processEvents() noexcept
+	{
+		alignas(nlmsghdr) std::array<char, 8 * 1024> buffer;
+		while (true)
+		{
+			const ssize_t bytesRead = recv(mSocketFd, buffer.data(), buffer.size(), 0);
+			if (bytesRead < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			if (bytesRead < 0 && errno == ENOBUFS)
+			{
+				// the kernel dropped some events, there is no way to know which ones
+				mIsFullRescanNeeded = true;
+				continue;
+			}
+			if (bytesRead <= 0)
+			{
+				return;
+			}
+
+			int remainingSize = int(bytesRead);
+			for (const nlmsghdr* header = reinterpret_cast<const nlmsghdr*>(buffer.data()); NLMSG_OK(header, remainingSize); header = NLMSG_NEXT(header, remainingSize))
+			{
+				const cn_msg* message = static_cast<const cn_msg*>(NLMSG_DATA(header));
+				if (message->id.idx == CN_IDX_PROC && message->id.val == CN_VAL_PROC && message->len >= sizeof(proc_event))
+				{
+					applyEvent(*reinterpret_cast<const proc_event*>(message->data));
+				}
+			}
+		}
+	}
+
+	void collect(ProcessSnapshot& outSnapshot, ProcessReadOptions options)
+	{
+		TraceSpan span("collectProcessTable");
+		collectSnapshotSystemInfo(outSnapshot, options, mBuffer);
+		processEvents();
+
+		const auto timeNow = std::chrono::steady_clock::now();
+		if (mIsFullRescanNeeded || timeNow >= mNextFullRescanTime)
+		{
+			rescan();
+			mIsFullRescanNeeded = false;
+			mNextFullRescanTime = timeNow + mFullRescanInterval;
+		}
+
+		outSnapshot.processes.clear();
+		outSnapshot.processes.reserve(mEntries.size());
+		mReadEntries.clear();
+		for (auto it = mEntries.begin(); it != mEntries.end();)
+		{
+			ProcessRecord& record = outSnapshot.processes.emplace_back();
+			if (readEntry(it->first, it->second, options, record))
+			{
+				mReadEntries.push_back(&it->second);
+				++it;
+				continue;
+			}
+
+			// exited and the event is not processed yet
+			outSnapshot.processes.pop_back();
+			mStatCache.remove(it->first);
+			it = mEntries.erase(it);
+		}
+		updateTopConsumers(outSnapshot);
+		// same order as listing /proc gives
+		std::ranges::sort(outSnapshot.processes, std::less<>(), &ProcessRecord::pid);
+	}
+
+	// a watched process is sampled on every check, so its stat file is kept open
+	void setWatched(pid_t pid, bool isWatched) noexcept
+	{
+		if (const auto it = mEntries.find(pid); it != mEntries.end())
+		{
+			it->second.isWatched = isWatched;
+		}
+	}
+
+private:
+	struct Entry
+	{
+		// tells a reused pid apart from the process seen before, zero until the first read
+		uint64_t startTimeTicks = 0;
+		uid_t uid = 0;
+		// new processes, and processes after exec or setuid, have their user and command line read again
+		bool isInfoStale = true;
+		bool isTopConsumer = false;
+		bool isWatched = false;
+		// the full rescan that saw the process last
+		uint32_t rescanIndex = 0;
+		std::string commandLine;
+	};
+
+	bool subscribe() noexcept
+	{
+		sockaddr_nl address{};
+		address.nl_family = AF_NETLINK;
+		address.nl_groups = CN_IDX_PROC;
+		if (bind(mSocketFd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0)
+		{
+			return false;
+		}
+
+		// room for a burst of forks between two checks, going over rmem_max only works with CAP_NET_ADMIN
+		const int receiveBufferSize = 4 * 1024 * 1024;
+		if (setsockopt(mSocketFd, SOL_SOCKET, SO_RCVBUFFORCE, &receiveBufferSize, sizeof(receiveBufferSize)) < 0)
+		{
+			setsockopt(mSocketFd, SOL_SOCKET, SO_RCVBUF, &receiveBufferSize, sizeof(receiveBufferSize));
+		}
+
+		// cn_msg ends with the payload, so the message is put together in a buffer
+		alignas(nlmsghdr) std::array<char, NLMSG_SPACE(sizeof(cn_msg) + sizeof(proc_cn_mcast_op))> message{};
+		nlmsghdr* header = reinterpret_cast<nlmsghdr*>(message.data());
+		header->nlmsg_len = NLMSG_LENGTH(sizeof(cn_msg) + sizeof(proc_cn_mcast_op));
+		header->nlmsg_type = NLMSG_DONE;
+		cn_msg* connectorHeader = static_cast<cn_msg*>(NLMSG_DATA(header));
+		connectorHeader->id.idx = CN_IDX_PROC;
+		connectorHeader->id.val = CN_VAL_PROC;
+		connectorHeader->len = sizeof(proc_cn_mcast_op);
+		const proc_cn_mcast_op operation = PROC_CN_MCAST_LISTEN;
+		std::memcpy(connectorHeader->data, &operation, sizeof(operation));
+
+		sockaddr_nl kernelAddress{};
+		kernelAddress.nl_family = AF_NETLINK;
+		return sendto(mSocketFd, message.data(), header->nlmsg_len, 0, reinterpret_cast<const sockaddr*>(&kernelAddress), sizeof(kernelAddress)) >= 0;
+	}
+
+	void applyEvent(const proc_event& event)
+	{
+		switch (event.what)
+		{
+		case proc_event::PROC_EVENT_FORK:
+			// new threads are reported as forks too
+			if (event.event_data.fork.child_pid == event.event_data.fork.child_tgid)
+			{
+				mEntries[event.event_data.fork.child_tgid].isInfoStale = true;
+			}
+			break;
+		case proc_event::PROC_EVENT_EXEC:
+			mEntries[event.event_data.exec.process_tgid].isInfoStale = true;
+			break;
+		case proc_event::PROC_EVENT_UID:
+			mEntries[event.event_data.id.process_tgid].isInfoStale = true;
+			break;
+		case proc_event::PROC_EVENT_EXIT:
+			if (event.event_data.exit.process_pid == event.event_data.exit.process_tgid)
+			{
+				mEntries.erase(event.event_data.exit.process_tgid);
+				mStatCache.remove(event.event_data.exit.process_tgid);
+			}
+			break;
+		default:
+			break;
+		}
+	}
+
+	// lists /proc to add the processes started before the subscription or whose events were lost, and to drop the ones that are gone
+	void rescan()
+	{
+		TraceSpan span("rescanProcesses");
+		DIR* procDir = opendir("/proc");
+		if (procDir == nullptr)
+		{
+			fprintf(stderr, "Could not open /proc\n");
+			return;
+		}
+
+		++mRescanIndex;
+		while (const dirent* entry = readdir(procDir))
+		{
+			if (entry->d_name[0] >= '0' && entry->d_name[0] <= '9')
+			{
+				mEntries[pid_t(std::strtol(entry->d_name, nullptr, 10))].rescanIndex = mRescanIndex;
+			}
+		}
+		closedir(procDir);
+
+		// the events are not processed during the listing, so everything that is not listed is gone
+		for (auto it = mEntries.begin(); it != mEntries.end();)
+		{
+			if (it->second.rescanIndex == mRescanIndex)
+			{
+				++it;
+				continue;
+			}
+			mStatCache.remove(it->first);
+			it = mEntries.erase(it);
+		}
+	}
+
+	bool readEntry(pid_t pid, Entry& entry, ProcessReadOptions options, ProcessRecord& outRecord)
+	{
+		if (!mStatCache.read(pid, entry.isTopConsumer || entry.isWatched, outRecord))
+		{
+			return false;
+		}
+		// covers the pids reused while the events were lost
+		if (entry.startTimeTicks != outRecord.startTimeTicks)
+		{
+			entry.startTimeTicks = outRecord.startTimeTicks;
+			entry.isInfoStale = true;
+		}
+
+		std::array<char, 32> path;
+		auto setPath = [&path, pid](std::string_view fileName) {
+			*std::format_to_n(path.data(), path.size() - 1, "{}/{}", pid, fileName).out = '\0';
+			return path.data();
+		};
+
+		if (entry.isInfoStale)
+		{
+			// the owner of the /proc/[pid] directory is the effective uid of the process
+			struct stat dirStat;
+			*std::to_chars(path.data(), path.data() + path.size() - 1, pid).ptr = '\0';
+			if (fstatat(mProcDirFd, path.data(), &dirStat, 0) != 0)
+			{
+				return false;
+			}
+			entry.uid = dirStat.st_uid;
+			const bool hasCommandLine = readSmallFile(mProcDirFd, setPath("cmdline"), mBuffer) && mBuffer.find_first_not_of('\0') != std::string::npos;
+			setProcessCommandLine(hasCommandLine ? std::string_view(mBuffer) : std::string_view(), outRecord);
+			entry.commandLine = hasCommandLine ? outRecord.commandLine : std::string();
+			entry.isInfoStale = false;
+		}
+		else if (entry.commandLine.empty())
+		{
+			// kernel threads are shown by their command, which can change without any event
+			setProcessCommandLine(std::string_view(), outRecord);
+		}
+		else
+		{
+			outRecord.commandLine = entry.commandLine;
+		}
+		outRecord.uid = entry.uid;
+
+		// not readable for other users' processes without root, these are reported as zero
+		if (options.shouldReadIo && readSmallFile(mProcDirFd, setPath("io"), mBuffer))
+		{
+			parseProcessIo(mBuffer, outRecord);
+		}
+		// a process can be moved to another cgroup without any event, so it is not cached
+		if (options.shouldReadCgroup && readSmallFile(mProcDirFd, setPath("cgroup"), mBuffer))
+		{
+			setProcessCgroup(mBuffer, outRecord);
+		}
+		return true;
+	}
+
+	// the processes with the highest RSS and CPU of this pass are likely to be the top ones of the next pass too
+	void updateTopConsumers(const ProcessSnapshot& snapshot)
+	{
+		static constexpr size_t TopConsumerCount = 64;
+		const size_t topCount = std::min(TopConsumerCount, mReadEntries.size());
+		mRanking.resize(mReadEntries.size());
+		std::iota(mRanking.begin(), mRanking.end(), uint32_t(0));
+		for (Entry* entry : mReadEntries)
+		{
+			entry->isTopConsumer = false;
+		}
+
+		std::ranges::partial_sort(mRanking, mRanking.begin() + ptrdiff_t(topCount), [&snapshot](uint32_t a, uint32_t b) {
+			return snapshot.processes[a].residentMemoryKb > snapshot.processes[b].residentMemoryKb;
+		});
+		for (size_t i = 0; i < topCount; ++i)
+		{
+			mReadEntries[mRanking[i]]->isTopConsumer = true;
+		}
+		std::ranges::partial_sort(mRanking, mRanking.begin() + ptrdiff_t(topCount), [&snapshot](uint32_t a, uint32_t b) {
+			return getLifetimeCpuPct(snapshot, snapshot.processes[a]) > getLifetimeCpuPct(snapshot, snapshot.processes[b]);
+		});
+		for (size_t i = 0; i < topCount; ++i)
+		{
+			mReadEntries[mRanking[i]]->isTopConsumer = true;
+		}
+	}
+
+private:
+	const std::chrono::seconds mFullRescanInterval;
+	const int mProcDirFd;
+	int mSocketFd = -1;
+	ProcessStatCache mStatCache;
+	std::unordered_map<pid_t, Entry> mEntries;
+	uint32_t mRescanIndex = 0;
+	bool mIsFullRescanNeeded = true;
+	std::chrono::steady_clock::time_point mNextFullRescanTime;
+	std::string mBuffer;
+	// the entries of the processes in the snapshot being collected, in the same order, reused between passes
+	std::vector<Entry*> mReadEntries;
+	std::vector<uint32_t> mRanking;
+};
+
+// the value of a "Key:   123 kB" line of /proc/[pid]/smaps_rollup, the key includes the colon
+uint64_t findSmapsValueKb(std::string_view text, std::string_view key) noexcept
+{
+	// keys like "Pss_Dirty:" start the same as "Pss:", so match from the start of the line
+	for (size_t position = text.find(key); position != std::string_view::npos; position = text.find(key, position + 1))
+	{
+		if (position == 0 || text[position - 1] == '\n')
+		{
+			position += key.size();
+			return parseUnsigned(text, position);
+		}
+	}
+	return 0;
+}
+
+// RSS counts the shared pages fully in every process that maps them, so the processes with the highest RSS are
+// re-ranked by PSS and USS, reading smaps_rollup is slow (the kernel walks the page tables) so it's done on several threads
+void collectProportionalMemory(ProcessSnapshot& snapshot, size_t candidateCount)
+{
+	TraceSpan span("collectProportionalMemory");
+	snapshot.hasProportionalMemory = false;
+	candidateCount = std::min(candidateCount, snapshot.processes.size());
+	if (candidateCount == 0)
+	{
+		return;
+	}
+
+	std::vector<ProcessRecord*> candidates;
+	candidates.reserve(snapshot.processes.size());
+	for (ProcessRecord& process : snapshot.processes)
+	{
+		process.proportionalMemoryKb = 0;
+		process.uniqueMemoryKb = 0;
+		candidates.push_back(&process);
+	}
+	std::ranges::partial_sort(candidates, candidates.begin() + candidateCount, std::greater<>(), &ProcessRecord::residentMemoryKb);
+	candidates.resize(candidateCount);
+
+	const int procDirFd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (procDirFd < 0)
+	{
+		return;
+	}
+
+	std::atomic<size_t> nextCandidate = 0;
+	auto readCandidates = [&]() {
+		std::string buffer;
+		std::array<char, 32> path;
+		for (size_t i = nextCandidate++; i < candidates.size(); i = nextCandidate++)
+		{
+			ProcessRecord& process = *candidates[i];
+			*std::format_to_n(path.data(), path.size() - 1, "{}/smaps_rollup", process.pid).out = '\0';
+			// kernel threads have no memory map, and other users' processes need root
+			if (readSmallFile(procDirFd, path.data(), buffer))
+			{
+				process.proportionalMemoryKb = findSmapsValueKb(buffer, "Pss:");
+				process.uniqueMemoryKb = findSmapsValueKb(buffer, "Private_Clean:") + findSmapsValueKb(buffer, "Private_Dirty:") + findSmapsValueKb(buffer, "Private_Hugetlb:");
+			}
+		}
+	};
+
+	static constexpr size_t CandidatesPerThread = 8;
+	const size_t threadCount = std::min<size_t>({std::max(std::thread::hardware_concurrency(), 1u), 4, (candidateCount + CandidatesPerThread - 1) / CandidatesPerThread});
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < threadCount; ++i)
+	{
+		threads.emplace_back(readCandidates);
+	}
+	readCandidates();
+	for (std::thread& thread : threads)
+	{
+		thread.join();
+	}
+
+	close(procDirFd);
+	snapshot.hasProportionalMemory = true;
+}
+
+enum class ProcessSortKey
+{
+	Memory,
+	Cpu,
+};
+
+// caches uid to user name lookups for the duration of rendering one report
+class UserNameCache
+{
+public:
+	// used when the names come from a report and not from the local system
+	void addName(uid_t uid, std::string_view name)
+	{
+		for (const auto& [cachedUid, cachedName] : mNames)
+		{
+			if (cachedUid == uid)
+			{
+				return;
+			}
+		}
+		mNames.emplace_back(uid, name);
+	}
+
+	const std::string& getName(uid_t uid)
+	{
+		for (const auto& [cachedUid, name] : mNames)
+		{
+			if (cachedUid == uid)
+			{
+				return name;
+			}
+		}
+
+		std::array<char, 1024> buffer;
+		passwd entry;
+		passwd* result = nullptr;
+		if (getpwuid_r(uid, &entry, buffer.data(), buffer.size(), &result) == 0 && result != nullptr)
+		{
+			return mNames.emplace_back(uid, result->pw_name).second;
+		}
+		return mNames.emplace_back(uid, std::to_string(uid)).second;
+	}
+
+private:
+	// deque keeps returned references valid when new names are added
+	std::deque<std::pair<uid_t, std::string>> mNames;
+};
+
+void renderProcessTable(const ProcessSnapshot& snapshot, ProcessSortKey sortKey, UserNameCache& userNames, std::string& outReport)
+{
+	std::vector<const ProcessRecord*> sortedProcesses;
+	sortedProcesses.reserve(snapshot.processes.size());
+	for (const ProcessRecord& process : snapshot.processes)
+	{
+		sortedProcesses.push_back(&process);
+	}
+
+	if (sortKey == ProcessSortKey::Memory)
+	{
+		std::sort(sortedProcesses.begin(), sortedProcesses.end(), [](const ProcessRecord* a, const ProcessRecord* b) {
+			return a->residentMemoryKb > b->residentMemoryKb;
+		});
+	}
+	else
+	{
+		std::sort(sortedProcesses.begin(), sortedProcesses.end(), [&snapshot](const ProcessRecord* a, const ProcessRecord* b) {
+			return getLifetimeCpuPct(snapshot, *a) > getLifetimeCpuPct(snapshot, *b);
+		});
+	}
+
+	outReport += "USER            PID    PPID  %CPU  %MEM        VSZ        RSS  THR S     TIME COMMAND\n";
+	for (const ProcessRecord* process : sortedProcesses)
+	{
+		const uint64_t cpuTimeSec = process->cpuTimeTicks / uint64_t(snapshot.clockTicksPerSec);
+		outReport += std::format("{:<12} {:>7} {:>7} {:>5.1f} {:>5.1f} {:>10} {:>10} {:>4} {} {:>5}:{:02} {}\n",
+			userNames.getName(process->uid), process->pid, process->parentPid,
+			getLifetimeCpuPct(snapshot, *process), getMemoryPct(snapshot, *process),
+			process->virtualMemoryKb, process->residentMemoryKb, process->threadCount, process->state,
+			cpuTimeSec / 60, cpuTimeSec % 60, process->commandLine);
+	}
+}
+
+// the processes that were PSS candidates, shared memory is split between the processes that map it
+void renderProportionalMemoryTable(const ProcessSnapshot& snapshot, UserNameCache& userNames, std::string& outReport)
+{
+	std::vector<const ProcessRecord*> sortedProcesses;
+	for (const ProcessRecord& process : snapshot.processes)
+	{
+		if (process.proportionalMemoryKb > 0)
+		{
+			sortedProcesses.push_back(&process);
+		}
+	}
+	std::ranges::sort(sortedProcesses, std::greater<>(), &ProcessRecord::proportionalMemoryKb);
+
+	outReport += "USER            PID        PSS        USS        RSS %PSS COMMAND\n";
+	for (const ProcessRecord* process : sortedProcesses)
+	{
+		const float proportionalMemoryPct = snapshot.memoryTotalKb == 0 ? 0.0f : float(double(process->proportionalMemoryKb) / double(snapshot.memoryTotalKb) * 100.0);
+		outReport += std::format("{:<12} {:>7} {:>10} {:>10} {:>10} {:>4.1f} {}\n",
+			userNames.getName(process->uid), process->pid, process->proportionalMemoryKb, process->uniqueMemoryKb, process->residentMemoryKb,
+			proportionalMemoryPct, process->commandLine);
+	}
+}
+
+std::string formatByteSize(uint64_t sizeBytes)
+{
+	static constexpr const char* units[] = {"B", "KiB", "MiB", "GiB", "TiB", "PiB"};
+	double size = double(sizeBytes);
+	size_t unitIndex = 0;
+	while (size >= 1024.0 && unitIndex + 1 < std::size(units))
+	{
+		size /= 1024.0;
+		++unitIndex;
+	}
+	return std::format("{:.1f} {}", size, units[unitIndex]);
+}
+
+// open addressing map from a key to a dense index, the groups of a snapshot are built without a node allocation per key
+template<typename Key>
+class GroupIndexMap
+{
+public:
+	explicit GroupIndexMap(size_t expectedCount)
+	{
+		mSlots.assign(std::bit_ceil(std::max<size_t>(expectedCount * 2, 16)), InvalidIndex);
+	}
+
+	// returns the index of the key, the indices are given out in the order the keys are added
+	uint32_t findOrAdd(const Key& key)
+	{
+		if ((mKeys.size() + 1) * 2 > mSlots.size())
+		{
+			grow();
+		}
+
+		size_t slot = getSlot(key);
+		for (; mSlots[slot] != InvalidIndex; slot = (slot + 1) & (mSlots.size() - 1))
+		{
+			if (mKeys[mSlots[slot]] == key)
+			{
+				return mSlots[slot];
+			}
+		}
+		mSlots[slot] = uint32_t(mKeys.size());
+		mKeys.push_back(key);
+		return mSlots[slot];
+	}
+
+	std::optional<uint32_t> find(const Key& key) const noexcept
+	{
+		for (size_t slot = getSlot(key); mSlots[slot] != InvalidIndex; slot = (slot + 1) & (mSlots.size() - 1))
+		{
+			if (mKeys[mSlots[slot]] == key)
+			{
+				return mSlots[slot];
+			}
+		}
+		return std::nullopt;
+	}
+
+	const Key& getKey(uint32_t index) const noexcept { return mKeys[index]; }
+	size_t getSize() const noexcept { return mKeys.size(); }
+
+private:
+	static constexpr uint32_t InvalidIndex = std::numeric_limits<uint32_t>::max();
+
+	size_t getSlot(const Key& key) const noexcept
+	{
+		// std::hash of integers is the identity, the multiplication spreads consecutive pids and uids over the table
+		return size_t((uint64_t(std::hash<Key>()(key)) * 0x9E3779B97F4A7C15ull) >> (64 - std::countr_zero(mSlots.size())));
+	}
+
+	void grow()
+	{
+		mSlots.assign(mSlots.size() * 2, InvalidIndex);
+		for (uint32_t index = 0; index < mKeys.size(); ++index)
+		{
+			size_t slot = getSlot(mKeys[index]);
+			while (mSlots[slot] != InvalidIndex)
+			{
+				slot = (slot + 1) & (mSlots.size() - 1);
+			}
+			mSlots[slot] = index;
+		}
+	}
+
+private:
+	std::vector<uint32_t> mSlots;
+	std::vector<Key> mKeys;
+};
+
+// resource usage of the processes that share a user, a command, a cgroup or a top-level ancestor
+struct ProcessGroupUsage
+{
+	size_t processCount = 0;
+	size_t threadCount = 0;
+	float cpuPct = 0.0f;
+	uint64_t residentMemoryKb = 0;
+	uint64_t proportionalMemoryKb = 0;
+	double ioBytesPerSec = 0.0;
+};
+
+enum class ProcessGrouping
+{
+	User,
+	Command,
+	// the ancestor right below init, kernel threads are all under kthreadd
+	Tree,
+	Cgroup,
+	Count,
+};
+
+// sums up the processes by user, command, process tree and cgroup in one pass over the snapshot
+// the keys are views into the snapshot, which has to outlive the result
+struct ProcessGroups
+{
+	explicit ProcessGroups(const ProcessSnapshot& snapshot)
+		: users(64)
+		, commands(snapshot.processes.size())
+		, trees(snapshot.processes.size())
+		, cgroups(snapshot.hasCgroups ? snapshot.processes.size() : 0)
+	{
+		TraceSpan span("groupProcesses");
+		const std::vector<const ProcessRecord*> treeRoots = findTreeRoots(snapshot);
+		for (size_t i = 0; i < snapshot.processes.size(); ++i)
+		{
+			const ProcessRecord& process = snapshot.processes[i];
+			addProcess(snapshot, process, ProcessGrouping::User, users.findOrAdd(process.uid));
+			addProcess(snapshot, process, ProcessGrouping::Command, commands.findOrAdd(process.command));
+			addProcess(snapshot, process, ProcessGrouping::Tree, trees.findOrAdd(treeRoots[i]->pid));
+			if (snapshot.hasCgroups)
+			{
+				addProcess(snapshot, process, ProcessGrouping::Cgroup, cgroups.findOrAdd(process.cgroup));
+			}
+		}
+	}
+
+	GroupIndexMap<uid_t> users;
+	GroupIndexMap<std::string_view> commands;
+	// by the pid of the root of the tree
+	GroupIndexMap<pid_t> trees;
+	GroupIndexMap<std::string_view> cgroups;
+	// in the order of the indices of the maps
+	std::array<std::vector<ProcessGroupUsage>, size_t(ProcessGrouping::Count)> usages;
+
+private:
+	void addProcess(const ProcessSnapshot& snapshot, const ProcessRecord& process, ProcessGrouping grouping, uint32_t groupIndex)
+	{
+		std::vector<ProcessGroupUsage>& groupUsages = usages[size_t(grouping)];
+		if (groupIndex >= groupUsages.size())
+		{
+			groupUsages.emplace_back();
+		}
+
+		ProcessGroupUsage& usage = groupUsages[groupIndex];
+		++usage.processCount;
+		usage.threadCount += size_t(process.threadCount);
+		usage.cpuPct += getLifetimeCpuPct(snapshot, process);
+		usage.residentMemoryKb += process.residentMemoryKb;
+		usage.proportionalMemoryKb += process.proportionalMemoryKb;
+		usage.ioBytesPerSec += getLifetimeIoBytesPerSec(snapshot, process);
+	}
+
+	// the ancestor of every process whose parent is init or not in the snapshot
+	static std::vector<const ProcessRecord*> findTreeRoots(const ProcessSnapshot& snapshot)
+	{
+		const std::vector<ProcessRecord>& processes = snapshot.processes;
+		GroupIndexMap<pid_t> indices(processes.size());
+		for (const ProcessRecord& process : processes)
+		{
+			indices.findOrAdd(process.pid);
+		}
+
+		std::vector<const ProcessRecord*> roots(processes.size(), nullptr);
+		std::vector<uint32_t> path;
+		for (size_t i = 0; i < processes.size(); ++i)
+		{
+			// walk up until a process with a known root, and give every process on the way the same root
+			uint32_t index = uint32_t(i);
+			path.clear();
+			while (roots[index] == nullptr)
+			{
+				path.push_back(index);
+				const pid_t parentPid = processes[index].parentPid;
+				const std::optional<uint32_t> parentIndex = (parentPid > 1) ? indices.find(parentPid) : std::nullopt;
+				// the parents can't loop within one snapshot unless pids were reused while it was read
+				if (!parentIndex.has_value() || path.size() > processes.size())
+				{
+					roots[index] = &processes[index];
+					break;
+				}
+				index = *parentIndex;
+			}
+			for (const uint32_t pathIndex : path)
+			{
+				roots[pathIndex] = roots[index];
+			}
+		}
+		return roots;
+	}
+};
+
+// the groups with the most CPU and the most memory of one grouping
+void renderProcessGroupTable(const ProcessSnapshot& snapshot, const ProcessGroups& groups, ProcessGrouping grouping, UserNameCache& userNames, std::string& outReport)
+{
+	static constexpr size_t TopGroupCount = 10;
+	const std::vector<ProcessGroupUsage>& usages = groups.usages[size_t(grouping)];
+	std::vector<uint32_t> byCpu(usages.size());
+	std::iota(byCpu.begin(), byCpu.end(), 0);
+	std::vector<uint32_t> byMemory = byCpu;
+	const size_t shownCount = std::min(TopGroupCount, usages.size());
+	std::partial_sort(byCpu.begin(), byCpu.begin() + ptrdiff_t(shownCount), byCpu.end(), [&usages](uint32_t a, uint32_t b) { return usages[a].cpuPct > usages[b].cpuPct; });
+	std::partial_sort(byMemory.begin(), byMemory.begin() + ptrdiff_t(shownCount), byMemory.end(), [&usages](uint32_t a, uint32_t b) { return usages[a].residentMemoryKb > usages[b].residentMemoryKb; });
+
+	// the top groups by either, sorted by memory like the rest of the report
+	std::vector<uint32_t> shownGroups(byMemory.begin(), byMemory.begin() + ptrdiff_t(shownCount));
+	for (size_t i = 0; i < shownCount; ++i)
+	{
+		if (std::ranges::find(shownGroups, byCpu[i]) == shownGroups.end())
+		{
+			shownGroups.push_back(byCpu[i]);
+		}
+	}
+	std::ranges::stable_sort(shownGroups, [&usages](uint32_t a, uint32_t b) { return usages[a].residentMemoryKb > usages[b].residentMemoryKb; });
+
+	outReport += " PROCS    THR   %CPU        RSS        PSS     IO/SEC GROUP\n";
+	for (const uint32_t groupIndex : shownGroups)
+	{
+		const ProcessGroupUsage& usage = usages[groupIndex];
+		std::string_view groupName;
+		std::string treeName;
+		switch (grouping)
+		{
+		case ProcessGrouping::User:
+			groupName = userNames.getName(groups.users.getKey(groupIndex));
+			break;
+		case ProcessGrouping::Command:
+			groupName = groups.commands.getKey(groupIndex);
+			break;
+		case ProcessGrouping::Tree:
+		{
+			const pid_t rootPid = groups.trees.getKey(groupIndex);
+			const auto root = std::ranges::find(snapshot.processes, rootPid, &ProcessRecord::pid);
+			treeName = std::format("{} {}", rootPid, (root != snapshot.processes.end()) ? std::string_view(root->commandLine) : std::string_view());
+			groupName = treeName;
+			break;
+		}
+		default:
+			groupName = groups.cgroups.getKey(groupIndex);
+			break;
+		}
+
+		// PSS is only known for the candidates, and I/O only when it was read
+		outReport += std::format("{:>6} {:>6} {:>6.1f} {:>10} {:>10} {:>10} {}\n", usage.processCount, usage.threadCount, usage.cpuPct, usage.residentMemoryKb,
+			snapshot.hasProportionalMemory ? std::to_string(usage.proportionalMemoryKb) : std::string("-"),
+			snapshot.hasIoStats ? formatByteSize(uint64_t(usage.ioBytesPerSec)) : std::string("-"), groupName.empty() ? std::string_view("-") : groupName);
+	}
+}
+
+void renderProcessGroups(const ProcessSnapshot& snapshot, UserNameCache& userNames, std::string& outReport)
+{
+	const ProcessGroups groups(snapshot);
+	outReport += "\n=== Processes grouped by user ===\n";
+	renderProcessGroupTable(snapshot, groups, ProcessGrouping::User, userNames, outReport);
+	outReport += "\n=== Processes grouped by command ===\n";
+	renderProcessGroupTable(snapshot, groups, ProcessGrouping::Command, userNames, outReport);
+	outReport += "\n=== Processes grouped by process tree ===\n";
+	renderProcessGroupTable(snapshot, groups, ProcessGrouping::Tree, userNames, outReport);
+	if (snapshot.hasCgroups)
+	{
+		outReport += "\n=== Processes grouped by cgroup ===\n";
+		renderProcessGroupTable(snapshot, groups, ProcessGrouping::Cgroup, userNames, outReport);
+	}
+}
+
+void renderReportHeader(const ProcessSnapshot& snapshot, float memConsumptionPct, float cpuConsumptionPct, std::string& outReport)
+{
+	outReport += std::format("Report at {:%Y-%m-%d %H:%M:%OS}\n", snapshot.time);
+	outReport += std::format("Memory consumption: {:.2f}%\nCPU consumption: {:.2f}%\nProcesses: {}\n", memConsumptionPct, cpuConsumptionPct, snapshot.processes.size());
+}
+
+// counters from /proc/vmstat that show how hard the kernel is reclaiming memory
+struct MemoryPressureStats
+{
+	static constexpr size_t CounterCount = 10;
+	std::array<uint64_t, CounterCount> counters{};
+	// since the previous check, NaN on the first sample
+	std::array<double, CounterCount> ratesPerSec{};
+	bool isValid = false;
+};
+
+// the kernel splits some of the counters by zone or by page type, these are summed up by the name prefix
+constexpr std::array<std::string_view, MemoryPressureStats::CounterCount> MemoryPressureCounterNames{
+	"pswpin", "pswpout", "pgmajfault", "allocstall", "oom_kill", "pgscan_kswapd", "pgscan_direct", "pgsteal_kswapd", "pgsteal_direct", "workingset_refault",
+};
+
+void renderMemoryPressure(const MemoryPressureStats& stats, std::string& outReport)
+{
+	outReport += "\n=== Memory pressure ===\n";
+	outReport += "COUNTER                         TOTAL      PER SEC\n";
+	for (size_t i = 0; i < MemoryPressureStats::CounterCount; ++i)
+	{
+		outReport += std::format("{:<20} {:>16} {:>12.1f}\n", MemoryPressureCounterNames[i], stats.counters[i], stats.ratesPerSec[i]);
+	}
+}
+
+// renders one report with memory and CPU views of the same snapshot
+void renderCombinedReport(const ProcessSnapshot& snapshot, float memConsumptionPct, float cpuConsumptionPct, const MemoryPressureStats& memoryPressure, std::string& outReport)
+{
+	TraceSpan span("renderCombinedReport");
+	outReport.clear();
+	renderReportHeader(snapshot, memConsumptionPct, cpuConsumptionPct, outReport);
+	if (memoryPressure.isValid)
+	{
+		renderMemoryPressure(memoryPressure, outReport);
+	}
+
+	UserNameCache userNames;
+	if (snapshot.hasProportionalMemory)
+	{
+		outReport += "\n=== Processes with the highest RSS sorted by PSS ===\n";
+		renderProportionalMemoryTable(snapshot, userNames, outReport);
+	}
+	renderProcessGroups(snapshot, userNames, outReport);
+	outReport += "\n=== Processes sorted by memory ===\n";
+	renderProcessTable(snapshot, ProcessSortKey::Memory, userNames, outReport);
+	outReport += "\n=== Processes sorted by CPU ===\n";
+	renderProcessTable(snapshot, ProcessSortKey::Cpu, userNames, outReport);
+}
+
+// compact binary report, all values are in the native byte order
+// header, then one column per field with a value per process, then the users and the interned string table
+// strings (commands, command lines, user names) are stored once and referenced by index
+// a delta report contains only the new processes in the columns, followed by the exited and changed processes
+constexpr std::array<char, 4> BinaryReportMagic{'R', 'A', 'B', 'R'};
+constexpr uint32_t BinaryReportVersion = 1;
+
+struct BinaryReportHeader
+{
+	std::array<char, 4> magic = BinaryReportMagic;
+	uint32_t version = BinaryReportVersion;
+	int64_t unixTimeMs = 0;
+	float memConsumptionPct = 0.0f;
+	float cpuConsumptionPct = 0.0f;
+	uint64_t memoryTotalKb = 0;
+	double uptimeSec = 0.0;
+	uint32_t clockTicksPerSec = 0;
+	uint32_t processCount = 0;
+	uint32_t userCount = 0;
+	uint32_t stringCount = 0;
+	uint32_t stringBytes = 0;
+	// BinaryReportKind
+	uint32_t kind = 0;
+};
+static_assert(std::is_trivially_copyable_v<BinaryReportHeader>);
+
+enum class BinaryReportKind : uint32_t
+{
+	Keyframe = 0,
+	Delta = 1,
+};
+
+// the size of one changed process across the delta columns: pid, state, threadCount, cpuTimeTicks, virtualMemoryKb, residentMemoryKb
+constexpr size_t BinaryReportChangedProcessSize = sizeof(int32_t) + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint64_t) * 3;
+
+// the size of one process across all the columns
+constexpr size_t BinaryReportProcessSize = sizeof(int32_t) * 2 + sizeof(uint32_t) + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint64_t) * 4 + sizeof(uint32_t) * 2;
+
+template<typename T>
+void appendBinaryValue(std::string& outData, const T& value)
+{
+	static_assert(std::is_trivially_copyable_v<T>);
+	outData.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template<typename T, typename Func>
+void appendBinaryColumn(std::string& outData, const ProcessSnapshot& snapshot, Func&& getValue)
+{
+	for (const ProcessRecord& process : snapshot.processes)
+	{
+		appendBinaryValue<T>(outData, getValue(process));
+	}
+}
+
+class BinaryReportStringTable
+{
+public:
+	uint32_t intern(std::string_view string)
+	{
+		const auto [it, isInserted] = mIndexes.try_emplace(string, uint32_t(mStrings.size()));
+		if (isInserted)
+		{
+			mStrings.push_back(string);
+		}
+		return it->second;
+	}
+
+	void append(std::string& outData) const
+	{
+		uint32_t offset = 0;
+		for (const std::string_view string : mStrings)
+		{
+			appendBinaryValue<uint32_t>(outData, offset);
+			offset += uint32_t(string.size());
+		}
+		appendBinaryValue<uint32_t>(outData, offset);
+		for (const std::string_view string : mStrings)
+		{
+			outData += string;
+		}
+	}
+
+	uint32_t getCount() const { return uint32_t(mStrings.size()); }
+
+	uint32_t getBytes() const
+	{
+		uint32_t bytes = 0;
+		for (const std::string_view string : mStrings)
+		{
+			bytes += uint32_t(string.size());
+		}
+		return bytes;
+	}
+
+private:
+	// views point into the snapshot that is being encoded
+	std::unordered_map<std::string_view, uint32_t> mIndexes;
+	std::vector<std::string_view> mStrings;
+};
+
+void encodeBinaryReport(const ProcessSnapshot& snapshot, float memConsumptionPct, float cpuConsumptionPct, UserNameCache& userNames, std::string& outData, BinaryReportKind kind = BinaryReportKind::Keyframe)
+{
+	TraceSpan span("encodeBinaryReport");
+	BinaryReportStringTable strings;
+	std::vector<uint32_t> commandIndexes;
+	std::vector<uint32_t> commandLineIndexes;
+	std::vector<std::pair<uid_t, uint32_t>> users;
+	commandIndexes.reserve(snapshot.processes.size());
+	commandLineIndexes.reserve(snapshot.processes.size());
+	for (const ProcessRecord& process : snapshot.processes)
+	{
+		commandIndexes.push_back(strings.intern(process.command));
+		commandLineIndexes.push_back(strings.intern(process.commandLine));
+		if (std::find_if(users.begin(), users.end(), [&process](const auto& user) { return user.first == process.uid; }) == users.end())
+		{
+			users.emplace_back(process.uid, strings.intern(userNames.getName(process.uid)));
+		}
+	}
+
+	BinaryReportHeader header;
+	header.unixTimeMs = std::chrono::duration_cast<std::chrono::milliseconds>(snapshot.time.time_since_epoch()).count();
+	header.memConsumptionPct = memConsumptionPct;
+	header.cpuConsumptionPct = cpuConsumptionPct;
+	header.memoryTotalKb = snapshot.memoryTotalKb;
+	header.uptimeSec = snapshot.uptimeSec;
+	header.clockTicksPerSec = uint32_t(snapshot.clockTicksPerSec);
+	header.processCount = uint32_t(snapshot.processes.size());
+	header.userCount = uint32_t(users.size());
+	header.stringCount = strings.getCount();
+	header.stringBytes = strings.getBytes();
+	header.kind = static_cast<uint32_t>(kind);
+
+	outData.clear();
+	outData.reserve(sizeof(BinaryReportHeader) + snapshot.processes.size() * BinaryReportProcessSize + users.size() * 8 + (header.stringCount + 1) * 4 + header.stringBytes);
+	appendBinaryValue(outData, header);
+	appendBinaryColumn<int32_t>(outData, snapshot, [](const ProcessRecord& p) { return p.pid; });
+	appendBinaryColumn<int32_t>(outData, snapshot, [](const ProcessRecord& p) { return p.parentPid; });
+	appendBinaryColumn<uint32_t>(outData, snapshot, [](const ProcessRecord& p) { return p.uid; });
+	appendBinaryColumn<uint8_t>(outData, snapshot, [](const ProcessRecord& p) { return uint8_t(p.state); });
+	appendBinaryColumn<uint32_t>(outData, snapshot, [](const ProcessRecord& p) { return uint32_t(p.threadCount); });
+	appendBinaryColumn<uint64_t>(outData, snapshot, [](const ProcessRecord& p) { return p.cpuTimeTicks; });
+	appendBinaryColumn<uint64_t>(outData, snapshot, [](const ProcessRecord& p) { return p.startTimeTicks; });
+	appendBinaryColumn<uint64_t>(outData, snapshot, [](const ProcessRecord& p) { return p.virtualMemoryKb; });
+	appendBinaryColumn<uint64_t>(outData, snapshot, [](const ProcessRecord& p) { return p.residentMemoryKb; });
+	outData.append(reinterpret_cast<const char*>(commandIndexes.data()), commandIndexes.size() * sizeof(uint32_t));
+	outData.append(reinterpret_cast<const char*>(commandLineIndexes.data()), commandLineIndexes.size() * sizeof(uint32_t));
+	for (const auto& [uid, nameIndex] : users)
+	{
+		appendBinaryValue<uint32_t>(outData, uid);
+		appendBinaryValue<uint32_t>(outData, nameIndex);
+	}
+	strings.append(outData);
+}
+
+// false makes the delta write the process as exited and new, with all its columns
+bool isSameProcess(const ProcessRecord& a, const ProcessRecord& b) noexcept
+{
+	// a reused pid has a different start time, and exec changes the command
+	// the parent changes when an orphan is reparented, and the owner after setuid, both are rare enough to not have delta columns
+	return a.pid == b.pid && a.startTimeTicks == b.startTimeTicks && a.command == b.command && a.commandLine == b.commandLine
+		&& a.parentPid == b.parentPid && a.uid == b.uid;
+}
+
+bool hasProcessChanged(const ProcessRecord& a, const ProcessRecord& b) noexcept
+{
+	return a.state != b.state || a.threadCount != b.threadCount || a.cpuTimeTicks != b.cpuTimeTicks
+		|| a.virtualMemoryKb != b.virtualMemoryKb || a.residentMemoryKb != b.residentMemoryKb;
+}
+
+// writes a full keyframe every N reports and only the differences from the previous report otherwise
+class BinaryReportDeltaEncoder
+{
+public:
+	explicit BinaryReportDeltaEncoder(size_t keyframeInterval) noexcept
+		: mKeyframeInterval(keyframeInterval)
+	{
+	}
+
+	// the next report will be a keyframe, e.g. when the previous one could not be saved
+	void reset() noexcept
+	{
+		mPreviousProcesses.clear();
+		mReportsSinceKeyframe = 0;
+	}
+
+	BinaryReportKind encode(const ProcessSnapshot& snapshot, float memConsumptionPct, float cpuConsumptionPct, UserNameCache& userNames, std::string& outData)
+	{
+		TraceSpan span("encodeBinaryReportDelta");
+		std::vector<const ProcessRecord*> sortedProcesses;
+		sortedProcesses.reserve(snapshot.processes.size());
+		for (const ProcessRecord& process : snapshot.processes)
+		{
+			sortedProcesses.push_back(&process);
+		}
+		std::sort(sortedProcesses.begin(), sortedProcesses.end(), [](const ProcessRecord* a, const ProcessRecord* b) { return a->pid < b->pid; });
+
+		const bool isKeyframe = mPreviousProcesses.empty() || mReportsSinceKeyframe + 1 >= mKeyframeInterval;
+		if (isKeyframe)
+		{
+			encodeBinaryReport(snapshot, memConsumptionPct, cpuConsumptionPct, userNames, outData, BinaryReportKind::Keyframe);
+			mReportsSinceKeyframe = 0;
+		}
+		else
+		{
+			encodeDelta(snapshot, sortedProcesses, memConsumptionPct, cpuConsumptionPct, userNames, outData);
+			++mReportsSinceKeyframe;
+		}
+
+		mPreviousProcesses.clear();
+		for (const ProcessRecord* process : sortedProcesses)
+		{
+			mPreviousProcesses.push_back(*process);
+		}
+
+		return isKeyframe ? BinaryReportKind::Keyframe : BinaryReportKind::Delta;
+	}
+
+private:
+	void encodeDelta(const ProcessSnapshot& snapshot, const std::vector<const ProcessRecord*>& sortedProcesses, float memConsumptionPct, float cpuConsumptionPct, UserNameCache& userNames, std::string& outData)
+	{
+		mNewProcesses.time = snapshot.time;
+		mNewProcesses.uptimeSec = snapshot.uptimeSec;
+		mNewProcesses.memoryTotalKb = snapshot.memoryTotalKb;
+		mNewProcesses.clockTicksPerSec = snapshot.clockTicksPerSec;
+		mNewProcesses.processes.clear();
+		mExitedPids.clear();
+		mChangedProcesses.clear();
+
+		// both lists are sorted by pid
+		size_t previousIndex = 0;
+		for (const ProcessRecord* process : sortedProcesses)
+		{
+			while (previousIndex < mPreviousProcesses.size() && mPreviousProcesses[previousIndex].pid < process->pid)
+			{
+				mExitedPids.push_back(mPreviousProcesses[previousIndex].pid);
+				++previousIndex;
+			}
+
+			if (previousIndex < mPreviousProcesses.size() && mPreviousProcesses[previousIndex].pid == process->pid)
+			{
+				const ProcessRecord& previous = mPreviousProcesses[previousIndex];
+				++previousIndex;
+				if (isSameProcess(previous, *process))
+				{
+					if (hasProcessChanged(previous, *process))
+					{
+						mChangedProcesses.push_back(process);
+					}
+					continue;
+				}
+				mExitedPids.push_back(previous.pid);
+			}
+			mNewProcesses.processes.push_back(*process);
+		}
+		for (; previousIndex < mPreviousProcesses.size(); ++previousIndex)
+		{
+			mExitedPids.push_back(mPreviousProcesses[previousIndex].pid);
+		}
+
+		encodeBinaryReport(mNewProcesses, memConsumptionPct, cpuConsumptionPct, userNames, outData, BinaryReportKind::Delta);
+		appendBinaryValue<uint32_t>(outData, uint32_t(mExitedPids.size()));
+		appendBinaryValue<uint32_t>(outData, uint32_t(mChangedProcesses.size()));
+		outData.append(reinterpret_cast<const char*>(mExitedPids.data()), mExitedPids.size() * sizeof(int32_t));
+		for (const ProcessRecord* p : mChangedProcesses) { appendBinaryValue<int32_t>(outData, p->pid); }
+		for (const ProcessRecord* p : mChangedProcesses) { appendBinaryValue<uint8_t>(outData, uint8_t(p->state)); }
+		for (const ProcessRecord* p : mChangedProcesses) { appendBinaryValue<uint32_t>(outData, uint32_t(p->threadCount)); }
+		for (const ProcessRecord* p : mChangedProcesses) { appendBinaryValue<uint64_t>(outData, p->cpuTimeTicks); }
+		for (const ProcessRecord* p : mChangedProcesses) { appendBinaryValue<uint64_t>(outData, p->virtualMemoryKb); }
+		for (const ProcessRecord* p : mChangedProcesses) { appendBinaryValue<uint64_t>(outData, p->residentMemoryKb); }
+	}
+
+private:
+	const size_t mKeyframeInterval;
+	size_t mReportsSinceKeyframe = 0;
+	// sorted by pid
+	std::vector<ProcessRecord> mPreviousProcesses;
+	// reused between reports
+	ProcessSnapshot mNewProcesses;
+	std::vector<int32_t> mExitedPids;
+	std::vector<const ProcessRecord*> mChangedProcesses;
+};
+
+// read-only access to an encoded report without copying the columns
+class BinaryReportView
+{
+public:
+	// returns false if the data is not a valid report
+	bool parse(std::string_view data) noexcept
+	{
+		if (data.size() < sizeof(BinaryReportHeader))
+		{
+			return false;
+		}
+		mData = data;
+		std::memcpy(&mHeader, data.data(), sizeof(BinaryReportHeader));
+		if (mHeader.magic != BinaryReportMagic || mHeader.version != BinaryReportVersion)
+		{
+			return false;
+		}
+
+		const size_t processCount = mHeader.processCount;
+		const size_t keyframeSize = sizeof(BinaryReportHeader) + processCount * BinaryReportProcessSize + size_t(mHeader.userCount) * 8 + (size_t(mHeader.stringCount) + 1) * 4 + mHeader.stringBytes;
+		if (isDelta())
+		{
+			if (data.size() < keyframeSize + sizeof(uint32_t) * 2)
+			{
+				return false;
+			}
+			std::memcpy(&mExitedCount, data.data() + keyframeSize, sizeof(uint32_t));
+			std::memcpy(&mChangedCount, data.data() + keyframeSize + sizeof(uint32_t), sizeof(uint32_t));
+			if (data.size() != keyframeSize + sizeof(uint32_t) * 2 + size_t(mExitedCount) * sizeof(int32_t) + size_t(mChangedCount) * BinaryReportChangedProcessSize)
+			{
+				return false;
+			}
+		}
+		else if (mHeader.kind != static_cast<uint32_t>(BinaryReportKind::Keyframe) || data.size() != keyframeSize)
+		{
+			return false;
+		}
+
+		size_t offset = sizeof(BinaryReportHeader);
+		auto takeColumn = [&data, &offset, processCount](size_t valueSize) {
+			const char* column = data.data() + offset;
+			offset += valueSize * processCount;
+			return column;
+		};
+		mPids = takeColumn(sizeof(int32_t));
+		mParentPids = takeColumn(sizeof(int32_t));
+		mUids = takeColumn(sizeof(uint32_t));
+		mStates = takeColumn(sizeof(uint8_t));
+		mThreadCounts = takeColumn(sizeof(uint32_t));
+		mCpuTimes = takeColumn(sizeof(uint64_t));
+		mStartTimes = takeColumn(sizeof(uint64_t));
+		mVirtualMemory = takeColumn(sizeof(uint64_t));
+		mResidentMemory = takeColumn(sizeof(uint64_t));
+		mCommandIndexes = takeColumn(sizeof(uint32_t));
+		mCommandLineIndexes = takeColumn(sizeof(uint32_t));
+		mUsers = data.data() + offset;
+		offset += size_t(mHeader.userCount) * 8;
+		mStringOffsets = data.data() + offset;
+		offset += (size_t(mHeader.stringCount) + 1) * 4;
+		mStringData = data.data() + offset;
+		offset += mHeader.stringBytes + sizeof(uint32_t) * 2;
+
+		if (isDelta())
+		{
+			mExitedPids = data.data() + offset;
+			offset += size_t(mExitedCount) * sizeof(int32_t);
+			auto takeChangedColumn = [&data, &offset, this](size_t valueSize) {
+				const char* column = data.data() + offset;
+				offset += valueSize * mChangedCount;
+				return column;
+			};
+			mChangedPids = takeChangedColumn(sizeof(int32_t));
+			mChangedStates = takeChangedColumn(sizeof(uint8_t));
+			mChangedThreadCounts = takeChangedColumn(sizeof(uint32_t));
+			mChangedCpuTimes = takeChangedColumn(sizeof(uint64_t));
+			mChangedVirtualMemory = takeChangedColumn(sizeof(uint64_t));
+			mChangedResidentMemory = takeChangedColumn(sizeof(uint64_t));
+		}
+
+		for (uint32_t i = 0; i <= mHeader.stringCount; ++i)
+		{
+			if (read<uint32_t>(mStringOffsets, i) > mHeader.stringBytes || (i > 0 && read<uint32_t>(mStringOffsets, i) < read<uint32_t>(mStringOffsets, i - 1)))
+			{
+				return false;
+			}
+		}
+		for (uint32_t i = 0; i < mHeader.processCount; ++i)
+		{
+			if (read<uint32_t>(mCommandIndexes, i) >= mHeader.stringCount || read<uint32_t>(mCommandLineIndexes, i) >= mHeader.stringCount)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	const BinaryReportHeader& getHeader() const noexcept { return mHeader; }
+	std::string_view getData() const noexcept { return mData; }
+	bool isDelta() const noexcept { return mHeader.kind == static_cast<uint32_t>(BinaryReportKind::Delta); }
+	uint32_t getExitedCount() const noexcept { return mExitedCount; }
+	uint32_t getChangedCount() const noexcept { return mChangedCount; }
+	pid_t getExitedPid(size_t index) const noexcept { return read<int32_t>(mExitedPids, index); }
+	pid_t getChangedPid(size_t index) const noexcept { return read<int32_t>(mChangedPids, index); }
+
+	void applyChange(size_t index, ProcessRecord& outRecord) const noexcept
+	{
+		outRecord.state = char(read<uint8_t>(mChangedStates, index));
+		outRecord.threadCount = int(read<uint32_t>(mChangedThreadCounts, index));
+		outRecord.cpuTimeTicks = read<uint64_t>(mChangedCpuTimes, index);
+		outRecord.virtualMemoryKb = read<uint64_t>(mChangedVirtualMemory, index);
+		outRecord.residentMemoryKb = read<uint64_t>(mChangedResidentMemory, index);
+	}
+
+	std::chrono::system_clock::time_point getTime() const noexcept
+	{
+		return std::chrono::system_clock::time_point(std::chrono::milliseconds(mHeader.unixTimeMs));
+	}
+
+	std::string_view getString(uint32_t index) const noexcept
+	{
+		const uint32_t begin = read<uint32_t>(mStringOffsets, index);
+		return std::string_view(mStringData + begin, read<uint32_t>(mStringOffsets, index + 1) - begin);
+	}
+
+	uint32_t getCommandIndex(size_t processIndex) const noexcept { return read<uint32_t>(mCommandIndexes, processIndex); }
+	uint32_t getCommandLineIndex(size_t processIndex) const noexcept { return read<uint32_t>(mCommandLineIndexes, processIndex); }
+
+	void fillProcessRecord(size_t processIndex, ProcessRecord& outRecord) const
+	{
+		outRecord.pid = read<int32_t>(mPids, processIndex);
+		outRecord.parentPid = read<int32_t>(mParentPids, processIndex);
+		outRecord.uid = read<uint32_t>(mUids, processIndex);
+		outRecord.state = char(read<uint8_t>(mStates, processIndex));
+		outRecord.threadCount = int(read<uint32_t>(mThreadCounts, processIndex));
+		outRecord.cpuTimeTicks = read<uint64_t>(mCpuTimes, processIndex);
+		outRecord.startTimeTicks = read<uint64_t>(mStartTimes, processIndex);
+		outRecord.virtualMemoryKb = read<uint64_t>(mVirtualMemory, processIndex);
+		outRecord.residentMemoryKb = read<uint64_t>(mResidentMemory, processIndex);
+		outRecord.command = getString(getCommandIndex(processIndex));
+		outRecord.commandLine = getString(getCommandLineIndex(processIndex));
+	}
+
+	void fillSnapshotInfo(ProcessSnapshot& outSnapshot) const
+	{
+		outSnapshot.time = getTime();
+		outSnapshot.uptimeSec = mHeader.uptimeSec;
+		outSnapshot.memoryTotalKb = mHeader.memoryTotalKb;
+		outSnapshot.clockTicksPerSec = long(mHeader.clockTicksPerSec);
+	}
+
+	void fillUserNames(UserNameCache& outUserNames) const
+	{
+		for (uint32_t i = 0; i < mHeader.userCount; ++i)
+		{
+			const uint32_t nameIndex = read<uint32_t>(mUsers, i * 2 + 1);
+			if (nameIndex < mHeader.stringCount)
+			{
+				outUserNames.addName(read<uint32_t>(mUsers, i * 2), getString(nameIndex));
+			}
+		}
+	}
+
+private:
+	template<typename T>
+	static T read(const char* column, size_t index) noexcept
+	{
+		T value;
+		std::memcpy(&value, column + index * sizeof(T), sizeof(T));
+		return value;
+	}
+
+private:
+	std::string_view mData;
+	BinaryReportHeader mHeader;
+	const char* mPids = nullptr;
+	const char* mParentPids = nullptr;
+	const char* mUids = nullptr;
+	const char* mStates = nullptr;
+	const char* mThreadCounts = nullptr;
+	const char* mCpuTimes = nullptr;
+	const char* mStartTimes = nullptr;
+	const char* mVirtualMemory = nullptr;
+	const char* mResidentMemory = nullptr;
+	const char* mCommandIndexes = nullptr;
+	const char* mCommandLineIndexes = nullptr;
+	const char* mUsers = nullptr;
+	const char* mStringOffsets = nullptr;
+	const char* mStringData = nullptr;
+	uint32_t mExitedCount = 0;
+	uint32_t mChangedCount = 0;
+	const char* mExitedPids = nullptr;
+	const char* mChangedPids = nullptr;
+	const char* mChangedStates = nullptr;
+	const char* mChangedThreadCounts = nullptr;
+	const char* mChangedCpuTimes = nullptr;
+	const char* mChangedVirtualMemory = nullptr;
+	const char* mChangedResidentMemory = nullptr;
+};
+
+// rebuilds full snapshots from a sequence of keyframes and deltas
+// a keyframe is only copied, and decoded when a delta follows it, so the keyframes that are read directly or skipped cost little
+class BinaryReportDecoder
+{
+public:
+	// returns false for a delta that doesn't have a keyframe before it
+	bool apply(const BinaryReportView& report)
+	{
+		if (!report.isDelta())
+		{
+			mPendingKeyframe.assign(report.getData());
+			mHasKeyframe = true;
+			return true;
+		}
+		if (!mHasKeyframe)
+		{
+			return false;
+		}
+
+		TraceSpan span("applyBinaryReport");
+		if (!mPendingKeyframe.empty())
+		{
+			// the data was valid when it was parsed the first time
+			BinaryReportView keyframe;
+			keyframe.parse(mPendingKeyframe);
+			mSnapshot.processes.clear();
+			decode(keyframe);
+			mPendingKeyframe.clear();
+		}
+		decode(report);
+		return true;
+	}
+
+	// only valid after a delta, a keyframe is read from its view
+	const ProcessSnapshot& getSnapshot() const noexcept { return mSnapshot; }
+	UserNameCache& getUserNames() noexcept { return mUserNames; }
+	float getMemConsumptionPct() const noexcept { return mMemConsumptionPct; }
+	float getCpuConsumptionPct() const noexcept { return mCpuConsumptionPct; }
+
+private:
+	void decode(const BinaryReportView& report)
+	{
+		report.fillSnapshotInfo(mSnapshot);
+		report.fillUserNames(mUserNames);
+		mMemConsumptionPct = report.getHeader().memConsumptionPct;
+		mCpuConsumptionPct = report.getHeader().cpuConsumptionPct;
+
+		// processes are kept sorted by pid
+		auto findProcess = [this](pid_t pid) {
+			const auto it = std::lower_bound(mSnapshot.processes.begin(), mSnapshot.processes.end(), pid, [](const ProcessRecord& process, pid_t searchedPid) { return process.pid < searchedPid; });
+			return (it != mSnapshot.processes.end() && it->pid == pid) ? it : mSnapshot.processes.end();
+		};
+
+		if (report.isDelta())
+		{
+			for (size_t i = 0; i < report.getExitedCount(); ++i)
+			{
+				if (const auto it = findProcess(report.getExitedPid(i)); it != mSnapshot.processes.end())
+				{
+					// marked and removed in one pass below
+					it->pid = -1;
+				}
+			}
+			std::erase_if(mSnapshot.processes, [](const ProcessRecord& process) { return process.pid == -1; });
+
+			for (size_t i = 0; i < report.getChangedCount(); ++i)
+			{
+				if (const auto it = findProcess(report.getChangedPid(i)); it != mSnapshot.processes.end())
+				{
+					report.applyChange(i, *it);
+				}
+			}
+		}
+
+		for (size_t i = 0; i < report.getHeader().processCount; ++i)
+		{
+			report.fillProcessRecord(i, mSnapshot.processes.emplace_back());
+		}
+		std::sort(mSnapshot.processes.begin(), mSnapshot.processes.end(), [](const ProcessRecord& a, const ProcessRecord& b) { return a.pid < b.pid; });
+	}
+
+private:
+	// the last keyframe while no delta was applied to it yet
+	std::string mPendingKeyframe;
+	ProcessSnapshot mSnapshot;
+	UserNameCache mUserNames;
+	float mMemConsumptionPct = 0.0f;
+	float mCpuConsumptionPct = 0.0f;
+	bool mHasKeyframe = false;
+};
+
+enum class ReportFormat
+{
+	Text,
+	Binary,
+};
+
+std::optional<ReportFormat> parseReportFormat(std::string_view name) noexcept
+{
+	if (name == "text")
+	{
+		return ReportFormat::Text;
+	}
+	if (name == "binary")
+	{
+		return ReportFormat::Binary;
+	}
+	return std::nullopt;
+}
+
+// reports appended to segment files reports/segment_<id>.log, each with a reports/segment_<id>.idx file
+// the index has a (time, offset) entry per report, so a time range is found with a binary search
+// retention removes whole segments
+constexpr std::array<char, 4> ReportLogRecordMagic{'R', 'A', 'L', 'R'};
+
+// flags in the format field of the record
+// the payload is gzip-compressed
+constexpr uint32_t ReportLogCompressedFlag = 1u << 31;
+// the payload is a binary delta report that needs the previous records to be decoded
+constexpr uint32_t ReportLogDeltaFlag = 1u << 30;
+constexpr uint32_t ReportLogFlagsMask = ReportLogCompressedFlag | ReportLogDeltaFlag;
+
+struct ReportLogRecordHeader
+{
+	std::array<char, 4> magic = ReportLogRecordMagic;
+	uint32_t format = 0;
+	int64_t unixTimeMs = 0;
+	uint64_t payloadSize = 0;
+};
+static_assert(std::is_trivially_copyable_v<ReportLogRecordHeader>);
+
+struct ReportLogIndexEntry
+{
+	// never decreases within a segment, even if the system clock goes back
+	int64_t unixTimeMs = 0;
+	uint64_t offset = 0;
+};
+static_assert(std::is_trivially_copyable_v<ReportLogIndexEntry>);
+
+std::string getReportLogSegmentPath(const std::string& directory, uint64_t segmentId, std::string_view extension)
+{
+	return std::format("{}/segment_{:08}.{}", directory, segmentId, extension);
+}
+
+std::string getReportLogIndexPath(std::string_view logPath)
+{
+	std::string indexPath(logPath);
+	if (indexPath.ends_with(".log"))
+	{
+		indexPath.resize(indexPath.size() - 4);
+	}
+	indexPath += ".idx";
+	return indexPath;
+}
+
+class ReportLogWriter
+{
+public:
+	ReportLogWriter(std::string directory, uint64_t maxSegmentBytes)
+		: mDirectory(std::move(directory))
+		, mMaxSegmentBytes(maxSegmentBytes)
+	{
+		std::error_code error;
+		for (const auto& entry : std::filesystem::directory_iterator{mDirectory, error})
+		{
+			const std::string fileName = entry.path().filename().string();
+			if (fileName.starts_with("segment_") && fileName.ends_with(".log"))
+			{
+				const std::string idPart = fileName.substr(8, fileName.size() - 12);
+				if (const std::optional<int> id = parseInt(idPart.c_str(), 10); id.has_value() && *id >= 0)
+				{
+					mSegmentIds.push_back(uint64_t(*id));
+				}
+			}
+		}
+		std::sort(mSegmentIds.begin(), mSegmentIds.end());
+	}
+
+	~ReportLogWriter() noexcept
+	{
+		closeSegment();
+	}
+
+	ReportLogWriter(const ReportLogWriter&) = delete;
+	ReportLogWriter& operator=(const ReportLogWriter&) = delete;
+
+	// the data is buffered until flush() is called
+	// flags are ReportLog*Flag values
+	bool append(std::chrono::system_clock::time_point time, ReportFormat format, uint32_t flags, std::string_view payload) noexcept
+	{
+		TraceSpan span("appendReportLog");
+		std::lock_guard lock(mMutex);
+		// the last segment from a previous run can have a torn tail, so always start a new one
+		// segments are switched only before a keyframe, so every segment can be decoded on its own
+		if (mLogFile == nullptr || (mSegmentBytes >= mMaxSegmentBytes && (flags & ReportLogDeltaFlag) == 0))
+		{
+			closeSegment();
+			if (!openNextSegment())
+			{
+				return false;
+			}
+		}
+
+		ReportLogRecordHeader header;
+		header.format = static_cast<uint32_t>(format) | (flags & ReportLogFlagsMask);
+		header.unixTimeMs = std::chrono::duration_cast<std::chrono::milliseconds>(time.time_since_epoch()).count();
+		header.payloadSize = payload.size();
+
+		mLastIndexedTimeMs = std::max(mLastIndexedTimeMs, header.unixTimeMs);
+		const ReportLogIndexEntry indexEntry{mLastIndexedTimeMs, mSegmentBytes};
+
+		if (fwrite(&header, sizeof(header), 1, mLogFile) != 1
+			|| fwrite(payload.data(), 1, payload.size(), mLogFile) != payload.size()
+			|| fwrite(&indexEntry, sizeof(indexEntry), 1, mIndexFile) != 1)
+		{
+			abandonSegment();
+			return false;
+		}
+
+		mSegmentBytes += sizeof(header) + payload.size();
+		return true;
+	}
+
+	// the index is flushed after the log, so it never points to data that is not written yet
+	bool flush() noexcept
+	{
+		std::lock_guard lock(mMutex);
+		if (!flushUnlocked())
+		{
+			abandonSegment();
+			return false;
+		}
+		return true;
+	}
+
+	// flushes and makes the written data durable
+	bool sync() noexcept
+	{
+		std::lock_guard lock(mMutex);
+		if (!flushUnlocked())
+		{
+			return false;
+		}
+		return mLogFile == nullptr || (fdatasync(fileno(mLogFile)) == 0 && fdatasync(fileno(mIndexFile)) == 0);
+	}
+
+	// keeps at most maxSegmentCount segments, the current segment is never removed
+	void removeOldSegments(size_t maxSegmentCount) noexcept
+	{
+		std::lock_guard lock(mMutex);
+		while (mSegmentIds.size() > std::max<size_t>(maxSegmentCount, 1))
+		{
+			std::error_code error;
+			std::filesystem::remove(getReportLogSegmentPath(mDirectory, mSegmentIds.front(), "log"), error);
+			std::filesystem::remove(getReportLogSegmentPath(mDirectory, mSegmentIds.front(), "idx"), error);
+			mSegmentIds.erase(mSegmentIds.begin());
+		}
+	}
+
+private:
+	bool openNextSegment() noexcept
+	{
+		const uint64_t segmentId = mSegmentIds.empty() ? 0 : mSegmentIds.back() + 1;
+		const std::string logPath = getReportLogSegmentPath(mDirectory, segmentId, "log");
+		mLogFile = fopen(logPath.c_str(), "wb");
+		mIndexFile = fopen(getReportLogSegmentPath(mDirectory, segmentId, "idx").c_str(), "wb");
+		if (mLogFile == nullptr || mIndexFile == nullptr)
+		{
+			fprintf(stderr, "Could not create report log segment '%s'\n", logPath.c_str());
+			closeSegment();
+			return false;
+		}
+
+		// reports are written in batches, one flush per check
+		setvbuf(mLogFile, nullptr, _IOFBF, 1 << 20);
+		mSegmentIds.push_back(segmentId);
+		mSegmentBytes = 0;
+		mLastIndexedTimeMs = std::numeric_limits<int64_t>::min();
+		return true;
+	}
+
+	bool flushUnlocked() noexcept
+	{
+		if (mLogFile == nullptr)
+		{
+			return true;
+		}
+		TraceSpan span("flushReportLog");
+		const bool isLogFlushed = fflush(mLogFile) == 0;
+		return fflush(mIndexFile) == 0 && isLogFlushed;
+	}
+
+	void closeSegment() noexcept
+	{
+		flushUnlocked();
+		if (mLogFile)
+		{
+			fclose(mLogFile);
+			mLogFile = nullptr;
+		}
+		if (mIndexFile)
+		{
+			fclose(mIndexFile);
+			mIndexFile = nullptr;
+		}
+	}
+
+	// after a failed write the segment ends with a torn record and mSegmentBytes no longer matches the file,
+	// so the next record starts a new segment, a segment without any complete record is removed
+	void abandonSegment() noexcept
+	{
+		const bool hasRecords = mSegmentBytes > 0;
+		closeSegment();
+		if (!hasRecords && !mSegmentIds.empty())
+		{
+			std::error_code error;
+			std::filesystem::remove(getReportLogSegmentPath(mDirectory, mSegmentIds.back(), "log"), error);
+			std::filesystem::remove(getReportLogSegmentPath(mDirectory, mSegmentIds.back(), "idx"), error);
+			mSegmentIds.pop_back();
+		}
+	}
+
+private:
+	// reports can be appended from the background writer while retention runs on the main thread
+	std::mutex mMutex;
+	const std::string mDirectory;
+	const uint64_t mMaxSegmentBytes;
+	std::vector<uint64_t> mSegmentIds;
+	FILE* mLogFile = nullptr;
+	FILE* mIndexFile = nullptr;
+	uint64_t mSegmentBytes = 0;
+	int64_t mLastIndexedTimeMs = std::numeric_limits<int64_t>::min();
+};
+
+// calls onRecord(header, payload, isInRange) for every record of the segment that is in [fromTimeMs, toTimeMs]
+// delta records before the range are also passed (with isInRange false) starting from their keyframe
+// uses the index when it is available and falls back to a sequential scan otherwise
+template<typename Func>
+bool readReportLogRange(const std::string& logPath, int64_t fromTimeMs, int64_t toTimeMs, Func&& onRecord)
+{
+	const int logFd = open(logPath.c_str(), O_RDONLY | O_CLOEXEC);
+	if (logFd < 0)
+	{
+		return false;
+	}
+
+	std::vector<ReportLogIndexEntry> index;
+	std::string indexData;
+	if (readSmallFile(AT_FDCWD, getReportLogIndexPath(logPath).c_str(), indexData))
+	{
+		index.resize(indexData.size() / sizeof(ReportLogIndexEntry));
+		std::memcpy(index.data(), indexData.data(), index.size() * sizeof(ReportLogIndexEntry));
+	}
+
+	struct stat logStat;
+	const uint64_t logSize = fstat(logFd, &logStat) == 0 ? uint64_t(logStat.st_size) : 0;
+
+	uint64_t offset = 0;
+	if (!index.empty())
+	{
+		const auto it = std::lower_bound(index.begin(), index.end(), fromTimeMs, [](const ReportLogIndexEntry& entry, int64_t timeMs) {
+			return entry.unixTimeMs < timeMs;
+		});
+		// the index may miss the records written after its last flush, they can still be in range
+		size_t entryIndex = (it == index.end()) ? index.size() - 1 : size_t(it - index.begin());
+
+		// step back to the keyframe the first record depends on
+		ReportLogRecordHeader header;
+		while (entryIndex > 0
+			&& pread(logFd, &header, sizeof(header), off_t(index[entryIndex].offset)) == ssize_t(sizeof(header))
+			&& (header.format & ReportLogDeltaFlag) != 0)
+		{
+			--entryIndex;
+		}
+		offset = index[entryIndex].offset;
+	}
+
+	bool isValid = true;
+	std::string payload;
+	// a header cut short at the end is a torn tail, the sizes are compared without sums that could wrap around
+	while (offset <= logSize && logSize - offset >= sizeof(ReportLogRecordHeader))
+	{
+		ReportLogRecordHeader header;
+		if (pread(logFd, &header, sizeof(header), off_t(offset)) != ssize_t(sizeof(header)) || header.magic != ReportLogRecordMagic)
+		{
+			isValid = false;
+			break;
+		}
+		if (header.payloadSize > logSize - offset - sizeof(header))
+		{
+			// a torn tail after a crash is expected, the rest of the segment is only read up to it
+			break;
+		}
+
+		if (header.unixTimeMs > toTimeMs && !index.empty())
+		{
+			break;
+		}
+
+		// the records before the range are needed to decode the deltas in it
+		if (header.unixTimeMs <= toTimeMs)
+		{
+			payload.resize(header.payloadSize);
+			if (pread(logFd, payload.data(), payload.size(), off_t(offset + sizeof(header))) != ssize_t(payload.size()))
+			{
+				isValid = false;
+				break;
+			}
+			onRecord(header, std::string_view(payload), header.unixTimeMs >= fromTimeMs);
+		}
+		offset += sizeof(header) + header.payloadSize;
+	}
+
+	close(logFd);
+	return isValid;
+}
+
+// streams the input through zlib in gzip format (readable with zcat), onOutput receives the compressed chunks
+bool compressGzip(std::string_view input, int level, const std::function<bool(std::string_view)>& onOutput) noexcept
+{
+	TraceSpan span("compressGzip");
+	z_stream stream{};
+	if (deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+	{
+		return false;
+	}
+
+	std::array<unsigned char, 64 * 1024> chunk;
+	stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+	stream.avail_in = uInt(input.size());
+	int result = Z_OK;
+	while (result == Z_OK)
+	{
+		stream.next_out = chunk.data();
+		stream.avail_out = uInt(chunk.size());
+		result = deflate(&stream, Z_FINISH);
+		const size_t producedBytes = chunk.size() - stream.avail_out;
+		if ((result == Z_OK || result == Z_STREAM_END) && producedBytes > 0 && !onOutput(std::string_view(reinterpret_cast<const char*>(chunk.data()), producedBytes)))
+		{
+			result = Z_ERRNO;
+		}
+	}
+
+	deflateEnd(&stream);
+	return result == Z_STREAM_END;
+}
+
+bool decompressGzip(std::string_view input, std::string& outData) noexcept
+{
+	z_stream stream{};
+	// detect gzip or zlib headers
+	if (inflateInit2(&stream, 15 + 32) != Z_OK)
+	{
+		return false;
+	}
+
+	outData.clear();
+	std::array<unsigned char, 64 * 1024> chunk;
+	stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+	stream.avail_in = uInt(input.size());
+	int result = Z_OK;
+	while (result == Z_OK)
+	{
+		stream.next_out = chunk.data();
+		stream.avail_out = uInt(chunk.size());
+		result = inflate(&stream, Z_NO_FLUSH);
+		outData.append(reinterpret_cast<const char*>(chunk.data()), chunk.size() - stream.avail_out);
+	}
+
+	inflateEnd(&stream);
+	return result == Z_STREAM_END;
+}
+
+// a mount point or a device as a metric or file name part, "/" is "root", "/var/log" is "var_log" and "dm-0" is "dm_0"
+std::string getMetricNamePart(std::string_view text)
+{
+	std::string name;
+	for (const char c : text)
+	{
+		const bool isNameChar = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+		if (isNameChar || !name.empty())
+		{
+			name += isNameChar ? c : '_';
+		}
+	}
+	return name.empty() ? "root" : name;
+}
+
+struct DirectoryUsage
+{
+	std::string path;
+	uint64_t sizeBytes = 0;
+};
+
+// adds up the allocated size of everything under the directory that is on the same filesystem
+// visitedEntryCount limits the walk on huge trees, the sizes are partial once it runs out
+uint64_t getDirectoryUsageBytes(int dirFd, dev_t device, int depth, size_t& visitedEntryCount) noexcept
+{
+	DIR* dir = fdopendir(dirFd);
+	if (dir == nullptr)
+	{
+		close(dirFd);
+		return 0;
+	}
+
+	uint64_t sizeBytes = 0;
+	while (const dirent* entry = readdir(dir))
+	{
+		if (visitedEntryCount == 0)
+		{
+			break;
+		}
+		if (std::strcmp(entry->d_name, ".") == 0 || std::strcmp(entry->d_name, "..") == 0)
+		{
+			continue;
+		}
+		--visitedEntryCount;
+
+		struct stat entryStat;
+		if (fstatat(dirfd(dir), entry->d_name, &entryStat, AT_SYMLINK_NOFOLLOW) != 0 || entryStat.st_dev != device)
+		{
+			continue;
+		}
+		sizeBytes += uint64_t(entryStat.st_blocks) * 512;
+
+		// the depth limit keeps the number of open directories bounded
+		if (S_ISDIR(entryStat.st_mode) && depth < 64)
+		{
+			const int childFd = openat(dirfd(dir), entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			if (childFd >= 0)
+			{
+				sizeBytes += getDirectoryUsageBytes(childFd, device, depth + 1, visitedEntryCount);
+			}
+		}
+	}
+	closedir(dir);
+	return sizeBytes;
+}
+
+// du-like report of the biggest top-level directories of a filesystem
+void renderDiskUsageReport(const std::string& mountPath, std::chrono::system_clock::time_point time, std::string& outReport)
+{
+	TraceSpan span("renderDiskUsageReport");
+	outReport.clear();
+	outReport += std::format("Disk usage of {} at {:%Y-%m-%d %H:%M:%OS}\n", mountPath, time);
+
+	struct statvfs fsStat;
+	if (statvfs(mountPath.c_str(), &fsStat) == 0 && fsStat.f_blocks > 0)
+	{
+		const uint64_t totalBytes = uint64_t(fsStat.f_blocks) * fsStat.f_frsize;
+		const uint64_t usedBytes = uint64_t(fsStat.f_blocks - fsStat.f_bfree) * fsStat.f_frsize;
+		outReport += std::format("Used {} of {}, {} available\n", formatByteSize(usedBytes), formatByteSize(totalBytes), formatByteSize(uint64_t(fsStat.f_bavail) * fsStat.f_frsize));
+		if (fsStat.f_files > 0)
+		{
+			outReport += std::format("Inodes used {} of {}\n", fsStat.f_files - fsStat.f_ffree, fsStat.f_files);
+		}
+	}
+
+	const int rootFd = open(mountPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	struct stat rootStat;
+	if (rootFd < 0 || fstat(rootFd, &rootStat) != 0)
+	{
+		outReport += "Could not open the mount point\n";
+		if (rootFd >= 0)
+		{
+			close(rootFd);
+		}
+		return;
+	}
+
+	DIR* rootDir = fdopendir(rootFd);
+	if (rootDir == nullptr)
+	{
+		close(rootFd);
+		return;
+	}
+
+	static constexpr size_t MaxVisitedEntryCount = 2'000'000;
+	size_t visitedEntryCount = MaxVisitedEntryCount;
+	std::vector<DirectoryUsage> usages;
+	while (const dirent* entry = readdir(rootDir))
+	{
+		if (std::strcmp(entry->d_name, ".") == 0 || std::strcmp(entry->d_name, "..") == 0)
+		{
+			continue;
+		}
+
+		struct stat entryStat;
+		if (fstatat(dirfd(rootDir), entry->d_name, &entryStat, AT_SYMLINK_NOFOLLOW) != 0 || entryStat.st_dev != rootStat.st_dev)
+		{
+			continue;
+		}
+
+		DirectoryUsage usage;
+		usage.path = (mountPath == "/") ? std::format("/{}", entry->d_name) : std::format("{}/{}", mountPath, entry->d_name);
+		usage.sizeBytes = uint64_t(entryStat.st_blocks) * 512;
+		if (S_ISDIR(entryStat.st_mode))
+		{
+			const int childFd = openat(dirfd(rootDir), entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			if (childFd >= 0)
+			{
+				usage.sizeBytes += getDirectoryUsageBytes(childFd, rootStat.st_dev, 1, visitedEntryCount);
+			}
+		}
+		usages.push_back(std::move(usage));
+	}
+	closedir(rootDir);
+
+	std::ranges::sort(usages, std::greater<>(), &DirectoryUsage::sizeBytes);
+	static constexpr size_t MaxShownCount = 20;
+	outReport += std::format("\n{:>12}  {}\n", "SIZE", "PATH");
+	for (size_t i = 0; i < std::min(usages.size(), MaxShownCount); ++i)
+	{
+		outReport += std::format("{:>12}  {}\n", formatByteSize(usages[i].sizeBytes), usages[i].path);
+	}
+	if (visitedEntryCount == 0)
+	{
+		outReport += std::format("(stopped after {} entries, the sizes are partial)\n", MaxVisitedEntryCount);
+	}
+}
+
+// the processes that did the most storage I/O, with the totals and the average rate over their lifetime
+void renderIoReport(const ProcessSnapshot& snapshot, std::string& outReport)
+{
+	TraceSpan span("renderIoReport");
+	outReport.clear();
+	outReport += std::format("I/O report at {:%Y-%m-%d %H:%M:%OS}\n", snapshot.time);
+
+	std::vector<const ProcessRecord*> sortedProcesses;
+	sortedProcesses.reserve(snapshot.processes.size());
+	for (const ProcessRecord& process : snapshot.processes)
+	{
+		if (process.ioReadBytes + process.ioWriteBytes > 0)
+		{
+			sortedProcesses.push_back(&process);
+		}
+	}
+
+	static constexpr size_t MaxShownCount = 20;
+	const size_t shownCount = std::min(sortedProcesses.size(), MaxShownCount);
+	std::partial_sort(sortedProcesses.begin(), sortedProcesses.begin() + shownCount, sortedProcesses.end(), [&snapshot](const ProcessRecord* a, const ProcessRecord* b) {
+		return getLifetimeIoBytesPerSec(snapshot, *a) > getLifetimeIoBytesPerSec(snapshot, *b);
+	});
+
+	UserNameCache userNames;
+	outReport += "\nUSER            PID         READ        WRITE       RATE/s COMMAND\n";
+	for (size_t i = 0; i < shownCount; ++i)
+	{
+		const ProcessRecord* process = sortedProcesses[i];
+		outReport += std::format("{:<12} {:>7} {:>12} {:>12} {:>12} {}\n",
+			userNames.getName(process->uid), process->pid, formatByteSize(process->ioReadBytes), formatByteSize(process->ioWriteBytes),
+			formatByteSize(uint64_t(getLifetimeIoBytesPerSec(snapshot, *process))), process->commandLine);
+	}
+	if (sortedProcesses.empty())
+	{
+		outReport += "(no I/O stats could be read, reading other users' processes needs root)\n";
+	}
+}
+
+// indexed by the kernel's TCP state numbers
+constexpr std::array<std::string_view, 13> TcpStateNames{
+	"unknown", "established", "syn_sent", "syn_recv", "fin_wait1", "fin_wait2", "time_wait", "close", "close_wait", "last_ack", "listen", "closing", "new_syn_recv",
+};
+constexpr uint8_t TcpStateEstablished = 1;
+constexpr uint8_t TcpStateCloseWait = 8;
+constexpr uint8_t TcpStateListen = 10;
+
+// bound right away, so the port the replies are addressed to is known before the first request
+int openSockDiagSocket() noexcept
+{
+	const int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+	sockaddr_nl localAddress{};
+	localAddress.nl_family = AF_NETLINK;
+	if (fd >= 0 && bind(fd, reinterpret_cast<const sockaddr*>(&localAddress), sizeof(localAddress)) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// shared by the checking thread and the report writer, a reply with another number is left over from an earlier dump
+std::atomic<uint32_t> gNextSockDiagSequence = 1;
+
+// calls the function for every TCP socket of the address family, the messages are read in place from a fixed buffer
+template<typename Func>
+bool dumpTcpSockets(int netlinkFd, uint8_t family, Func&& onSocket) noexcept
+{
+	sockaddr_nl localAddress{};
+	socklen_t localAddressSize = sizeof(localAddress);
+	if (getsockname(netlinkFd, reinterpret_cast<sockaddr*>(&localAddress), &localAddressSize) != 0)
+	{
+		return false;
+	}
+
+	alignas(nlmsghdr) std::array<char, 32 * 1024> buffer;
+	// finishes a dump that failed part way, the kernel refuses a new one with EBUSY while it runs
+	while (recv(netlinkFd, buffer.data(), buffer.size(), MSG_DONTWAIT) > 0)
+	{
+	}
+
+	struct
+	{
+		nlmsghdr header;
+		inet_diag_req_v2 request;
+	} message{};
+	message.header.nlmsg_len = sizeof(message);
+	message.header.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+	message.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	message.header.nlmsg_seq = gNextSockDiagSequence++;
+	message.header.nlmsg_pid = localAddress.nl_pid;
+	message.request.sdiag_family = family;
+	message.request.sdiag_protocol = IPPROTO_TCP;
+	message.request.idiag_states = ~0u;
+
+	sockaddr_nl kernelAddress{};
+	kernelAddress.nl_family = AF_NETLINK;
+	if (sendto(netlinkFd, &message, sizeof(message), 0, reinterpret_cast<const sockaddr*>(&kernelAddress), sizeof(kernelAddress)) < 0)
+	{
+		return false;
+	}
+
+	bool isFailed = false;
+	while (true)
+	{
+		// after an error the rest of the reply is drained without waiting, the kernel usually sends nothing more
+		const ssize_t bytesRead = recv(netlinkFd, buffer.data(), buffer.size(), isFailed ? MSG_DONTWAIT : 0);
+		if (bytesRead < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (bytesRead <= 0)
+		{
+			return false;
+		}
+
+		int remainingSize = int(bytesRead);
+		for (const nlmsghdr* header = reinterpret_cast<const nlmsghdr*>(buffer.data()); NLMSG_OK(header, remainingSize); header = NLMSG_NEXT(header, remainingSize))
+		{
+			if (header->nlmsg_seq != message.header.nlmsg_seq || header->nlmsg_pid != localAddress.nl_pid)
+			{
+				continue;
+			}
+			if (header->nlmsg_type == NLMSG_DONE)
+			{
+				return !isFailed;
+			}
+			if (header->nlmsg_type == NLMSG_ERROR)
+			{
+				isFailed = true;
+			}
+			else if (!isFailed)
+			{
+				onSocket(*static_cast<const inet_diag_msg*>(NLMSG_DATA(header)));
+			}
+		}
+	}
+}
+
+// the processes holding the most TCP sockets, found by matching the socket inodes with /proc/[pid]/fd
+// sockets in time_wait don't belong to any process anymore and are not counted
+void renderSocketOwnersReport(const ProcessSnapshot& snapshot, std::string& outReport)
+{
+	TraceSpan span("renderSocketOwnersReport");
+	outReport.clear();
+	outReport += std::format("TCP socket owners at {:%Y-%m-%d %H:%M:%OS}\n", snapshot.time);
+
+	struct SocketInode
+	{
+		uint32_t inode = 0;
+		uint8_t state = 0;
+	};
+	std::vector<SocketInode> sockets;
+	const int netlinkFd = openSockDiagSocket();
+	bool isDumped = netlinkFd >= 0;
+	for (const uint8_t family : {uint8_t(AF_INET), uint8_t(AF_INET6)})
+	{
+		isDumped = isDumped && dumpTcpSockets(netlinkFd, family, [&sockets](const inet_diag_msg& socketInfo) {
+			if (socketInfo.idiag_inode != 0)
+			{
+				sockets.push_back({socketInfo.idiag_inode, socketInfo.idiag_state});
+			}
+		});
+	}
+	if (netlinkFd >= 0)
+	{
+		close(netlinkFd);
+	}
+	if (!isDumped)
+	{
+		outReport += "Could not list the sockets with sock_diag\n";
+		return;
+	}
+	std::ranges::sort(sockets, {}, &SocketInode::inode);
+
+	struct SocketOwner
+	{
+		const ProcessRecord* process = nullptr;
+		size_t totalCount = 0;
+		size_t establishedCount = 0;
+		size_t closeWaitCount = 0;
+		size_t listenCount = 0;
+	};
+	std::vector<SocketOwner> owners;
+	const int procDirFd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	std::array<char, 64> linkTarget;
+	for (const ProcessRecord& process : snapshot.processes)
+	{
+		const int fdDirFd = openat(procDirFd, std::format("{}/fd", process.pid).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		DIR* fdDir = (fdDirFd >= 0) ? fdopendir(fdDirFd) : nullptr;
+		if (fdDir == nullptr)
+		{
+			if (fdDirFd >= 0)
+			{
+				close(fdDirFd);
+			}
+			continue;
+		}
+
+		SocketOwner owner;
+		owner.process = &process;
+		while (const dirent* entry = readdir(fdDir))
+		{
+			// links to sockets look like "socket:[12345]"
+			const ssize_t linkSize = readlinkat(dirfd(fdDir), entry->d_name, linkTarget.data(), linkTarget.size());
+			const std::string_view link(linkTarget.data(), size_t(std::max(linkSize, ssize_t(0))));
+			if (!link.starts_with("socket:["))
+			{
+				continue;
+			}
+			size_t position = 8;
+			const uint64_t inode = parseUnsigned(link, position);
+			const auto socketIt = std::ranges::lower_bound(sockets, inode, {}, &SocketInode::inode);
+			if (socketIt == sockets.end() || socketIt->inode != inode)
+			{
+				continue;
+			}
+
+			++owner.totalCount;
+			owner.establishedCount += (socketIt->state == TcpStateEstablished) ? 1 : 0;
+			owner.closeWaitCount += (socketIt->state == TcpStateCloseWait) ? 1 : 0;
+			owner.listenCount += (socketIt->state == TcpStateListen) ? 1 : 0;
+		}
+		closedir(fdDir);
+
+		if (owner.totalCount > 0)
+		{
+			owners.push_back(owner);
+		}
+	}
+	if (procDirFd >= 0)
+	{
+		close(procDirFd);
+	}
+
+	std::ranges::sort(owners, std::greater<>(), &SocketOwner::totalCount);
+	static constexpr size_t MaxShownCount = 20;
+	UserNameCache userNames;
+	outReport += std::format("TCP sockets: {}\n\nUSER            PID    TOTAL    ESTAB CLOSE_WAIT   LISTEN COMMAND\n", sockets.size());
+	for (size_t i = 0; i < std::min(owners.size(), MaxShownCount); ++i)
+	{
+		const SocketOwner& owner = owners[i];
+		outReport += std::format("{:<12} {:>7} {:>8} {:>8} {:>10} {:>8} {}\n",
+			userNames.getName(owner.process->uid), owner.process->pid, owner.totalCount, owner.establishedCount, owner.closeWaitCount, owner.listenCount, owner.process->commandLine);
+	}
+	if (owners.empty())
+	{
+		outReport += "(no socket owners found, reading other users' processes needs root)\n";
+	}
+}
+
+enum class ReportQueueOverflowPolicy
+{
+	// the new report is dropped when all the buffers are busy
+	Drop,
+	// the checks wait for a buffer to become free
+	Block,
+};
+
+// Space-Saving counters of the most frequent keys of a stream, in a fixed amount of memory
+// a key that isn't counted yet replaces the one with the lowest count and takes over its count as the error,
+// so every key seen more than total / capacity times is guaranteed to be counted
+class HeavyHitterCounter
+{
+public:
+	struct Entry
+	{
+		std::string key;
+		uint64_t count = 0;
+		// the count is overestimated by at most this much, it may belong to the keys that were replaced
+		uint64_t error = 0;
+		int64_t lastSeenUnixTime = 0;
+	};
+
+	explicit HeavyHitterCounter(size_t capacity) noexcept
+		: mCapacity(capacity)
+	{
+	}
+
+	void add(std::string_view key, int64_t unixTime)
+	{
+		if (mCapacity == 0)
+		{
+			return;
+		}
+
+		auto it = std::ranges::find(mEntries, key, &Entry::key);
+		if (it == mEntries.end() && mEntries.size() < mCapacity)
+		{
+			it = mEntries.insert(mEntries.end(), Entry{std::string(key), 0, 0, 0});
+		}
+		else if (it == mEntries.end())
+		{
+			it = std::ranges::min_element(mEntries, std::less<>(), &Entry::count);
+			it->key = key;
+			it->error = it->count;
+		}
+		++it->count;
+		it->lastSeenUnixTime = unixTime;
+	}
+
+	// for the entries loaded from a file, the ones with the lowest counts are dropped if there are too many
+	void addEntry(Entry&& entry)
+	{
+		mEntries.push_back(std::move(entry));
+		if (mEntries.size() > mCapacity)
+		{
+			mEntries.erase(std::ranges::min_element(mEntries, std::less<>(), &Entry::count));
+		}
+	}
+
+	void clear() noexcept { mEntries.clear(); }
+	const std::vector<Entry>& getEntries() const noexcept { return mEntries; }
+
+private:
+	const size_t mCapacity;
+	std::vector<Entry> mEntries;
+};
+
+// next to the reports folder, so it doesn't count toward the report file limit
+constexpr const char* TopConsumerHistoryPath = "top_consumers.txt";
+
+// the commands that appear among the top consumers of the reports most often, kept across restarts in a small text file
+// only the report writer thread updates it
+class TopConsumerHistory
+{
+public:
+	// the whole file is rewritten on a save, so it's saved at most this often while reports are written, and when the writer stops
+	static constexpr std::chrono::minutes SaveInterval{10};
+
+	TopConsumerHistory(std::string filePath, size_t capacity)
+		: mFilePath(std::move(filePath))
+		, mMemoryCounter(capacity)
+		, mCpuCounter(capacity)
+	{
+	}
+
+	// a missing file is a new history, a broken one is reported and replaced on the next save
+	bool load()
+	{
+		std::string text;
+		if (!readSmallFile(AT_FDCWD, mFilePath.c_str(), text))
+		{
+			if (errno == ENOENT)
+			{
+				return true;
+			}
+			fprintf(stderr, "Could not read top consumer history '%s'\n", mFilePath.c_str());
+			return false;
+		}
+
+		// "snapshots <count>" and then "memory|cpu <count> <error> <last seen unix time> <command>" per line
+		for (size_t lineStart = 0; lineStart < text.size();)
+		{
+			const size_t lineEnd = std::min(text.find('\n', lineStart), text.size());
+			const std::string_view line = std::string_view(text).substr(lineStart, lineEnd - lineStart);
+			lineStart = lineEnd + 1;
+			if (line.empty() || line.front() == '#')
+			{
+				continue;
+			}
+
+			const size_t spacePosition = std::min(line.find(' '), line.size());
+			const std::string_view kind = line.substr(0, spacePosition);
+			if (kind == "snapshots")
+			{
+				size_t position = spacePosition;
+				mSnapshotCount = parseUnsigned(line, position);
+				continue;
+			}
+
+			HeavyHitterCounter* counter = (kind == "memory") ? &mMemoryCounter : (kind == "cpu") ? &mCpuCounter : nullptr;
+			HeavyHitterCounter::Entry entry;
+			size_t position = spacePosition;
+			entry.count = parseUnsigned(line, position);
+			entry.error = parseUnsigned(line, position);
+			entry.lastSeenUnixTime = int64_t(parseUnsigned(line, position));
+			if (counter == nullptr || position + 1 >= line.size() || entry.count == 0)
+			{
+				fprintf(stderr, "Top consumer history '%s' is malformed, starting a new one\n", mFilePath.c_str());
+				mSnapshotCount = 0;
+				mMemoryCounter.clear();
+				mCpuCounter.clear();
+				return false;
+			}
+			entry.key = line.substr(position + 1);
+			counter->addEntry(std::move(entry));
+		}
+		return true;
+	}
+
+	// counts the commands of the processes with the highest RSS and CPU, a command counts once per snapshot
+	void addSnapshot(const ProcessSnapshot& snapshot)
+	{
+		TraceSpan span("addTopConsumers");
+		static constexpr size_t TopProcessCount = 5;
+		const int64_t unixTime = std::chrono::duration_cast<std::chrono::seconds>(snapshot.time.time_since_epoch()).count();
+		++mSnapshotCount;
+		mHasUnsavedChanges = true;
+
+		std::vector<const ProcessRecord*> processes;
+		processes.reserve(snapshot.processes.size());
+		for (const ProcessRecord& process : snapshot.processes)
+		{
+			processes.push_back(&process);
+		}
+		const size_t topCount = std::min(TopProcessCount, processes.size());
+
+		auto addTopCommands = [&](HeavyHitterCounter& counter) {
+			std::array<std::string, TopProcessCount> commands;
+			size_t commandCount = 0;
+			for (size_t i = 0; i < topCount; ++i)
+			{
+				// the history file has one entry per line
+				std::string command = processes[i]->command;
+				std::ranges::replace_if(command, [](char c) { return static_cast<unsigned char>(c) < 0x20; }, '?');
+				if (std::find(commands.begin(), commands.begin() + commandCount, command) == commands.begin() + commandCount)
+				{
+					counter.add(command, unixTime);
+					commands[commandCount++] = std::move(command);
+				}
+			}
+		};
+
+		std::partial_sort(processes.begin(), processes.begin() + ptrdiff_t(topCount), processes.end(), [](const ProcessRecord* a, const ProcessRecord* b) {
+			return a->residentMemoryKb > b->residentMemoryKb;
+		});
+		addTopCommands(mMemoryCounter);
+		std::partial_sort(processes.begin(), processes.begin() + ptrdiff_t(topCount), processes.end(), [&snapshot](const ProcessRecord* a, const ProcessRecord* b) {
+			return getLifetimeCpuPct(snapshot, *a) > getLifetimeCpuPct(snapshot, *b);
+		});
+		addTopCommands(mCpuCounter);
+	}
+
+	bool saveIfDue(std::chrono::steady_clock::time_point timeNow)
+	{
+		if (timeNow < mNextSaveTime)
+		{
+			return true;
+		}
+		mNextSaveTime = timeNow + SaveInterval;
+		return save();
+	}
+
+	// written to a temporary file and synced first, so a crash doesn't lose the history
+	bool save()
+	{
+		if (!mHasUnsavedChanges)
+		{
+			return true;
+		}
+
+		std::string text = "# resource_alert top consumer history\n";
+		text += std::format("snapshots {}\n", mSnapshotCount);
+		for (const auto& [kind, counter] : {std::pair("memory", &mMemoryCounter), std::pair("cpu", &mCpuCounter)})
+		{
+			for (const HeavyHitterCounter::Entry& entry : counter->getEntries())
+			{
+				text += std::format("{} {} {} {} {}\n", kind, entry.count, entry.error, entry.lastSeenUnixTime, entry.key);
+			}
+		}
+
+		const std::string temporaryPath = mFilePath + ".tmp";
+		FILE* file = fopen(temporaryPath.c_str(), "wb");
+		if (file == nullptr)
+		{
+			return false;
+		}
+		const bool isWritten = fwrite(text.data(), 1, text.size(), file) == text.size() && fflush(file) == 0 && fsync(fileno(file)) == 0;
+		if (fclose(file) != 0 || !isWritten || rename(temporaryPath.c_str(), mFilePath.c_str()) != 0)
+		{
+			return false;
+		}
+		mHasUnsavedChanges = false;
+		return true;
+	}
+
+	void render(std::string& outText) const
+	{
+		outText += std::format("Top consumers over {} reports\n", mSnapshotCount);
+		for (const auto& [title, counter] : {std::pair("by memory", &mMemoryCounter), std::pair("by CPU", &mCpuCounter)})
+		{
+			std::vector<const HeavyHitterCounter::Entry*> entries;
+			for (const HeavyHitterCounter::Entry& entry : counter->getEntries())
+			{
+				entries.push_back(&entry);
+			}
+			std::ranges::sort(entries, std::greater<>(), &HeavyHitterCounter::Entry::count);
+
+			outText += std::format("\n=== Most frequent top consumers {} ===\n", title);
+			outText += "   COUNT  MAX ERROR   %REPORTS LAST SEEN           COMMAND\n";
+			for (const HeavyHitterCounter::Entry* entry : entries)
+			{
+				// a command counts once per report, only the error can push the count over the number of reports
+				const double reportsPct = (mSnapshotCount == 0) ? 0.0 : double(std::min(entry->count, mSnapshotCount)) / double(mSnapshotCount) * 100.0;
+				outText += std::format("{:>8} {:>10} {:>10.1f} {:%Y-%m-%d %H:%M:%OS} {}\n", entry->count, entry->error, reportsPct,
+					std::chrono::system_clock::time_point(std::chrono::seconds(entry->lastSeenUnixTime)), entry->key);
+			}
+		}
+	}
+
+private:
+	std::string mFilePath;
+	uint64_t mSnapshotCount = 0;
+	HeavyHitterCounter mMemoryCounter;
+	HeavyHitterCounter mCpuCounter;
+	bool mHasUnsavedChanges = false;
+	std::chrono::steady_clock::time_point mNextSaveTime;
+};
+
+// the report to render, filled by the checking thread in a preallocated buffer
+struct ReportJob
+{
+	ProcessSnapshot snapshot;
+	float memConsumptionPct = 0.0f;
+	float cpuConsumptionPct = 0.0f;
+	// only in the text reports
+	MemoryPressureStats memoryPressure;
+	// mount points to write a disk usage report for, next to the process report
+	std::vector<std::string> diskUsageMounts;
+	// write a report of the processes holding the most TCP sockets
+	bool shouldReportSocketOwners = false;
+};
+
+struct ReportWriterStats
+{
+	uint64_t submittedCount = 0;
+	uint64_t writtenCount = 0;
+	// the queue was full and the policy is to drop
+	uint64_t droppedCount = 0;
+	uint64_t failedCount = 0;
+	// time the checking thread spent waiting for a free buffer
+	uint64_t blockedTimeNs = 0;
+};
+
+struct ReportWriterSettings
+{
+	ReportFormat format = ReportFormat::Text;
+	// zero disables compression
+	int compressionLevel = 0;
+	// zero or one disables delta reports
+	size_t keyframeInterval = 0;
+	ReportQueueOverflowPolicy overflowPolicy = ReportQueueOverflowPolicy::Drop;
+	// fdatasync after this many reports, zero leaves it to the kernel
+	size_t syncBatchSize = 0;
+	// if set, reports are appended to the log, only the writer thread appends to it
+	ReportLogWriter* logWriter = nullptr;
+	// if set, every report is added to it and the history is saved
+	TopConsumerHistory* topConsumerHistory = nullptr;
+};
+
+// renders, compresses and writes reports on a dedicated thread, so a saturated disk doesn't delay the checks
+// jobs go through a single-producer single-consumer ring of preallocated buffers
+class ReportWriter
+{
+public:
+	explicit ReportWriter(const ReportWriterSettings& settings)
+		: mSettings(settings)
+		, mDeltaEncoder(settings.keyframeInterval)
+		, mThread([this]{ run(); })
+	{
+	}
+
+	~ReportWriter() noexcept
+	{
+		mIsStopping.store(true, std::memory_order_release);
+		wakeUp(mWriterWakeUps);
+		mThread.join();
+	}
+
+	ReportWriter(const ReportWriter&) = delete;
+	ReportWriter& operator=(const ReportWriter&) = delete;
+
+	// returns a buffer to fill and pass to submitJob(), or nullptr if the report has to be dropped
+	ReportJob* acquireJob() noexcept
+	{
+		const uint64_t head = mHead.load(std::memory_order_relaxed);
+		if (head - mTail.load(std::memory_order_acquire) < QueueCapacity)
+		{
+			return &mJobs[head % QueueCapacity];
+		}
+
+		if (mSettings.overflowPolicy == ReportQueueOverflowPolicy::Drop)
+		{
+			mDroppedCount.fetch_add(1, std::memory_order_relaxed);
+			return nullptr;
+		}
+
+		TraceSpan span("reportQueueBackpressure");
+		const uint64_t waitStartNs = getMonotonicTimeNs();
+		while (head - mTail.load(std::memory_order_acquire) >= QueueCapacity)
+		{
+			const uint32_t wakeUps = mCheckerWakeUps.load(std::memory_order_acquire);
+			if (head - mTail.load(std::memory_order_acquire) >= QueueCapacity)
+			{
+				mCheckerWakeUps.wait(wakeUps, std::memory_order_acquire);
+			}
+		}
+		mBlockedTimeNs.fetch_add(getMonotonicTimeNs() - waitStartNs, std::memory_order_relaxed);
+		return &mJobs[head % QueueCapacity];
+	}
+
+	void submitJob() noexcept
+	{
+		mHead.store(mHead.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		wakeUp(mWriterWakeUps);
+	}
+
+	ReportWriterStats getStats() const noexcept
+	{
+		ReportWriterStats stats;
+		stats.submittedCount = mHead.load(std::memory_order_relaxed);
+		stats.writtenCount = mWrittenCount.load(std::memory_order_relaxed);
+		stats.droppedCount = mDroppedCount.load(std::memory_order_relaxed);
+		stats.failedCount = mFailedCount.load(std::memory_order_relaxed);
+		stats.blockedTimeNs = mBlockedTimeNs.load(std::memory_order_relaxed);
+		return stats;
+	}
+
+private:
+	static constexpr size_t QueueCapacity = 4;
+
+	static void wakeUp(std::atomic<uint32_t>& wakeUps) noexcept
+	{
+		wakeUps.fetch_add(1, std::memory_order_release);
+		wakeUps.notify_one();
+	}
+
+	void run() noexcept
+	{
+		setTraceThreadName("reportWriter");
+		uint64_t tail = mTail.load(std::memory_order_relaxed);
+		while (true)
+		{
+			const uint32_t wakeUps = mWriterWakeUps.load(std::memory_order_acquire);
+			if (tail == mHead.load(std::memory_order_acquire))
+			{
+				if (mIsStopping.load(std::memory_order_acquire))
+				{
+					syncPendingWrites();
+					if (mSettings.topConsumerHistory && !mSettings.topConsumerHistory->save())
+					{
+						fprintf(stderr, "Could not save the top consumer history\n");
+					}
+					return;
+				}
+				mWriterWakeUps.wait(wakeUps, std::memory_order_acquire);
+				continue;
+			}
+
+			if (writeJob(mJobs[tail % QueueCapacity]))
+			{
+				mWrittenCount.fetch_add(1, std::memory_order_relaxed);
+			}
+			else
+			{
+				fprintf(stderr, "Could not save report\n");
+				mFailedCount.fetch_add(1, std::memory_order_relaxed);
+				// the next delta would depend on the lost report
+				mDeltaEncoder.reset();
+			}
+
+			++tail;
+			mTail.store(tail, std::memory_order_release);
+			wakeUp(mCheckerWakeUps);
+		}
+	}
+
+	bool writeJob(const ReportJob& job) noexcept
+	{
+		TraceSpan span("writeReport");
+		const char* extension = "txt";
+		uint32_t flags = 0;
+		if (mSettings.format == ReportFormat::Binary)
+		{
+			UserNameCache userNames;
+			if (mSettings.keyframeInterval > 1)
+			{
+				const BinaryReportKind kind = mDeltaEncoder.encode(job.snapshot, job.memConsumptionPct, job.cpuConsumptionPct, userNames, mReportBuffer);
+				flags = (kind == BinaryReportKind::Delta) ? ReportLogDeltaFlag : 0;
+			}
+			else
+			{
+				encodeBinaryReport(job.snapshot, job.memConsumptionPct, job.cpuConsumptionPct, userNames, mReportBuffer);
+			}
+			extension = "rab";
+		}
+		else
+		{
+			renderCombinedReport(job.snapshot, job.memConsumptionPct, job.cpuConsumptionPct, job.memoryPressure, mReportBuffer);
+		}
+
+		const std::string filePath = std::format("reports/report_{:%y%m%d_%H%M%OS}_mem{}_cpu{}.{}", job.snapshot.time, int(job.memConsumptionPct), int(job.cpuConsumptionPct), extension);
+		bool isWritten = saveReport(job.snapshot.time, mSettings.format, flags, filePath);
+		for (const std::string& mountPath : job.diskUsageMounts)
+		{
+			renderDiskUsageReport(mountPath, job.snapshot.time, mReportBuffer);
+			const std::string diskFilePath = std::format("reports/disk_{:%y%m%d_%H%M%OS}_{}.txt", job.snapshot.time, getMetricNamePart(mountPath));
+			isWritten = saveReport(job.snapshot.time, ReportFormat::Text, 0, diskFilePath) && isWritten;
+		}
+		if (job.shouldReportSocketOwners)
+		{
+			renderSocketOwnersReport(job.snapshot, mReportBuffer);
+			const std::string socketFilePath = std::format("reports/sockets_{:%y%m%d_%H%M%OS}.txt", job.snapshot.time);
+			isWritten = saveReport(job.snapshot.time, ReportFormat::Text, 0, socketFilePath) && isWritten;
+		}
+		if (job.snapshot.hasIoStats)
+		{
+			renderIoReport(job.snapshot, mReportBuffer);
+			const std::string ioFilePath = std::format("reports/io_{:%y%m%d_%H%M%OS}.txt", job.snapshot.time);
+			isWritten = saveReport(job.snapshot.time, ReportFormat::Text, 0, ioFilePath) && isWritten;
+		}
+		if (mSettings.topConsumerHistory)
+		{
+			mSettings.topConsumerHistory->addSnapshot(job.snapshot);
+			isWritten = mSettings.topConsumerHistory->saveIfDue(std::chrono::steady_clock::now()) && isWritten;
+		}
+		return isWritten;
+	}
+
+	// writes the rendered report to the log or to a file, the file path is without the compression extension
+	bool saveReport(std::chrono::system_clock::time_point time, ReportFormat format, uint32_t flags, const std::string& filePath) noexcept
+	{
+		bool isWritten = false;
+		if (mSettings.logWriter)
+		{
+			std::string_view payload = mReportBuffer;
+			if (mSettings.compressionLevel > 0)
+			{
+				mCompressedBuffer.clear();
+				if (!compressGzip(mReportBuffer, mSettings.compressionLevel, [this](std::string_view chunk) { mCompressedBuffer += chunk; return true; }))
+				{
+					return false;
+				}
+				payload = mCompressedBuffer;
+				flags |= ReportLogCompressedFlag;
+			}
+			isWritten = mSettings.logWriter->append(time, format, flags, payload) && mSettings.logWriter->flush();
+		}
+		else
+		{
+			isWritten = writeFile((mSettings.compressionLevel > 0) ? filePath + ".gz" : filePath);
+		}
+
+		if (isWritten && mSettings.syncBatchSize > 0 && ++mUnsyncedReportCount >= mSettings.syncBatchSize)
+		{
+			isWritten = syncPendingWrites();
+		}
+		return isWritten;
+	}
+
+	bool writeFile(const std::string& filePath) noexcept
+	{
+		const int fd = open(filePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd < 0)
+		{
+			return false;
+		}
+
+		auto writeAll = [fd](std::string_view data) {
+			while (!data.empty())
+			{
+				const ssize_t bytesWritten = write(fd, data.data(), data.size());
+				if (bytesWritten < 0 && errno == EINTR)
+				{
+					continue;
+				}
+				if (bytesWritten <= 0)
+				{
+					return false;
+				}
+				data.remove_prefix(size_t(bytesWritten));
+			}
+			return true;
+		};
+
+		// the compressed file is written as the data is produced, without holding all of it in memory
+		const bool isWritten = (mSettings.compressionLevel > 0) ? compressGzip(mReportBuffer, mSettings.compressionLevel, writeAll) : writeAll(mReportBuffer);
+		if (isWritten && mSettings.syncBatchSize > 0)
+		{
+			// synced and closed with the rest of the batch
+			mUnsyncedFds.push_back(fd);
+		}
+		else
+		{
+			close(fd);
+		}
+		return isWritten;
+	}
+
+	bool syncPendingWrites() noexcept
+	{
+		if (mUnsyncedReportCount == 0)
+		{
+			return true;
+		}
+
+		TraceSpan span("syncReports");
+		bool isSynced = true;
+		if (mSettings.logWriter)
+		{
+			isSynced = mSettings.logWriter->sync();
+		}
+		else
+		{
+			for (const int fd : mUnsyncedFds)
+			{
+				isSynced = (fdatasync(fd) == 0) && isSynced;
+				close(fd);
+			}
+			mUnsyncedFds.clear();
+
+			// new files are only durable when the directory entries are
+			const int dirFd = open("reports", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if (dirFd >= 0)
+			{
+				isSynced = (fsync(dirFd) == 0) && isSynced;
+				close(dirFd);
+			}
+		}
+		mUnsyncedReportCount = 0;
+		return isSynced;
+	}
+
+private:
+	const ReportWriterSettings mSettings;
+	std::array<ReportJob, QueueCapacity> mJobs;
+	// monotonic counters, the job index is the counter modulo the capacity
+	std::atomic<uint64_t> mHead = 0;
+	std::atomic<uint64_t> mTail = 0;
+	std::atomic<uint32_t> mWriterWakeUps = 0;
+	std::atomic<uint32_t> mCheckerWakeUps = 0;
+	std::atomic<bool> mIsStopping = false;
+	std::atomic<uint64_t> mWrittenCount = 0;
+	std::atomic<uint64_t> mDroppedCount = 0;
+	std::atomic<uint64_t> mFailedCount = 0;
+	std::atomic<uint64_t> mBlockedTimeNs = 0;
+
+	// used only by the writer thread
+	BinaryReportDeltaEncoder mDeltaEncoder;
+	std::string mReportBuffer;
+	std::string mCompressedBuffer;
+	size_t mUnsyncedReportCount = 0;
+	std::vector<int> mUnsyncedFds;
+
+	// started last, after all the other members are initialized
+	std::thread mThread;
+};
+
+// the latest value of every metric, rules refer to the metrics by their index
+// a metric that couldn't be collected is NaN, every comparison with it is NaN too, which is false for a rule
+class MetricTable
+{
+public:
+	static constexpr size_t MemMetric = 0;
+	static constexpr size_t CpuMetric = 1;
+	static constexpr size_t CpuCoreMaxMetric = 2;
+	// the monitor's own metrics, in seconds
+	static constexpr size_t SelfCheckIntervalMetric = 3;
+	static constexpr size_t SelfCheckDurationMetric = 4;
+	// the worst of all the monitored filesystems
+	static constexpr size_t DiskUsedPctMaxMetric = 5;
+	static constexpr size_t DiskInodesUsedPctMaxMetric = 6;
+	static constexpr size_t DiskHoursToFullMinMetric = 7;
+	// the busiest of all the block devices
+	static constexpr size_t DiskIoAwaitMsMaxMetric = 8;
+	static constexpr size_t DiskIoQueueDepthMaxMetric = 9;
+	static constexpr size_t DiskIoUtilPctMaxMetric = 10;
+	// the sums over all the network interfaces
+	static constexpr size_t NetRxBytesPerSecMetric = 11;
+	static constexpr size_t NetTxBytesPerSecMetric = 12;
+	static constexpr size_t NetErrorsPerSecMetric = 13;
+	static constexpr size_t NetDropsPerSecMetric = 14;
+	// dropped packets out of all the packets of all the interfaces
+	static constexpr size_t NetDropPctMetric = 15;
+	// TCP sockets in all the states, the per-state counts are added by the socket collector
+	static constexpr size_t TcpTotalMetric = 16;
+	// from /proc/vmstat, swapping is in pages
+	static constexpr size_t VmSwapInPerSecMetric = 17;
+	static constexpr size_t VmSwapOutPerSecMetric = 18;
+	static constexpr size_t VmMajorFaultsPerSecMetric = 19;
+	static constexpr size_t VmAllocStallsPerSecMetric = 20;
+	// new OOM kills since the previous check
+	static constexpr size_t VmOomKillsMetric = 21;
+
+	MetricTable()
+	{
+		addMetric("mem");
+		addMetric("cpu");
+		addMetric("cpu.core_max");
+		addMetric("self.check_interval");
+		addMetric("self.check_duration");
+		addMetric("disk.used_pct_max");
+		addMetric("disk.inodes_used_pct_max");
+		addMetric("disk.hours_to_full_min");
+		addMetric("diskio.await_ms_max");
+		addMetric("diskio.queue_depth_max");
+		addMetric("diskio.util_pct_max");
+		addMetric("net.rx_bytes_per_sec");
+		addMetric("net.tx_bytes_per_sec");
+		addMetric("net.errors_per_sec");
+		addMetric("net.drops_per_sec");
+		addMetric("net.drop_pct");
+		addMetric("tcp.total");
+		addMetric("vm.swap_in_per_sec");
+		addMetric("vm.swap_out_per_sec");
+		addMetric("vm.major_faults_per_sec");
+		addMetric("vm.alloc_stalls_per_sec");
+		addMetric("vm.oom_kills");
+	}
+
+	size_t addMetric(std::string_view name)
+	{
+		if (const std::optional<size_t> index = findMetric(name); index.has_value())
+		{
+			return *index;
+		}
+
+		mNames.emplace_back(name);
+		mValues.push_back(std::numeric_limits<double>::quiet_NaN());
+		return mNames.size() - 1;
+	}
+
+	std::optional<size_t> findMetric(std::string_view name) const noexcept
+	{
+		for (size_t i = 0; i < mNames.size(); ++i)
+		{
+			if (mNames[i] == name)
+			{
+				return i;
+			}
+		}
+		return std::nullopt;
+	}
+
+	void setValue(size_t index, double value) noexcept { mValues[index] = value; }
+	double getValue(size_t index) const noexcept { return mValues[index]; }
+	const std::string& getName(size_t index) const noexcept { return mNames[index]; }
+	const double* getValues() const noexcept { return mValues.data(); }
+	size_t getSize() const noexcept { return mValues.size(); }
+
+private:
+	std::vector<std::string> mNames;
+	std::vector<double> mValues;
+};
+
+// busy percentage of the busiest core since the previous sample, from /proc/stat
+class CpuCoreSampler
+{
+public:
+	// NaN on the first sample, or if /proc/stat couldn't be read
+	double sampleMaxCorePct(std::string& buffer) noexcept
+	{
+		double maxCorePct = std::numeric_limits<double>::quiet_NaN();
+		if (!readSmallFile(AT_FDCWD, "/proc/stat", buffer))
+		{
+			return maxCorePct;
+		}
+
+		const std::string_view text = buffer;
+		size_t coreIndex = 0;
+		for (size_t lineStart = 0; lineStart < text.size();)
+		{
+			const size_t lineEnd = std::min(text.find('\n', lineStart), text.size());
+			// per-core lines are "cpuN user nice system idle iowait irq softirq steal ...", the first one is the total
+			if (text.compare(lineStart, 3, "cpu") == 0 && lineStart + 3 < lineEnd && text[lineStart + 3] >= '0' && text[lineStart + 3] <= '9')
+			{
+				const std::string_view line = text.substr(lineStart, lineEnd - lineStart);
+				size_t position = 0;
+				skipFields(line, position, 1);
+				CoreTimes times;
+				for (int field = 0; field < 8; ++field)
+				{
+					const uint64_t ticks = parseUnsigned(line, position);
+					times.totalTicks += ticks;
+					// idle and iowait
+					if (field == 3 || field == 4)
+					{
+						times.idleTicks += ticks;
+					}
+				}
+
+				if (coreIndex < mPreviousTimes.size())
+				{
+					const CoreTimes& previous = mPreviousTimes[coreIndex];
+					if (times.totalTicks > previous.totalTicks)
+					{
+						const double totalDelta = double(times.totalTicks - previous.totalTicks);
+						const double idleDelta = double(times.idleTicks - std::min(times.idleTicks, previous.idleTicks));
+						const double corePct = (totalDelta - std::min(idleDelta, totalDelta)) * 100.0 / totalDelta;
+						maxCorePct = std::isnan(maxCorePct) ? corePct : std::max(maxCorePct, corePct);
+					}
+					mPreviousTimes[coreIndex] = times;
+				}
+				else
+				{
+					mPreviousTimes.push_back(times);
+				}
+				++coreIndex;
+			}
+			lineStart = lineEnd + 1;
+		}
+
+		// cores went offline
+		mPreviousTimes.resize(coreIndex);
+		return maxCorePct;
+	}
+
+private:
+	struct CoreTimes
+	{
+		uint64_t totalTicks = 0;
+		uint64_t idleTicks = 0;
+	};
+
+	std::vector<CoreTimes> mPreviousTimes;
+};
+
+// filesystem space and inode usage from statvfs, with the fill rate projected to the time until the filesystem is full
+class DiskCollector
+{
+public:
+	// monitors the comma-separated mount points, or all the real filesystems from /proc/self/mountinfo if the list is empty
+	DiskCollector(MetricTable& metrics, std::string_view mountList)
+	{
+		if (mountList.empty())
+		{
+			discoverMounts();
+		}
+		else
+		{
+			while (!mountList.empty())
+			{
+				const size_t commaPosition = std::min(mountList.find(','), mountList.size());
+				if (commaPosition > 0)
+				{
+					addMount(std::string(mountList.substr(0, commaPosition)));
+				}
+				mountList.remove_prefix(std::min(commaPosition + 1, mountList.size()));
+			}
+		}
+
+		// the names drop the separators, so e.g. / and /root or /var/log and /var_log would share their metrics
+		std::vector<std::string> mountNames;
+		for (Mount& mount : mMounts)
+		{
+			const std::string baseName = getMetricNamePart(mount.path);
+			std::string mountName = baseName;
+			for (size_t suffix = 2; std::ranges::find(mountNames, mountName) != mountNames.end(); ++suffix)
+			{
+				mountName = std::format("{}_{}", baseName, suffix);
+			}
+			if (mountName != baseName)
+			{
+				fprintf(stderr, "The metrics of mount point '%s' are disk.%s.*, disk.%s.* is taken by another mount point\n", mount.path.c_str(), mountName.c_str(), baseName.c_str());
+			}
+			mountNames.push_back(mountName);
+
+			const std::string prefix = std::format("disk.{}.", mountName);
+			mount.usedPctMetric = metrics.addMetric(prefix + "used_pct");
+			mount.inodesUsedPctMetric = metrics.addMetric(prefix + "inodes_used_pct");
+			mount.hoursToFullMetric = metrics.addMetric(prefix + "hours_to_full");
+		}
+	}
+
+	void collect(MetricTable& metrics, std::chrono::steady_clock::time_point timeNow) noexcept
+	{
+		TraceSpan span("collectDisks");
+		double maxUsedPct = std::numeric_limits<double>::quiet_NaN();
+		double maxInodesUsedPct = std::numeric_limits<double>::quiet_NaN();
+		double minHoursToFull = std::numeric_limits<double>::quiet_NaN();
+		for (Mount& mount : mMounts)
+		{
+			struct statvfs fsStat;
+			if (statvfs(mount.path.c_str(), &fsStat) != 0 || fsStat.f_blocks == 0)
+			{
+				metrics.setValue(mount.usedPctMetric, std::numeric_limits<double>::quiet_NaN());
+				metrics.setValue(mount.inodesUsedPctMetric, std::numeric_limits<double>::quiet_NaN());
+				metrics.setValue(mount.hoursToFullMetric, std::numeric_limits<double>::quiet_NaN());
+				mount.hasPreviousSample = false;
+				continue;
+			}
+
+			// like df, the space reserved for root doesn't count as available
+			const uint64_t usedBlocks = fsStat.f_blocks - fsStat.f_bfree;
+			const double usedPct = double(usedBlocks) * 100.0 / double(usedBlocks + fsStat.f_bavail);
+			const double inodesUsedPct = (fsStat.f_files > 0) ? double(fsStat.f_files - fsStat.f_ffree) * 100.0 / double(fsStat.f_files) : std::numeric_limits<double>::quiet_NaN();
+
+			const double usedBytes = double(usedBlocks) * double(fsStat.f_frsize);
+			const double availableBytes = double(fsStat.f_bavail) * double(fsStat.f_frsize);
+			if (mount.hasPreviousSample)
+			{
+				const double elapsedSec = std::chrono::duration<double>(timeNow - mount.previousSampleTime).count();
+				if (elapsedSec > 0.0)
+				{
+					// smoothed, so one big temporary file doesn't predict a full disk for hours
+					const double rateBytesPerSec = (usedBytes - mount.previousUsedBytes) / elapsedSec;
+					mount.fillRateBytesPerSec += (rateBytesPerSec - mount.fillRateBytesPerSec) * FillRateSmoothing;
+				}
+			}
+			else
+			{
+				mount.fillRateBytesPerSec = 0.0;
+			}
+			mount.previousUsedBytes = usedBytes;
+			mount.previousSampleTime = timeNow;
+			mount.hasPreviousSample = true;
+
+			const double hoursToFull = (mount.fillRateBytesPerSec > 0.0) ? availableBytes / mount.fillRateBytesPerSec / 3600.0 : std::numeric_limits<double>::infinity();
+			metrics.setValue(mount.usedPctMetric, usedPct);
+			metrics.setValue(mount.inodesUsedPctMetric, inodesUsedPct);
+			metrics.setValue(mount.hoursToFullMetric, hoursToFull);
+
+			maxUsedPct = std::isnan(maxUsedPct) ? usedPct : std::max(maxUsedPct, usedPct);
+			if (!std::isnan(inodesUsedPct))
+			{
+				maxInodesUsedPct = std::isnan(maxInodesUsedPct) ? inodesUsedPct : std::max(maxInodesUsedPct, inodesUsedPct);
+			}
+			minHoursToFull = std::isnan(minHoursToFull) ? hoursToFull : std::min(minHoursToFull, hoursToFull);
+		}
+
+		metrics.setValue(MetricTable::DiskUsedPctMaxMetric, maxUsedPct);
+		metrics.setValue(MetricTable::DiskInodesUsedPctMaxMetric, maxInodesUsedPct);
+		metrics.setValue(MetricTable::DiskHoursToFullMinMetric, minHoursToFull);
+	}
+
+	// the mount point a disk metric is about, for the aggregated metrics the one with the worst value
+	std::optional<std::string_view> findMountForMetric(const MetricTable& metrics, size_t metricIndex) const noexcept
+	{
+		const Mount* worstMount = nullptr;
+		for (const Mount& mount : mMounts)
+		{
+			if (metricIndex == mount.usedPctMetric || metricIndex == mount.inodesUsedPctMetric || metricIndex == mount.hoursToFullMetric)
+			{
+				return mount.path;
+			}
+
+			auto isWorse = [&](size_t mountMetric, bool isHigherWorse) {
+				const double value = metrics.getValue(mountMetric);
+				if (std::isnan(value))
+				{
+					return false;
+				}
+				if (worstMount == nullptr)
+				{
+					return true;
+				}
+				const double worstValue = metrics.getValue(mountMetric == mount.usedPctMetric ? worstMount->usedPctMetric
+					: mountMetric == mount.inodesUsedPctMetric ? worstMount->inodesUsedPctMetric : worstMount->hoursToFullMetric);
+				return isHigherWorse ? value > worstValue : value < worstValue;
+			};
+
+			if ((metricIndex == MetricTable::DiskUsedPctMaxMetric && isWorse(mount.usedPctMetric, true))
+				|| (metricIndex == MetricTable::DiskInodesUsedPctMaxMetric && isWorse(mount.inodesUsedPctMetric, true))
+				|| (metricIndex == MetricTable::DiskHoursToFullMinMetric && isWorse(mount.hoursToFullMetric, false)))
+			{
+				worstMount = &mount;
+			}
+		}
+
+		if (worstMount == nullptr)
+		{
+			return std::nullopt;
+		}
+		return worstMount->path;
+	}
+
+private:
+	static constexpr double FillRateSmoothing = 0.3;
+
+	struct Mount
+	{
+		std::string path;
+		size_t usedPctMetric = 0;
+		size_t inodesUsedPctMetric = 0;
+		size_t hoursToFullMetric = 0;
+		bool hasPreviousSample = false;
+		double previousUsedBytes = 0.0;
+		std::chrono::steady_clock::time_point previousSampleTime;
+		double fillRateBytesPerSec = 0.0;
+	};
+
+	// octal escapes like "\040" for a space are used in /proc/self/mountinfo
+	static std::string unescapeMountPath(std::string_view path)
+	{
+		std::string result;
+		for (size_t i = 0; i < path.size(); ++i)
+		{
+			if (path[i] == '\\' && i + 3 < path.size())
+			{
+				result += char((path[i + 1] - '0') * 64 + (path[i + 2] - '0') * 8 + (path[i + 3] - '0'));
+				i += 3;
+			}
+			else
+			{
+				result += path[i];
+			}
+		}
+		return result;
+	}
+
+	void discoverMounts()
+	{
+		std::string text;
+		if (!readSmallFile(AT_FDCWD, "/proc/self/mountinfo", text))
+		{
+			fprintf(stderr, "Could not read /proc/self/mountinfo, disks are not monitored\n");
+			return;
+		}
+
+		// filesystems that don't store data on a device
+		static constexpr std::string_view virtualTypes[] = {
+			"autofs", "binfmt_misc", "bpf", "cgroup", "cgroup2", "configfs", "debugfs", "devpts", "devtmpfs", "efivarfs", "fusectl", "hugetlbfs",
+			"mqueue", "nsfs", "overlay", "proc", "pstore", "ramfs", "rpc_pipefs", "securityfs", "selinuxfs", "squashfs", "sysfs", "tmpfs", "tracefs",
+		};
+
+		std::vector<std::string_view> seenDevices;
+		const std::string_view textView = text;
+		for (size_t lineStart = 0; lineStart < textView.size();)
+		{
+			const size_t lineEnd = std::min(textView.find('\n', lineStart), textView.size());
+			const std::string_view line = textView.substr(lineStart, lineEnd - lineStart);
+			lineStart = lineEnd + 1;
+
+			// "id parentId major:minor root mountPoint options [optional fields] - fsType source superOptions"
+			size_t position = 0;
+			auto nextField = [&]() {
+				while (position < line.size() && line[position] == ' ')
+				{
+					++position;
+				}
+				const size_t start = position;
+				skipFields(line, position, 1);
+				return line.substr(start, position - start);
+			};
+
+			nextField();
+			nextField();
+			const std::string_view device = nextField();
+			nextField();
+			const std::string_view mountPoint = nextField();
+			const size_t separatorPosition = line.find(" - ", position);
+			if (separatorPosition == std::string_view::npos)
+			{
+				continue;
+			}
+			position = separatorPosition + 3;
+			const std::string_view fsType = nextField();
+
+			// bind mounts show the same filesystem again
+			if (std::ranges::find(virtualTypes, fsType) != std::end(virtualTypes) || fsType.starts_with("fuse.")
+				|| std::ranges::find(seenDevices, device) != seenDevices.end())
+			{
+				continue;
+			}
+			seenDevices.push_back(device);
+			addMount(unescapeMountPath(mountPoint));
+		}
+	}
+
+	void addMount(std::string path)
+	{
+		if (std::ranges::find(mMounts, path, &Mount::path) == mMounts.end())
+		{
+			Mount mount;
+			mount.path = std::move(path);
+			mMounts.push_back(std::move(mount));
+		}
+	}
+
+private:
+	std::vector<Mount> mMounts;
+};
+
+// per-device IOPS, throughput, queue depth, await and utilization from the counter deltas in /proc/diskstats
+class DiskIoCollector
+{
+public:
+	// monitors the whole disks from /sys/block, partitions are already counted in their disks
+	explicit DiskIoCollector(MetricTable& metrics)
+	{
+		std::string text;
+		if (!readSmallFile(AT_FDCWD, "/proc/diskstats", text))
+		{
+			fprintf(stderr, "Could not read /proc/diskstats, disk I/O is not monitored\n");
+			return;
+		}
+
+		forEachLine(text, [&](std::string_view name, std::string_view) {
+			// loop and ram devices are backed by files and memory, their I/O shows up elsewhere
+			if (name.starts_with("loop") || name.starts_with("ram"))
+			{
+				return;
+			}
+			struct stat blockStat;
+			if (stat(std::format("/sys/block/{}", name).c_str(), &blockStat) != 0)
+			{
+				return;
+			}
+
+			Device device;
+			device.name = name;
+			const std::string prefix = std::format("diskio.{}.", getMetricNamePart(name));
+			device.iopsMetric = metrics.addMetric(prefix + "iops");
+			device.readBytesPerSecMetric = metrics.addMetric(prefix + "read_bytes_per_sec");
+			device.writeBytesPerSecMetric = metrics.addMetric(prefix + "write_bytes_per_sec");
+			device.queueDepthMetric = metrics.addMetric(prefix + "queue_depth");
+			device.inFlightMetric = metrics.addMetric(prefix + "in_flight");
+			device.awaitMsMetric = metrics.addMetric(prefix + "await_ms");
+			device.utilPctMetric = metrics.addMetric(prefix + "util_pct");
+			mDevices.push_back(std::move(device));
+		});
+	}
+
+	// the rates are NaN on the first sample
+	void collect(MetricTable& metrics, std::chrono::steady_clock::time_point timeNow, std::string& buffer) noexcept
+	{
+		TraceSpan span("collectDiskIo");
+		if (mDevices.empty())
+		{
+			return;
+		}
+
+		for (Device& device : mDevices)
+		{
+			device.isSeen = false;
+		}
+		if (readSmallFile(AT_FDCWD, "/proc/diskstats", buffer))
+		{
+			forEachLine(buffer, [&](std::string_view name, std::string_view line) {
+				const auto deviceIt = std::ranges::find(mDevices, name, &Device::name);
+				if (deviceIt == mDevices.end())
+				{
+					return;
+				}
+
+				// "reads merged sectorsRead msReading writes merged sectorsWritten msWriting inProgress msIo weightedMs ..."
+				size_t position = 0;
+				Counters counters;
+				for (size_t i = 0; i < counters.values.size(); ++i)
+				{
+					counters.values[i] = parseUnsigned(line, position);
+				}
+				updateDevice(metrics, *deviceIt, counters, timeNow);
+			});
+		}
+
+		double maxAwaitMs = std::numeric_limits<double>::quiet_NaN();
+		double maxQueueDepth = std::numeric_limits<double>::quiet_NaN();
+		double maxUtilPct = std::numeric_limits<double>::quiet_NaN();
+		for (Device& device : mDevices)
+		{
+			if (!device.isSeen)
+			{
+				// the device was removed
+				device.hasPreviousSample = false;
+				setDeviceMetrics(metrics, device, std::numeric_limits<double>::quiet_NaN());
+				continue;
+			}
+
+			auto updateMax = [&](double& maxValue, size_t metricIndex) {
+				const double value = metrics.getValue(metricIndex);
+				if (!std::isnan(value))
+				{
+					maxValue = std::isnan(maxValue) ? value : std::max(maxValue, value);
+				}
+			};
+			updateMax(maxAwaitMs, device.awaitMsMetric);
+			updateMax(maxQueueDepth, device.queueDepthMetric);
+			updateMax(maxUtilPct, device.utilPctMetric);
+		}
+
+		metrics.setValue(MetricTable::DiskIoAwaitMsMaxMetric, maxAwaitMs);
+		metrics.setValue(MetricTable::DiskIoQueueDepthMaxMetric, maxQueueDepth);
+		metrics.setValue(MetricTable::DiskIoUtilPctMaxMetric, maxUtilPct);
+	}
+
+	bool isDiskIoMetric(size_t metricIndex) const noexcept
+	{
+		if (metricIndex == MetricTable::DiskIoAwaitMsMaxMetric || metricIndex == MetricTable::DiskIoQueueDepthMaxMetric || metricIndex == MetricTable::DiskIoUtilPctMaxMetric)
+		{
+			return true;
+		}
+		// the per-device metrics are registered one after another
+		return !mDevices.empty() && metricIndex >= mDevices.front().iopsMetric && metricIndex <= mDevices.back().utilPctMetric;
+	}
+
+private:
+	struct Counters
+	{
+		// the only field that isn't a counter, it goes down as requests complete
+		static constexpr size_t InFlightIndex = 8;
+
+		// the 11 fields after the device name, the later fields (discards, flushes) are not used
+		std::array<uint64_t, 11> values{};
+
+		uint64_t reads() const noexcept { return values[0]; }
+		uint64_t sectorsRead() const noexcept { return values[2]; }
+		uint64_t msReading() const noexcept { return values[3]; }
+		uint64_t writes() const noexcept { return values[4]; }
+		uint64_t sectorsWritten() const noexcept { return values[6]; }
+		uint64_t msWriting() const noexcept { return values[7]; }
+		uint64_t inFlight() const noexcept { return values[InFlightIndex]; }
+		uint64_t msDoingIo() const noexcept { return values[9]; }
+		uint64_t weightedMsDoingIo() const noexcept { return values[10]; }
+	};
+
+	struct Device
+	{
+		std::string name;
+		size_t iopsMetric = 0;
+		size_t readBytesPerSecMetric = 0;
+		size_t writeBytesPerSecMetric = 0;
+		size_t queueDepthMetric = 0;
+		size_t inFlightMetric = 0;
+		size_t awaitMsMetric = 0;
+		size_t utilPctMetric = 0;
+		bool isSeen = false;
+		bool hasPreviousSample = false;
+		Counters previousCounters;
+		std::chrono::steady_clock::time_point previousSampleTime;
+	};
+
+	// calls the function with the device name and the rest of the line for every line of /proc/diskstats
+	template<typename Func>
+	static void forEachLine(std::string_view text, Func&& func)
+	{
+		for (size_t lineStart = 0; lineStart < text.size();)
+		{
+			const size_t lineEnd = std::min(text.find('\n', lineStart), text.size());
+			const std::string_view line = text.substr(lineStart, lineEnd - lineStart);
+			lineStart = lineEnd + 1;
+
+			// "major minor name counters..."
+			size_t position = 0;
+			skipFields(line, position, 2);
+			while (position < line.size() && line[position] == ' ')
+			{
+				++position;
+			}
+			const size_t nameStart = position;
+			skipFields(line, position, 1);
+			if (position > nameStart)
+			{
+				func(line.substr(nameStart, position - nameStart), line.substr(position));
+			}
+		}
+	}
+
+	static void setDeviceMetrics(MetricTable& metrics, const Device& device, double value) noexcept
+	{
+		metrics.setValue(device.iopsMetric, value);
+		metrics.setValue(device.readBytesPerSecMetric, value);
+		metrics.setValue(device.writeBytesPerSecMetric, value);
+		metrics.setValue(device.queueDepthMetric, value);
+		metrics.setValue(device.inFlightMetric, value);
+		metrics.setValue(device.awaitMsMetric, value);
+		metrics.setValue(device.utilPctMetric, value);
+	}
+
+	static void updateDevice(MetricTable& metrics, Device& device, const Counters& counters, std::chrono::steady_clock::time_point timeNow) noexcept
+	{
+		device.isSeen = true;
+		const double elapsedSec = std::chrono::duration<double>(timeNow - device.previousSampleTime).count();
+		// a counter going back means the device was replaced or the counter wrapped, start over from this sample,
+		// the in-flight count is a gauge and goes back all the time
+		bool isValidDelta = device.hasPreviousSample && elapsedSec > 0.0;
+		for (size_t i = 0; i < counters.values.size() && isValidDelta; ++i)
+		{
+			isValidDelta = i == Counters::InFlightIndex || counters.values[i] >= device.previousCounters.values[i];
+		}
+		if (isValidDelta)
+		{
+			const Counters& previous = device.previousCounters;
+			const double ioCount = double(counters.reads() - previous.reads() + counters.writes() - previous.writes());
+			const double ioMs = double(counters.msReading() - previous.msReading() + counters.msWriting() - previous.msWriting());
+			const double elapsedMs = elapsedSec * 1000.0;
+			metrics.setValue(device.iopsMetric, ioCount / elapsedSec);
+			metrics.setValue(device.readBytesPerSecMetric, double(counters.sectorsRead() - previous.sectorsRead()) * 512.0 / elapsedSec);
+			metrics.setValue(device.writeBytesPerSecMetric, double(counters.sectorsWritten() - previous.sectorsWritten()) * 512.0 / elapsedSec);
+			metrics.setValue(device.queueDepthMetric, double(counters.weightedMsDoingIo() - previous.weightedMsDoingIo()) / elapsedMs);
+			metrics.setValue(device.awaitMsMetric, (ioCount > 0.0) ? ioMs / ioCount : 0.0);
+			metrics.setValue(device.utilPctMetric, std::min(double(counters.msDoingIo() - previous.msDoingIo()) * 100.0 / elapsedMs, 100.0));
+		}
+		else
+		{
+			setDeviceMetrics(metrics, device, std::numeric_limits<double>::quiet_NaN());
+		}
+		metrics.setValue(device.inFlightMetric, double(counters.inFlight()));
+
+		device.previousCounters = counters;
+		device.previousSampleTime = timeNow;
+		device.hasPreviousSample = true;
+	}
+
+private:
+	std::vector<Device> mDevices;
+};
+
+// per-interface throughput, errors and drops from the counter deltas in /proc/net/dev
+// hosts with containers can have hundreds of interfaces, so a check reads the file into a reused buffer and parses it in place
+class NetCollector
+{
+public:
+	// the interfaces present at the start get their own metrics, the ones created later only count in the sums
+	explicit NetCollector(MetricTable& metrics)
+	{
+		std::string text;
+		if (!readSmallFile(AT_FDCWD, "/proc/net/dev", text))
+		{
+			fprintf(stderr, "Could not read /proc/net/dev, network is not monitored\n");
+			return;
+		}
+
+		forEachLine(text, [&](std::string_view name, std::string_view) {
+			Interface& netInterface = mInterfaces.emplace_back();
+			netInterface.name = name;
+			const std::string prefix = std::format("net.{}.", getMetricNamePart(name));
+			netInterface.metrics = InterfaceMetrics{
+				metrics.addMetric(prefix + "rx_bytes_per_sec"),
+				metrics.addMetric(prefix + "tx_bytes_per_sec"),
+				metrics.addMetric(prefix + "rx_packets_per_sec"),
+				metrics.addMetric(prefix + "tx_packets_per_sec"),
+				metrics.addMetric(prefix + "errors_per_sec"),
+				metrics.addMetric(prefix + "drops_per_sec"),
+			};
+		});
+	}
+
+	// NaN on the first sample
+	void collect(MetricTable& metrics, std::chrono::steady_clock::time_point timeNow, std::string& buffer)
+	{
+		TraceSpan span("collectNet");
+		for (Interface& netInterface : mInterfaces)
+		{
+			netInterface.isSeen = false;
+		}
+
+		Counters totalDelta;
+		bool hasDelta = false;
+		const double elapsedSec = std::chrono::duration<double>(timeNow - mPreviousSampleTime).count();
+		if (readSmallFile(AT_FDCWD, "/proc/net/dev", buffer))
+		{
+			size_t lineIndex = 0;
+			forEachLine(buffer, [&](std::string_view name, std::string_view line) {
+				Interface& netInterface = findInterface(name, lineIndex++);
+				netInterface.isSeen = true;
+
+				// "rxBytes rxPackets rxErrors rxDrops fifo frame compressed multicast txBytes txPackets txErrors txDrops ..."
+				size_t position = 0;
+				Counters counters;
+				for (size_t i = 0; i < RxFieldCount + TxFieldCount; ++i)
+				{
+					const uint64_t value = parseUnsigned(line, position);
+					if (i < CounterCount)
+					{
+						counters.values[i] = value;
+					}
+					else if (i >= RxFieldCount && i < RxFieldCount + CounterCount)
+					{
+						counters.values[i - RxFieldCount + CounterCount] = value;
+					}
+				}
+
+				// a counter going back means the interface was recreated with the same name
+				const bool isValidDelta = netInterface.hasPreviousSample && elapsedSec > 0.0
+					&& std::ranges::equal(counters.values, netInterface.previousCounters.values, std::ranges::greater_equal());
+				if (isValidDelta)
+				{
+					Counters delta;
+					for (size_t i = 0; i < delta.values.size(); ++i)
+					{
+						delta.values[i] = counters.values[i] - netInterface.previousCounters.values[i];
+						totalDelta.values[i] += delta.values[i];
+					}
+					hasDelta = true;
+					setInterfaceMetrics(metrics, netInterface, delta, elapsedSec);
+				}
+				else if (netInterface.metrics.has_value())
+				{
+					setInterfaceMetrics(metrics, netInterface, std::nullopt, elapsedSec);
+				}
+				netInterface.previousCounters = counters;
+				netInterface.hasPreviousSample = true;
+			});
+		}
+		mPreviousSampleTime = timeNow;
+
+		// forget the removed interfaces that don't have metrics, veth interfaces of containers come and go all the time
+		std::erase_if(mInterfaces, [](const Interface& netInterface) { return !netInterface.isSeen && !netInterface.metrics.has_value(); });
+		for (Interface& netInterface : mInterfaces)
+		{
+			if (!netInterface.isSeen)
+			{
+				netInterface.hasPreviousSample = false;
+				setInterfaceMetrics(metrics, netInterface, std::nullopt, elapsedSec);
+			}
+		}
+
+		if (!hasDelta)
+		{
+			for (const size_t metricIndex : {MetricTable::NetRxBytesPerSecMetric, MetricTable::NetTxBytesPerSecMetric, MetricTable::NetErrorsPerSecMetric, MetricTable::NetDropsPerSecMetric, MetricTable::NetDropPctMetric})
+			{
+				metrics.setValue(metricIndex, std::numeric_limits<double>::quiet_NaN());
+			}
+			return;
+		}
+
+		const double packetCount = double(totalDelta.rxPackets() + totalDelta.txPackets());
+		const double dropCount = double(totalDelta.rxDrops() + totalDelta.txDrops());
+		metrics.setValue(MetricTable::NetRxBytesPerSecMetric, double(totalDelta.rxBytes()) / elapsedSec);
+		metrics.setValue(MetricTable::NetTxBytesPerSecMetric, double(totalDelta.txBytes()) / elapsedSec);
+		metrics.setValue(MetricTable::NetErrorsPerSecMetric, double(totalDelta.rxErrors() + totalDelta.txErrors()) / elapsedSec);
+		metrics.setValue(MetricTable::NetDropsPerSecMetric, dropCount / elapsedSec);
+		// dropped packets are not counted in the packets
+		metrics.setValue(MetricTable::NetDropPctMetric, (packetCount + dropCount > 0.0) ? dropCount * 100.0 / (packetCount + dropCount) : 0.0);
+	}
+
+private:
+	// the fields of each direction in /proc/net/dev, the first four of each are used
+	static constexpr size_t RxFieldCount = 8;
+	static constexpr size_t TxFieldCount = 8;
+	static constexpr size_t CounterCount = 4;
+
+	struct Counters
+	{
+		// bytes, packets, errors and drops, received and then transmitted
+		std::array<uint64_t, CounterCount * 2> values{};
+
+		uint64_t rxBytes() const noexcept { return values[0]; }
+		uint64_t rxPackets() const noexcept { return values[1]; }
+		uint64_t rxErrors() const noexcept { return values[2]; }
+		uint64_t rxDrops() const noexcept { return values[3]; }
+		uint64_t txBytes() const noexcept { return values[4]; }
+		uint64_t txPackets() const noexcept { return values[5]; }
+		uint64_t txErrors() const noexcept { return values[6]; }
+		uint64_t txDrops() const noexcept { return values[7]; }
+	};
+
+	struct InterfaceMetrics
+	{
+		size_t rxBytesPerSec = 0;
+		size_t txBytesPerSec = 0;
+		size_t rxPacketsPerSec = 0;
+		size_t txPacketsPerSec = 0;
+		size_t errorsPerSec = 0;
+		size_t dropsPerSec = 0;
+	};
+
+	struct Interface
+	{
+		std::string name;
+		std::optional<InterfaceMetrics> metrics;
+		bool isSeen = false;
+		bool hasPreviousSample = false;
+		Counters previousCounters;
+	};
+
+	// calls the function with the interface name and the rest of the line for every interface line of /proc/net/dev
+	template<typename Func>
+	static void forEachLine(std::string_view text, Func&& func)
+	{
+		for (size_t lineStart = 0; lineStart < text.size();)
+		{
+			const size_t lineEnd = std::min(text.find('\n', lineStart), text.size());
+			const std::string_view line = text.substr(lineStart, lineEnd - lineStart);
+			lineStart = lineEnd + 1;
+
+			// "  name: counters...", there may be no space after the colon with big numbers, the two header lines have no colon
+			const size_t colonPosition = line.find(':');
+			if (colonPosition == std::string_view::npos)
+			{
+				continue;
+			}
+			const size_t nameStart = std::min(line.find_first_not_of(' '), colonPosition);
+			if (colonPosition > nameStart)
+			{
+				func(line.substr(nameStart, colonPosition - nameStart), line.substr(colonPosition + 1));
+			}
+		}
+	}
+
+	// the interfaces are usually listed in the same order, so the one at the same position is checked first
+	Interface& findInterface(std::string_view name, size_t lineIndex)
+	{
+		if (lineIndex < mInterfaces.size() && mInterfaces[lineIndex].name == name)
+		{
+			return mInterfaces[lineIndex];
+		}
+		if (const auto it = std::ranges::find(mInterfaces, name, &Interface::name); it != mInterfaces.end())
+		{
+			return *it;
+		}
+		Interface& netInterface = mInterfaces.emplace_back();
+		netInterface.name = name;
+		return netInterface;
+	}
+
+	static void setInterfaceMetrics(MetricTable& metrics, const Interface& netInterface, const std::optional<Counters>& delta, double elapsedSec) noexcept
+	{
+		if (!netInterface.metrics.has_value())
+		{
+			return;
+		}
+
+		const InterfaceMetrics& indices = *netInterface.metrics;
+		auto getRate = [&](uint64_t value) {
+			return delta.has_value() ? double(value) / elapsedSec : std::numeric_limits<double>::quiet_NaN();
+		};
+		const Counters counters = delta.value_or(Counters());
+		metrics.setValue(indices.rxBytesPerSec, getRate(counters.rxBytes()));
+		metrics.setValue(indices.txBytesPerSec, getRate(counters.txBytes()));
+		metrics.setValue(indices.rxPacketsPerSec, getRate(counters.rxPackets()));
+		metrics.setValue(indices.txPacketsPerSec, getRate(counters.txPackets()));
+		metrics.setValue(indices.errorsPerSec, getRate(counters.rxErrors() + counters.txErrors()));
+		metrics.setValue(indices.dropsPerSec, getRate(counters.rxDrops() + counters.txDrops()));
+	}
+
+private:
+	std::vector<Interface> mInterfaces;
+	std::chrono::steady_clock::time_point mPreviousSampleTime;
+};
+
+// TCP socket counts by state from NETLINK_SOCK_DIAG, which is much cheaper than parsing /proc/net/tcp with many sockets
+class SocketCollector
+{
+public:
+	explicit SocketCollector(MetricTable& metrics)
+	{
+		// "tcp.unknown" is not a metric
+		for (size_t state = 1; state < TcpStateNames.size(); ++state)
+		{
+			mStateMetrics[state] = metrics.addMetric(std::format("tcp.{}", TcpStateNames[state]));
+		}
+
+		mNetlinkFd = openSockDiagSocket();
+		if (mNetlinkFd < 0)
+		{
+			fprintf(stderr, "Could not open a sock_diag netlink socket, TCP sockets are not monitored\n");
+		}
+	}
+
+	~SocketCollector()
+	{
+		if (mNetlinkFd >= 0)
+		{
+			close(mNetlinkFd);
+		}
+	}
+
+	SocketCollector(const SocketCollector&) = delete;
+	SocketCollector& operator=(const SocketCollector&) = delete;
+
+	// NaN if the sockets couldn't be listed
+	void collect(MetricTable& metrics) noexcept
+	{
+		TraceSpan span("collectSockets");
+		std::array<size_t, TcpStateNames.size()> stateCounts{};
+		bool isDumped = mNetlinkFd >= 0;
+		for (const uint8_t family : {uint8_t(AF_INET), uint8_t(AF_INET6)})
+		{
+			isDumped = isDumped && dumpTcpSockets(mNetlinkFd, family, [&stateCounts](const inet_diag_msg& socketInfo) {
+				++stateCounts[(socketInfo.idiag_state < stateCounts.size()) ? socketInfo.idiag_state : 0];
+			});
+		}
+
+		size_t totalCount = 0;
+		for (size_t state = 1; state < TcpStateNames.size(); ++state)
+		{
+			metrics.setValue(mStateMetrics[state], isDumped ? double(stateCounts[state]) : std::numeric_limits<double>::quiet_NaN());
+			totalCount += stateCounts[state];
+		}
+		metrics.setValue(MetricTable::TcpTotalMetric, isDumped ? double(totalCount + stateCounts[0]) : std::numeric_limits<double>::quiet_NaN());
+	}
+
+	bool isSocketMetric(size_t metricIndex) const noexcept
+	{
+		return metricIndex == MetricTable::TcpTotalMetric || std::ranges::find(mStateMetrics, metricIndex) != mStateMetrics.end();
+	}
+
+private:
+	// indexed by the TCP state, the first one is unused
+	std::array<size_t, TcpStateNames.size()> mStateMetrics{};
+	int mNetlinkFd = -1;
+};
+
+// swapping, major faults, reclaim stalls and OOM kills from the counter deltas in /proc/vmstat
+class VmStatCollector
+{
+public:
+	// NaN on the first sample
+	void collect(MetricTable& metrics, std::chrono::steady_clock::time_point timeNow, std::string& buffer) noexcept
+	{
+		TraceSpan span("collectVmStat");
+		MemoryPressureStats stats;
+		stats.isValid = readSmallFile(AT_FDCWD, "/proc/vmstat", buffer);
+		const std::string_view text = buffer;
+		for (size_t lineStart = 0; stats.isValid && lineStart < text.size();)
+		{
+			const size_t lineEnd = std::min(text.find('\n', lineStart), text.size());
+			// "name value"
+			const std::string_view line = text.substr(lineStart, lineEnd - lineStart);
+			lineStart = lineEnd + 1;
+
+			const size_t spacePosition = std::min(line.find(' '), line.size());
+			const std::string_view name = line.substr(0, spacePosition);
+			for (size_t i = 0; i < MemoryPressureStats::CounterCount; ++i)
+			{
+				const std::string_view counterName = MemoryPressureCounterNames[i];
+				// "allocstall_normal" or "workingset_refault_anon", but "pgscan_direct_throttle" is a different counter
+				const bool isSplitCounter = (i == AllocStallCounter || i == WorkingSetRefaultCounter) && name.starts_with(counterName) && name.size() > counterName.size() && name[counterName.size()] == '_';
+				if (name == counterName || isSplitCounter)
+				{
+					size_t position = spacePosition;
+					stats.counters[i] += parseUnsigned(line, position);
+					break;
+				}
+			}
+		}
+
+		const double elapsedSec = std::chrono::duration<double>(timeNow - mPreviousSampleTime).count();
+		const bool isValidDelta = stats.isValid && mStats.isValid && elapsedSec > 0.0;
+		for (size_t i = 0; i < MemoryPressureStats::CounterCount; ++i)
+		{
+			stats.ratesPerSec[i] = isValidDelta ? double(stats.counters[i] - std::min(stats.counters[i], mStats.counters[i])) / elapsedSec : std::numeric_limits<double>::quiet_NaN();
+		}
+		mStats = stats;
+		mPreviousSampleTime = timeNow;
+
+		metrics.setValue(MetricTable::VmSwapInPerSecMetric, stats.ratesPerSec[SwapInCounter]);
+		metrics.setValue(MetricTable::VmSwapOutPerSecMetric, stats.ratesPerSec[SwapOutCounter]);
+		metrics.setValue(MetricTable::VmMajorFaultsPerSecMetric, stats.ratesPerSec[MajorFaultCounter]);
+		metrics.setValue(MetricTable::VmAllocStallsPerSecMetric, stats.ratesPerSec[AllocStallCounter]);
+		metrics.setValue(MetricTable::VmOomKillsMetric, isValidDelta ? stats.ratesPerSec[OomKillCounter] * elapsedSec : std::numeric_limits<double>::quiet_NaN());
+	}
+
+	// the counters of the latest check, for the memory report
+	const MemoryPressureStats& getStats() const noexcept { return mStats; }
+
+private:
+	// indices in MemoryPressureCounterNames
+	static constexpr size_t SwapInCounter = 0;
+	static constexpr size_t SwapOutCounter = 1;
+	static constexpr size_t MajorFaultCounter = 2;
+	static constexpr size_t AllocStallCounter = 3;
+	static constexpr size_t OomKillCounter = 4;
+	static constexpr size_t WorkingSetRefaultCounter = 9;
+
+	MemoryPressureStats mStats;
+	std::chrono::steady_clock::time_point mPreviousSampleTime;
+};
+
+enum class RuleOpcode : uint8_t
+{
+	PushConstant,
+	PushMetric,
+	Negate,
+	Not,
+	Add,
+	Subtract,
+	Multiply,
+	Divide,
+	Less,
+	LessEqual,
+	Greater,
+	GreaterEqual,
+	Equal,
+	NotEqual,
+	And,
+	Or,
+};
+
+// a group of processes with its own metrics, so rules can have thresholds for one service
+// every matcher that is set has to match
+struct ProcessWatch
+{
+	enum MetricKind : size_t
+	{
+		CountMetric,
+		RssMbMaxMetric,
+		RssMbTotalMetric,
+		CpuPctMaxMetric,
+		CpuPctTotalMetric,
+		MetricKindCount,
+	};
+	static constexpr std::array<std::string_view, MetricKindCount> MetricNames{"count", "rss_mb_max", "rss_mb_total", "cpu_pct_max", "cpu_pct_total"};
+
+	// the kernel keeps this much of the command, the rest of a longer name is cut
+	static constexpr size_t MaxCommandLength = 15;
+	// the regex engine recurses for every character, so a very long command line could overflow the stack
+	static constexpr size_t MaxMatchedCommandLineLength = 4096;
+
+	std::string name;
+	// exact match with the command from /proc/[pid]/stat
+	std::string command;
+	// searched in the first MaxMatchedCommandLineLength characters of the command line
+	std::optional<std::regex> commandLinePattern;
+	std::optional<uid_t> uid;
+	// matches if any of the cgroups of the process starts with it
+	std::string cgroupPrefix;
+	// watch.<name>.<metric name>
+	std::array<size_t, MetricKindCount> metrics{};
+
+	bool matches(const ProcessRecord& process, std::string_view cgroups) const
+	{
+		if (!command.empty() && process.command != command)
+		{
+			return false;
+		}
+		if (uid.has_value() && process.uid != *uid)
+		{
+			return false;
+		}
+		if (commandLinePattern.has_value())
+		{
+			const std::string_view commandLine = std::string_view(process.commandLine).substr(0, MaxMatchedCommandLineLength);
+			if (!std::regex_search(commandLine.begin(), commandLine.end(), *commandLinePattern))
+			{
+				return false;
+			}
+		}
+		if (!cgroupPrefix.empty())
+		{
+			// "hierarchy-ID:controllers:path" per line, a single "0::path" line with cgroup v2
+			bool isInCgroup = false;
+			for (size_t lineStart = 0; !isInCgroup && lineStart < cgroups.size();)
+			{
+				const size_t lineEnd = std::min(cgroups.find('\n', lineStart), cgroups.size());
+				const std::string_view line = cgroups.substr(lineStart, lineEnd - lineStart);
+				lineStart = lineEnd + 1;
+				const size_t firstColon = line.find(':');
+				const size_t secondColon = (firstColon == std::string_view::npos) ? std::string_view::npos : line.find(':', firstColon + 1);
+				isInCgroup = secondColon != std::string_view::npos && line.substr(secondColon + 1).starts_with(cgroupPrefix);
+			}
+			if (!isInCgroup)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+};
+
+// samples all the processes on every check when there are watches, and sets the metrics of every watch
+// the watches a process matches are kept until the process exits or changes its user or command line,
+// so only new processes are matched against all the watches
+class ProcessWatchList
+{
+public:
+	bool isEmpty() const noexcept { return mWatches.empty(); }
+
+	// the metrics of the watches need to be registered already
+	void setWatches(std::vector<ProcessWatch>&& watches, MetricTable& metrics, ProcessEventTable* processTable)
+	{
+		// the metrics of removed watches stay registered, but shouldn't keep the last value
+		for (const ProcessWatch& watch : mWatches)
+		{
+			for (const size_t metricIndex : watch.metrics)
+			{
+				metrics.setValue(metricIndex, std::numeric_limits<double>::quiet_NaN());
+			}
+		}
+		mWatches = std::move(watches);
+		mIsCgroupNeeded = std::ranges::any_of(mWatches, [](const ProcessWatch& watch) { return !watch.cgroupPrefix.empty(); });
+		if (mWatches.empty())
+		{
+			// the processes of the removed watches don't need their stat file kept open anymore
+			if (processTable != nullptr)
+			{
+				for (const auto& [pid, watched] : mProcesses)
+				{
+					processTable->setWatched(pid, false);
+				}
+			}
+			mProcesses.clear();
+			return;
+		}
+		// matched again on the next check, which also updates which processes the process table keeps open
+		for (auto& [pid, watched] : mProcesses)
+		{
+			watched.isMatched = false;
+		}
+	}
+
+	// needs at least one watch, there is nothing to sample otherwise
+	void collect(MetricTable& metrics, ProcessEventTable* processTable)
+	{
+		TraceSpan span("collectProcessWatches");
+		if (processTable != nullptr)
+		{
+			processTable->collect(mSnapshot, ProcessReadOptions());
+		}
+		else
+		{
+			collectProcessSnapshot(mSnapshot, ProcessReadOptions());
+		}
+
+		mValues.assign(mWatches.size(), {});
+
+		++mSampleIndex;
+		for (const ProcessRecord& process : mSnapshot.processes)
+		{
+			const size_t commandLineHash = std::hash<std::string>()(process.commandLine);
+			WatchedProcess& watched = mProcesses[process.pid];
+			if (watched.startTimeTicks != process.startTimeTicks)
+			{
+				// the pid was reused
+				watched = WatchedProcess();
+				watched.startTimeTicks = process.startTimeTicks;
+			}
+			if (!watched.isMatched || watched.uid != process.uid || watched.commandLineHash != commandLineHash)
+			{
+				watched.isMatched = true;
+				watched.uid = process.uid;
+				watched.commandLineHash = commandLineHash;
+				watched.watchIndices.clear();
+				matchWatches(process, watched.watchIndices);
+				if (processTable != nullptr)
+				{
+					processTable->setWatched(process.pid, !watched.watchIndices.empty());
+				}
+			}
+
+			// CPU usage since the previous check, the first sample of a process only sets the starting point
+			double cpuPct = 0.0;
+			if (watched.sampleIndex != 0 && mSnapshot.uptimeSec > watched.uptimeSec)
+			{
+				cpuPct = double(process.cpuTimeTicks - std::min(process.cpuTimeTicks, watched.cpuTimeTicks)) / double(mSnapshot.clockTicksPerSec) / (mSnapshot.uptimeSec - watched.uptimeSec) * 100.0;
+			}
+			watched.cpuTimeTicks = process.cpuTimeTicks;
+			watched.uptimeSec = mSnapshot.uptimeSec;
+			watched.sampleIndex = mSampleIndex;
+
+			const double rssMb = double(process.residentMemoryKb) / 1024.0;
+			for (const uint32_t watchIndex : watched.watchIndices)
+			{
+				WatchValues& values = mValues[watchIndex];
+				++values.count;
+				values.rssMbMax = std::max(values.rssMbMax, rssMb);
+				values.rssMbTotal += rssMb;
+				values.cpuPctMax = std::max(values.cpuPctMax, cpuPct);
+				values.cpuPctTotal += cpuPct;
+			}
+		}
+
+		// the processes that weren't seen have exited
+		std::erase_if(mProcesses, [this](const auto& pidAndProcess) { return pidAndProcess.second.sampleIndex != mSampleIndex; });
+
+		for (size_t i = 0; i < mWatches.size(); ++i)
+		{
+			const std::array<size_t, ProcessWatch::MetricKindCount>& watchMetrics = mWatches[i].metrics;
+			metrics.setValue(watchMetrics[ProcessWatch::CountMetric], double(mValues[i].count));
+			metrics.setValue(watchMetrics[ProcessWatch::RssMbMaxMetric], mValues[i].rssMbMax);
+			metrics.setValue(watchMetrics[ProcessWatch::RssMbTotalMetric], mValues[i].rssMbTotal);
+			metrics.setValue(watchMetrics[ProcessWatch::CpuPctMaxMetric], mValues[i].cpuPctMax);
+			metrics.setValue(watchMetrics[ProcessWatch::CpuPctTotalMetric], mValues[i].cpuPctTotal);
+		}
+	}
+
+private:
+	struct WatchValues
+	{
+		size_t count = 0;
+		double rssMbMax = 0.0;
+		double rssMbTotal = 0.0;
+		double cpuPctMax = 0.0;
+		double cpuPctTotal = 0.0;
+	};
+
+	struct WatchedProcess
+	{
+		uint64_t startTimeTicks = 0;
+		// a change of the user or the command line means a setuid or an exec, so the watches are matched again
+		bool isMatched = false;
+		uid_t uid = 0;
+		size_t commandLineHash = 0;
+		std::vector<uint32_t> watchIndices;
+		uint64_t cpuTimeTicks = 0;
+		double uptimeSec = 0.0;
+		// zero for a process that wasn't sampled yet
+		uint32_t sampleIndex = 0;
+	};
+
+	void matchWatches(const ProcessRecord& process, std::vector<uint32_t>& outWatchIndices)
+	{
+		// the cgroup is only read for new processes, a process moved to another cgroup keeps its old matches
+		mCgroups.clear();
+		if (mIsCgroupNeeded)
+		{
+			std::array<char, 32> path;
+			*std::format_to_n(path.data(), path.size() - 1, "/proc/{}/cgroup", process.pid).out = '\0';
+			readSmallFile(AT_FDCWD, path.data(), mCgroups);
+		}
+
+		for (size_t i = 0; i < mWatches.size(); ++i)
+		{
+			if (mWatches[i].matches(process, mCgroups))
+			{
+				outWatchIndices.push_back(uint32_t(i));
+			}
+		}
+	}
+
+private:
+	std::vector<ProcessWatch> mWatches;
+	bool mIsCgroupNeeded = false;
+	std::unordered_map<pid_t, WatchedProcess> mProcesses;
+	uint32_t mSampleIndex = 0;
+	// reused between checks
+	ProcessSnapshot mSnapshot;
+	std::vector<WatchValues> mValues;
+	std::string mCgroups;
+};
+
+struct RuleInstruction
+{
+	RuleOpcode opcode;
+	// index of the constant or the metric
+	uint32_t operand = 0;
+};
+
+struct Rule
+{
+	std::string name;
+	// the expression as written, for the messages
+	std::string source;
+	std::string title;
+	// the metric to report the value of in the notification, if any
+	std::optional<size_t> valueMetric;
+	std::string valueLabel;
+	std::string valueUnit;
+	// range of the rule's expression in RuleSet::code
+	uint32_t codeBegin = 0;
+	uint32_t codeEnd = 0;
+	// the condition needs to hold for this many consecutive samples and at least this long before the rule fires
+	uint32_t forSampleCount = 1;
+	std::chrono::seconds forDuration{0};
+	// zero means the rule is evaluated on every check
+	std::chrono::seconds evaluationPeriod{0};
+};
+
+// a "metric > constant" comparison found in a rule, used to sample faster near it
+struct RuleThreshold
+{
+	size_t metricIndex = 0;
+	double value = 0.0;
+	// true if the rule triggers above the value, false if below
+	bool isUpper = true;
+};
+
+// all the rules share one flat array of stack machine instructions
+struct RuleSet
+{
+	static constexpr size_t MaxStackDepth = 32;
+
+	std::vector<RuleInstruction> code;
+	std::vector<double> constants;
+	std::vector<Rule> rules;
+	std::vector<RuleThreshold> thresholds;
+};
+
+inline bool isRuleValueTrue(double value) noexcept
+{
+	// NaN is false, as a metric without a value shouldn't trigger anything
+	return value > 0.0 || value < 0.0;
+}
+
+double evaluateRule(const RuleSet& ruleSet, const Rule& rule, const double* metricValues) noexcept
+{
+	std::array<double, RuleSet::MaxStackDepth> stack;
+	size_t depth = 0;
+	for (uint32_t i = rule.codeBegin; i < rule.codeEnd; ++i)
+	{
+		const RuleInstruction instruction = ruleSet.code[i];
+		switch (instruction.opcode)
+		{
+		case RuleOpcode::PushConstant:
+			stack[depth++] = ruleSet.constants[instruction.operand];
+			continue;
+		case RuleOpcode::PushMetric:
+			stack[depth++] = metricValues[instruction.operand];
+			continue;
+		case RuleOpcode::Negate:
+			stack[depth - 1] = -stack[depth - 1];
+			continue;
+		case RuleOpcode::Not:
+			// stays NaN, a metric without a value isn't true when negated either
+			if (!std::isnan(stack[depth - 1]))
+			{
+				stack[depth - 1] = isRuleValueTrue(stack[depth - 1]) ? 0.0 : 1.0;
+			}
+			continue;
+		default:
+			break;
+		}
+
+		// binary operators
+		const double right = stack[--depth];
+		double& left = stack[depth - 1];
+		// a comparison with NaN is NaN, otherwise "!=" would be true and "!" of the others would be true too
+		if (instruction.opcode >= RuleOpcode::Less && instruction.opcode <= RuleOpcode::NotEqual && (std::isnan(left) || std::isnan(right)))
+		{
+			left = std::numeric_limits<double>::quiet_NaN();
+			continue;
+		}
+		switch (instruction.opcode)
+		{
+		case RuleOpcode::Add: left = left + right; break;
+		case RuleOpcode::Subtract: left = left - right; break;
+		case RuleOpcode::Multiply: left = left * right; break;
+		case RuleOpcode::Divide: left = left / right; break;
+		case RuleOpcode::Less: left = left < right; break;
+		case RuleOpcode::LessEqual: left = left <= right; break;
+		case RuleOpcode::Greater: left = left > right; break;
+		case RuleOpcode::GreaterEqual: left = left >= right; break;
+		case RuleOpcode::Equal: left = left == right; break;
+		case RuleOpcode::NotEqual: left = left != right; break;
+		case RuleOpcode::And: left = isRuleValueTrue(left) && isRuleValueTrue(right); break;
+		case RuleOpcode::Or: left = isRuleValueTrue(left) || isRuleValueTrue(right); break;
+		default: break;
+		}
+	}
+	return depth > 0 ? stack[depth - 1] : 0.0;
+}
+
+// compiles "<expression> [for <N> samples | for <N>s|m|h] [every <N>s|m|h]" into instructions appended to the rule set
+// e.g. "mem > 85 && vm.swap_in_per_sec > 100 for 3 samples" or "cpu.core_max > 95 for 30s"
+class RuleCompiler
+{
+public:
+	// the column is where the text starts in its line, so the errors point at the line
+	RuleCompiler(const MetricTable& metrics, std::string_view text, RuleSet& ruleSet, size_t textColumn = 0) noexcept
+		: mMetrics(metrics)
+		, mText(text)
+		, mTextColumn(textColumn)
+		, mRuleSet(ruleSet)
+	{
+	}
+
+	// fills the expression and the duration of the rule, returns false and sets the error if the text is invalid
+	bool compile(Rule& outRule, std::string& outError)
+	{
+		const size_t codeBegin = mRuleSet.code.size();
+		const size_t constantCount = mRuleSet.constants.size();
+		const size_t thresholdCount = mRuleSet.thresholds.size();
+		parseOr();
+		while (mError.empty() && parseClause(outRule))
+		{
+		}
+		if (mError.empty() && !isAtEnd())
+		{
+			setError("unexpected text");
+		}
+
+		if (!mError.empty())
+		{
+			mRuleSet.code.resize(codeBegin);
+			mRuleSet.constants.resize(constantCount);
+			mRuleSet.thresholds.resize(thresholdCount);
+			outError = std::format("{} at column {}", mError, mTextColumn + mPosition + 1);
+			return false;
+		}
+
+		outRule.source = std::string(trim(mText.substr(0, mExpressionEnd)));
+		outRule.codeBegin = uint32_t(codeBegin);
+		outRule.codeEnd = uint32_t(mRuleSet.code.size());
+		outRule.valueMetric = mFirstMetric;
+		return true;
+	}
+
+private:
+	static std::string_view trim(std::string_view text) noexcept
+	{
+		while (!text.empty() && (text.front() == ' ' || text.front() == '\t'))
+		{
+			text.remove_prefix(1);
+		}
+		while (!text.empty() && (text.back() == ' ' || text.back() == '\t'))
+		{
+			text.remove_suffix(1);
+		}
+		return text;
+	}
+
+	static bool isNameChar(char c) noexcept
+	{
+		return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '.';
+	}
+
+	void skipSpaces() noexcept
+	{
+		while (mPosition < mText.size() && (mText[mPosition] == ' ' || mText[mPosition] == '\t'))
+		{
+			++mPosition;
+		}
+	}
+
+	bool isAtEnd() noexcept
+	{
+		skipSpaces();
+		return mPosition >= mText.size();
+	}
+
+	bool consume(std::string_view token) noexcept
+	{
+		skipSpaces();
+		if (mText.compare(mPosition, token.size(), token) != 0)
+		{
+			return false;
+		}
+		mPosition += token.size();
+		return true;
+	}
+
+	std::string_view peekName() noexcept
+	{
+		skipSpaces();
+		size_t end = mPosition;
+		while (end < mText.size() && isNameChar(mText[end]))
+		{
+			++end;
+		}
+		return mText.substr(mPosition, end - mPosition);
+	}
+
+	void setError(std::string_view error)
+	{
+		if (mError.empty())
+		{
+			mError = error;
+		}
+	}
+
+	void emit(RuleOpcode opcode, uint32_t operand = 0)
+	{
+		mRuleSet.code.push_back(RuleInstruction{opcode, operand});
+		switch (opcode)
+		{
+		case RuleOpcode::PushConstant:
+		case RuleOpcode::PushMetric:
+			if (++mStackDepth > RuleSet::MaxStackDepth)
+			{
+				setError("expression is too deeply nested");
+			}
+			break;
+		case RuleOpcode::Negate:
+		case RuleOpcode::Not:
+			break;
+		default:
+			--mStackDepth;
+			break;
+		}
+	}
+
+	void parseOr()
+	{
+		parseAnd();
+		while (mError.empty() && consume("||"))
+		{
+			parseAnd();
+			emit(RuleOpcode::Or);
+		}
+		mExpressionEnd = mPosition;
+	}
+
+	void parseAnd()
+	{
+		parseComparison();
+		while (mError.empty() && consume("&&"))
+		{
+			parseComparison();
+			emit(RuleOpcode::And);
+		}
+	}
+
+	void parseComparison()
+	{
+		const size_t leftBegin = mRuleSet.code.size();
+		parseAdditive();
+		// the longer operators go first, so "<=" is not read as "<"
+		static constexpr std::pair<std::string_view, RuleOpcode> operators[] = {
+			{"<=", RuleOpcode::LessEqual}, {">=", RuleOpcode::GreaterEqual}, {"==", RuleOpcode::Equal}, {"!=", RuleOpcode::NotEqual},
+			{"<", RuleOpcode::Less}, {">", RuleOpcode::Greater},
+		};
+		for (const auto& [token, opcode] : operators)
+		{
+			if (mError.empty() && consume(token))
+			{
+				const size_t rightBegin = mRuleSet.code.size();
+				parseAdditive();
+				if (mError.empty() && rightBegin == leftBegin + 1 && mRuleSet.code.size() == rightBegin + 1)
+				{
+					addThreshold(mRuleSet.code[leftBegin], mRuleSet.code[rightBegin], opcode);
+				}
+				emit(opcode);
+				return;
+			}
+		}
+	}
+
+	void addThreshold(RuleInstruction left, RuleInstruction right, RuleOpcode opcode)
+	{
+		const bool isUpper = (opcode == RuleOpcode::Greater || opcode == RuleOpcode::GreaterEqual);
+		if (!isUpper && opcode != RuleOpcode::Less && opcode != RuleOpcode::LessEqual)
+		{
+			return;
+		}
+
+		if (left.opcode == RuleOpcode::PushMetric && right.opcode == RuleOpcode::PushConstant)
+		{
+			mRuleSet.thresholds.push_back(RuleThreshold{left.operand, mRuleSet.constants[right.operand], isUpper});
+		}
+		else if (left.opcode == RuleOpcode::PushConstant && right.opcode == RuleOpcode::PushMetric)
+		{
+			mRuleSet.thresholds.push_back(RuleThreshold{right.operand, mRuleSet.constants[left.operand], !isUpper});
+		}
+	}
+
+	void parseAdditive()
+	{
+		parseMultiplicative();
+		while (mError.empty())
+		{
+			if (consume("+"))
+			{
+				parseMultiplicative();
+				emit(RuleOpcode::Add);
+			}
+			else if (consume("-"))
+			{
+				parseMultiplicative();
+				emit(RuleOpcode::Subtract);
+			}
+			else
+			{
+				return;
+			}
+		}
+	}
+
+	void parseMultiplicative()
+	{
+		parseUnary();
+		while (mError.empty())
+		{
+			if (consume("*"))
+			{
+				parseUnary();
+				emit(RuleOpcode::Multiply);
+			}
+			else if (consume("/"))
+			{
+				parseUnary();
+				emit(RuleOpcode::Divide);
+			}
+			else
+			{
+				return;
+			}
+		}
+	}
+
+	void parseUnary()
+	{
+		// "!=" is handled by the comparison
+		skipSpaces();
+		if (mText.compare(mPosition, 1, "!") == 0 && mText.compare(mPosition, 2, "!=") != 0)
+		{
+			++mPosition;
+			parseUnary();
+			emit(RuleOpcode::Not);
+		}
+		else if (consume("-"))
+		{
+			parseUnary();
+			emit(RuleOpcode::Negate);
+		}
+		else
+		{
+			parsePrimary();
+		}
+	}
+
+	void parsePrimary()
+	{
+		if (consume("("))
+		{
+			parseOr();
+			if (mError.empty() && !consume(")"))
+			{
+				setError("expected ')'");
+			}
+			return;
+		}
+
+		double value = 0.0;
+		const auto [ptr, error] = std::from_chars(mText.data() + mPosition, mText.data() + mText.size(), value);
+		if (error == std::errc())
+		{
+			mPosition = size_t(ptr - mText.data());
+			mRuleSet.constants.push_back(value);
+			emit(RuleOpcode::PushConstant, uint32_t(mRuleSet.constants.size() - 1));
+			return;
+		}
+
+		const std::string_view name = peekName();
+		if (name.empty())
+		{
+			setError("expected a number, a metric or '('");
+			return;
+		}
+
+		const std::optional<size_t> metricIndex = mMetrics.findMetric(name);
+		if (!metricIndex.has_value())
+		{
+			setError(std::format("unknown metric '{}'", name));
+			return;
+		}
+
+		mPosition += name.size();
+		if (!mFirstMetric.has_value())
+		{
+			mFirstMetric = metricIndex;
+		}
+		emit(RuleOpcode::PushMetric, uint32_t(*metricIndex));
+	}
+
+	// parses a "for" or an "every" clause, returns false if there is none
+	bool parseClause(Rule& outRule)
+	{
+		const std::string_view keyword = peekName();
+		const bool isFor = (keyword == "for");
+		if (!isFor && keyword != "every")
+		{
+			return false;
+		}
+		mPosition += keyword.size();
+		skipSpaces();
+
+		uint32_t count = 0;
+		const auto [ptr, error] = std::from_chars(mText.data() + mPosition, mText.data() + mText.size(), count);
+		if (error != std::errc() || count == 0)
+		{
+			setError(std::format("expected a positive number after '{}'", keyword));
+			return false;
+		}
+		mPosition = size_t(ptr - mText.data());
+
+		const std::string_view unit = peekName();
+		if (isFor && (unit == "samples" || unit == "sample"))
+		{
+			outRule.forSampleCount = count;
+		}
+		else if (unit == "s" || unit == "m" || unit == "h")
+		{
+			const std::chrono::seconds duration = std::chrono::seconds(count) * (unit == "h" ? 3600 : unit == "m" ? 60 : 1);
+			(isFor ? outRule.forDuration : outRule.evaluationPeriod) = duration;
+		}
+		else
+		{
+			setError(isFor ? "expected 'samples', 's', 'm' or 'h'" : "expected 's', 'm' or 'h'");
+			return false;
+		}
+		mPosition += unit.size();
+		return true;
+	}
+
+private:
+	const MetricTable& mMetrics;
+	const std::string_view mText;
+	const size_t mTextColumn;
+	RuleSet& mRuleSet;
+	size_t mPosition = 0;
+	size_t mExpressionEnd = 0;
+	size_t mStackDepth = 0;
+	std::optional<size_t> mFirstMetric;
+	std::string mError;
+};
+
+// hierarchical timing wheel on the monotonic clock, scheduling, cancelling and expiring a timer are O(1)
+// a level N slot covers 64^N ticks, its timers are moved to the lower levels when the wheel reaches the slot
+class TimingWheel
+{
+public:
+	using TimerId = uint32_t;
+	static constexpr TimerId InvalidTimer = std::numeric_limits<TimerId>::max();
+	static constexpr std::chrono::milliseconds TickDuration{100};
+
+	explicit TimingWheel(std::chrono::steady_clock::time_point startTime) noexcept
+		: mStartTime(startTime)
+	{
+		mSlotHeads.fill(InvalidTimer);
+	}
+
+	// the payload is passed to the expiry callback
+	TimerId schedule(std::chrono::steady_clock::time_point expiryTime, uint32_t payload)
+	{
+		TimerId id = mFreeTimers;
+		if (id != InvalidTimer)
+		{
+			mFreeTimers = mTimers[id].next;
+		}
+		else
+		{
+			id = TimerId(mTimers.size());
+			mTimers.emplace_back();
+		}
+
+		Timer& timer = mTimers[id];
+		timer.expiryTick = std::max(getTick(expiryTime), mNextTick);
+		timer.payload = payload;
+		timer.isActive = true;
+		insert(id);
+		return id;
+	}
+
+	void cancel(TimerId id) noexcept
+	{
+		if (id < mTimers.size() && mTimers[id].isActive)
+		{
+			unlink(id);
+			release(id);
+		}
+	}
+
+	void setPayload(TimerId id, uint32_t payload) noexcept
+	{
+		mTimers[id].payload = payload;
+	}
+
+	// calls onExpired(timerId, payload) for every timer that expired by the time
+	// the timer is released before the call, so the callback may schedule new timers
+	template<typename Func>
+	void advance(std::chrono::steady_clock::time_point time, Func&& onExpired)
+	{
+		const uint64_t targetTick = getTick(time);
+		for (; mNextTick <= targetTick; )
+		{
+			const uint64_t tick = mNextTick;
+			// move the timers of the higher level slots that start at this tick down, the highest level first
+			for (size_t level = LevelCount - 1; level > 0; --level)
+			{
+				if ((tick & ((uint64_t(1) << (LevelBits * level)) - 1)) == 0)
+				{
+					cascade(level, (tick >> (LevelBits * level)) & SlotMask);
+				}
+			}
+
+			++mNextTick;
+			TimerId& slotHead = mSlotHeads[tick & SlotMask];
+			while (slotHead != InvalidTimer)
+			{
+				const TimerId id = slotHead;
+				const uint32_t payload = mTimers[id].payload;
+				unlink(id);
+				release(id);
+				onExpired(id, payload);
+			}
+		}
+	}
+
+private:
+	static constexpr size_t LevelBits = 6;
+	static constexpr size_t SlotCount = size_t(1) << LevelBits;
+	static constexpr uint64_t SlotMask = SlotCount - 1;
+	// 64^4 ticks of 100 ms is about 19 days, longer timers wait in the last slot of the top level
+	static constexpr size_t LevelCount = 4;
+
+	struct Timer
+	{
+		uint64_t expiryTick = 0;
+		uint32_t payload = 0;
+		TimerId previous = InvalidTimer;
+		// also links the free timers
+		TimerId next = InvalidTimer;
+		uint16_t slotIndex = 0;
+		bool isActive = false;
+	};
+
+	uint64_t getTick(std::chrono::steady_clock::time_point time) const noexcept
+	{
+		return (time <= mStartTime) ? 0 : uint64_t((time - mStartTime) / TickDuration);
+	}
+
+	void insert(TimerId id) noexcept
+	{
+		Timer& timer = mTimers[id];
+		// the lowest level where the expiry is less than a full turn of the level away
+		size_t slotIndex = (LevelCount - 1) * SlotCount + (((mNextTick >> (LevelBits * (LevelCount - 1))) + SlotMask) & SlotMask);
+		for (size_t level = 0; level < LevelCount; ++level)
+		{
+			const size_t shift = LevelBits * level;
+			if ((timer.expiryTick >> shift) - (mNextTick >> shift) < SlotCount)
+			{
+				slotIndex = level * SlotCount + ((timer.expiryTick >> shift) & SlotMask);
+				break;
+			}
+		}
+
+		timer.slotIndex = uint16_t(slotIndex);
+		timer.previous = InvalidTimer;
+		timer.next = mSlotHeads[slotIndex];
+		if (timer.next != InvalidTimer)
+		{
+			mTimers[timer.next].previous = id;
+		}
+		mSlotHeads[slotIndex] = id;
+	}
+
+	void unlink(TimerId id) noexcept
+	{
+		Timer& timer = mTimers[id];
+		if (timer.previous != InvalidTimer)
+		{
+			mTimers[timer.previous].next = timer.next;
+		}
+		else
+		{
+			mSlotHeads[timer.slotIndex] = timer.next;
+		}
+		if (timer.next != InvalidTimer)
+		{
+			mTimers[timer.next].previous = timer.previous;
+		}
+	}
+
+	void release(TimerId id) noexcept
+	{
+		mTimers[id].isActive = false;
+		mTimers[id].next = mFreeTimers;
+		mFreeTimers = id;
+	}
+
+	void cascade(size_t level, size_t slot) noexcept
+	{
+		TimerId id = mSlotHeads[level * SlotCount + slot];
+		mSlotHeads[level * SlotCount + slot] = InvalidTimer;
+		while (id != InvalidTimer)
+		{
+			const TimerId next = mTimers[id].next;
+			insert(id);
+			id = next;
+		}
+	}
+
+private:
+	const std::chrono::steady_clock::time_point mStartTime;
+	uint64_t mNextTick = 0;
+	std::vector<Timer> mTimers;
+	TimerId mFreeTimers = InvalidTimer;
+	std::array<TimerId, LevelCount * SlotCount> mSlotHeads;
+};
+
+enum class RuleTimerKind : uint32_t
+{
+	// the rule doesn't notify again until it expires
+	Cooldown = 0,
+	// the rule is evaluated again when it expires
+	Period = 1,
+};
+
+inline uint32_t getRuleTimerPayload(size_t ruleIndex, RuleTimerKind kind) noexcept
+{
+	return (uint32_t(ruleIndex) << 1) | static_cast<uint32_t>(kind);
+}
+
+// picks the time until the next check from how close the metrics are to the rule thresholds and how fast they approach them
+// the interval drops right away when a threshold gets close, and grows back gradually once things calm down
+class AdaptiveSampler
+{
+public:
+	std::chrono::milliseconds update(const RuleSet& ruleSet, const MetricTable& metrics, std::chrono::steady_clock::time_point timeNow,
+		std::chrono::milliseconds minInterval, std::chrono::milliseconds maxInterval)
+	{
+		const double elapsedSec = std::chrono::duration<double>(timeNow - mPreviousTime).count();
+		double targetMs = double(maxInterval.count());
+		for (const RuleThreshold& threshold : ruleSet.thresholds)
+		{
+			const double value = metrics.getValue(threshold.metricIndex);
+			if (std::isnan(value))
+			{
+				continue;
+			}
+
+			// a metric sitting at the threshold, like a counter at zero for "> 0", isn't getting closer to it,
+			// and a crossed threshold has fired its rule already, neither needs faster checks
+			const double margin = threshold.isUpper ? threshold.value - value : value - threshold.value;
+			if (margin <= 0.0)
+			{
+				continue;
+			}
+			const double relativeMargin = margin / std::max(std::abs(threshold.value), 1.0);
+			// linearly faster from a quarter of the threshold away
+			targetMs = std::min(targetMs, double(maxInterval.count()) * std::clamp(relativeMargin / FarRelativeMargin, 0.0, 1.0));
+
+			const double previousValue = (threshold.metricIndex < mPreviousValues.size()) ? mPreviousValues[threshold.metricIndex] : std::numeric_limits<double>::quiet_NaN();
+			if (!std::isnan(previousValue) && elapsedSec > 0.0)
+			{
+				const double approachSpeed = (threshold.isUpper ? value - previousValue : previousValue - value) / elapsedSec;
+				if (approachSpeed > 0.0)
+				{
+					// a few samples before the projected crossing
+					targetMs = std::min(targetMs, margin / approachSpeed * 1000.0 / SamplesBeforeCrossing);
+				}
+			}
+		}
+
+		const double minMs = double(minInterval.count());
+		targetMs = std::clamp(targetMs, minMs, std::max(minMs, double(maxInterval.count())));
+		const double currentMs = (mInterval.count() > 0) ? double(mInterval.count()) : double(maxInterval.count());
+		mInterval = std::chrono::milliseconds(int64_t((targetMs < currentMs) ? targetMs : std::min(targetMs, currentMs * BackoffFactor)));
+
+		mPreviousValues.assign(metrics.getValues(), metrics.getValues() + metrics.getSize());
+		mPreviousTime = timeNow;
+		return mInterval;
+	}
+
+	std::chrono::milliseconds getInterval() const noexcept { return mInterval; }
+
+private:
+	static constexpr double FarRelativeMargin = 0.25;
+	static constexpr double SamplesBeforeCrossing = 4.0;
+	static constexpr double BackoffFactor = 1.5;
+
+	std::vector<double> mPreviousValues;
+	std::chrono::steady_clock::time_point mPreviousTime;
+	std::chrono::milliseconds mInterval{0};
+};
+
+// whether the rule's condition has held long enough, and its pending timers
+struct RuleState
+{
+	uint32_t consecutiveSampleCount = 0;
+	std::chrono::steady_clock::time_point conditionStartTime;
+	TimingWheel::TimerId cooldownTimer = TimingWheel::InvalidTimer;
+	TimingWheel::TimerId periodTimer = TimingWheel::InvalidTimer;
+	// rules without an evaluation period are always due
+	bool isDue = true;
+};
+
+// returns true if the rule fires on this sample
+bool updateRuleState(const Rule& rule, bool isConditionTrue, std::chrono::steady_clock::time_point timeNow, RuleState& state) noexcept
+{
+	if (!isConditionTrue)
+	{
+		state.consecutiveSampleCount = 0;
+		return false;
+	}
+
+	if (state.consecutiveSampleCount == 0)
+	{
+		state.conditionStartTime = timeNow;
+	}
+	state.consecutiveSampleCount = std::min(state.consecutiveSampleCount + 1, std::numeric_limits<uint32_t>::max() - 1);
+	return state.consecutiveSampleCount >= rule.forSampleCount && timeNow - state.conditionStartTime >= rule.forDuration;
+}
+
+struct Args
+{
+	// [0.0, 100.0)
+	float memThresholdPct = 70.0f;
+	// [0.0, 100.0)
+	float cpuThresholdPct = 70.0f;
+	// the longest time between checks when the sampling is adaptive
+	size_t timeBetweenChecksSec = 60;
+	// zero disables adaptive sampling, otherwise the checks get down to this interval close to the thresholds
+	size_t minTimeBetweenChecksMs = 0;
+	std::string runCustomScript;
+	size_t notificationThrottleSec = 20 * 60;
+	size_t limitReportFiles = 1000;
+	// zero means no timeout
+	size_t commandTimeoutSec = 30;
+	// "vmstat" or "sar" to keep one streaming process instead of running sar every check
+	std::string cpuStreamTool;
+	std::string traceFilePath;
+	ReportFormat reportFormat = ReportFormat::Text;
+	// zero means a separate file per report, otherwise reports are appended to segments of this size
+	size_t reportLogSegmentMb = 0;
+	// [1, 9] gzip compression level, zero disables compression
+	int compressionLevel = 0;
+	// for binary reports, a full report every N reports and only the differences in between, 0 or 1 disables deltas
+	size_t keyframeInterval = 0;
+	ReportQueueOverflowPolicy reportQueueOverflowPolicy = ReportQueueOverflowPolicy::Drop;
+	// fdatasync reports in batches of this size, zero disables it
+	size_t syncBatchSize = 0;
+	// rules from the config file replace all the built-in threshold rules, and then no threshold argument can be given
+	std::string configFilePath;
+	// comma-separated mount points, all the real filesystems if empty
+	std::string diskMounts;
+	// for the fullest filesystem, zero disables it
+	float diskThresholdPct = 0.0f;
+	// alert when a filesystem is projected to be full within this many hours, zero disables it
+	size_t diskFullHoursThreshold = 0;
+	// for the block device with the slowest requests, zero disables it
+	size_t diskIoAwaitThresholdMs = 0;
+	// dropped packets out of all the packets of all the interfaces, zero disables it
+	float netDropThresholdPct = 0.0f;
+	// TCP sockets in all the states, zero disables it
+	size_t tcpThreshold = 0;
+	// swap-ins and swap-outs, or major faults with reclaim stalls, in pages per second, zero disables it
+	size_t thrashingThreshold = 0;
+	// new OOM kills between two checks, zero disables it
+	size_t oomKillThreshold = 1;
+	// the processes with the highest RSS to read PSS and USS for in the reports, zero disables it
+	size_t pssCandidateCount = 32;
+	// non-zero keeps the process list up to date from the kernel process events and lists /proc only this often
+	size_t processEventsRescanSec = 0;
+	// the top consumers and watched processes kept with an open stat file in that mode, zero opens the file for every read
+	size_t statCacheSize = 1024;
+	// commands remembered as the most frequent top consumers of the reports, zero disables the history
+	size_t topConsumerHistorySize = 64;
+};
+
+struct AppState
+{
+	MetricTable metrics;
+	CpuCoreSampler cpuCoreSampler;
+	RuleSet ruleSet;
+	// one per rule
+	std::vector<RuleState> ruleStates;
+	// the rule cooldowns and evaluation periods
+	TimingWheel ruleTimers{std::chrono::steady_clock::now()};
+	AdaptiveSampler adaptiveSampler;
+	// measures the actual interval, which can be longer than planned when collecting the metrics is slow
+	std::chrono::steady_clock::time_point previousCheckTime;
+	// with adaptive sampling, the reports are written at most once per the longest interval between checks
+	std::chrono::steady_clock::time_point nextReportTime;
+	// when the last disk usage report was written for a mount point
+	std::unordered_map<std::string, std::chrono::steady_clock::time_point> diskUsageReportTimes;
+	// reused between checks
+	std::vector<size_t> firingRules;
+	std::unique_ptr<StreamingCpuReader> cpuStreamReader;
+	std::unique_ptr<DiskCollector> diskCollector;
+	std::unique_ptr<DiskIoCollector> diskIoCollector;
+	std::unique_ptr<NetCollector> netCollector;
+	std::unique_ptr<SocketCollector> socketCollector;
+	VmStatCollector vmStatCollector;
+	std::unique_ptr<ProcessEventTable> processTable;
+	ProcessWatchList watchList;
+	std::unique_ptr<TopConsumerHistory> topConsumerHistory;
+	std::unique_ptr<ReportLogWriter> reportLogWriter;
+	std::unique_ptr<ReportWriter> reportWriter;
+	// last reported writer stats, to report only the changes
+	ReportWriterStats reportWriterStats;
+};
+
+template<typename T>
+bool readArgValue(T& dest, int argc, char** argv, int& i)
+{
+	if (i + 1 >= argc || argv[i + 1][0] == '-')
+	{
+		return false;
+	}
+
+	if constexpr (std::is_same_v<T, int64_t>)
+	{
+		char* end;
+		errno = 0;
+		const long long value = std::strtoll(argv[i + 1], &end, 10);
+		if (errno == ERANGE || *argv[i + 1] == '\0' || *end != '\0')
+		{
+			return false;
+		}
+
+		dest = value;
+		++i;
+		return true;
+	}
+	else if constexpr (std::is_integral_v<T>)
+	{
+		std::optional<int> value = parseInt(argv[i + 1], 10);
+		if (!value.has_value())
+		{
+			return false;
+		}
+
+		if constexpr (std::is_unsigned_v<T>)
+		{
+			if (*value < 0)
+			{
+				return false;
+			}
+		}
+
+		if constexpr (sizeof(T) < sizeof(int))
+		{
+			if (*value < 0)
+			{
+				if (*value < std::numeric_limits<T>::lowest())
+				{
+					return false;
+				}
+			}
+			else
+			{
+				if (*value > std::numeric_limits<T>::max())
+				{
+					return false;
+				}
+			}
+		}
+
+		dest = T(*value);
+		++i;
+		return true;
+	}
+	else if constexpr (std::is_floating_point_v<T>)
+	{
+		std::optional<int> value = parseInt(argv[i + 1], 10);
+		if (value.has_value())
+		{
+			dest = T(*value);
+			++i;
+			return true;
+		}
+	}
+	else if constexpr (std::is_same_v<T, std::string>)
+	{
+		dest = std::string(argv[i + 1]);
+		++i;
+		return true;
+	}
+
+	return false;
+}
+
+Args readArgs(int argc, char** argv)
+{
+	if (argc == 1)
+	{
+		return {};
+	}
+
+	Args args;
+	for (int i = 1; i < argc; ++i)
+	{
+		bool isFound = false;
+		bool isMissingValue = false;
+		if (argv[i][0] == '-' && argv[i][1] != '\0')
+		{
+			// one letter args
+			if (argv[i][2] == '\0')
+			{
+				switch (argv[i][1])
+				{
+				case 'm':
+					isMissingValue = !readArgValue(args.memThresholdPct, argc, argv, i);
+					isFound = true;
+					break;
+				case 'c':
+					isMissingValue = !readArgValue(args.cpuThresholdPct, argc, argv, i);
+					isFound = true;
+					break;
+				case 't':
+					isMissingValue = !readArgValue(args.timeBetweenChecksSec, argc, argv, i);
+					isFound = true;
+					break;
+				case 'r':
+					isMissingValue = !readArgValue(args.runCustomScript, argc, argv, i);
+					isFound = true;
+					break;
+				case 'n':
+					isMissingValue = !readArgValue(args.notificationThrottleSec, argc, argv, i);
+					isFound = true;
+					break;
+				case 'l':
+					isMissingValue = !readArgValue(args.limitReportFiles, argc, argv, i);
+					isFound = true;
+					break;
+				case 'k':
+					isMissingValue = !readArgValue(args.commandTimeoutSec, argc, argv, i);
+					isFound = true;
+					break;
+				case 's':
+					isMissingValue = !readArgValue(args.cpuStreamTool, argc, argv, i) || !StreamingCpuReader::parseTool(args.cpuStreamTool).has_value();
+					isFound = true;
+					break;
+				case 'T':
+					isMissingValue = !readArgValue(args.traceFilePath, argc, argv, i);
+					isFound = true;
+					break;
+				case 'z':
+					isMissingValue = !readArgValue(args.compressionLevel, argc, argv, i) || args.compressionLevel > 9;
+					isFound = true;
+					break;
+				case 'K':
+					isMissingValue = !readArgValue(args.keyframeInterval, argc, argv, i);
+					isFound = true;
+					break;
+				case 'B':
+				{
+					std::string policyName;
+					isMissingValue = !readArgValue(policyName, argc, argv, i) || (policyName != "drop" && policyName != "block");
+					args.reportQueueOverflowPolicy = (policyName == "block") ? ReportQueueOverflowPolicy::Block : ReportQueueOverflowPolicy::Drop;
+					isFound = true;
+					break;
+				}
+				case 'y':
+					isMissingValue = !readArgValue(args.syncBatchSize, argc, argv, i);
+					isFound = true;
+					break;
+				case 'a':
+					isMissingValue = !readArgValue(args.minTimeBetweenChecksMs, argc, argv, i);
+					isFound = true;
+					break;
+				case 'D':
+					isMissingValue = !readArgValue(args.diskMounts, argc, argv, i);
+					isFound = true;
+					break;
+				case 'd':
+					isMissingValue = !readArgValue(args.diskThresholdPct, argc, argv, i);
+					isFound = true;
+					break;
+				case 'F':
+					isMissingValue = !readArgValue(args.diskFullHoursThreshold, argc, argv, i);
+					isFound = true;
+					break;
+				case 'w':
+					isMissingValue = !readArgValue(args.diskIoAwaitThresholdMs, argc, argv, i);
+					isFound = true;
+					break;
+				case 'N':
+					isMissingValue = !readArgValue(args.netDropThresholdPct, argc, argv, i);
+					isFound = true;
+					break;
+				case 'o':
+					isMissingValue = !readArgValue(args.tcpThreshold, argc, argv, i);
+					isFound = true;
+					break;
+				case 'S':
+					isMissingValue = !readArgValue(args.thrashingThreshold, argc, argv, i);
+					isFound = true;
+					break;
+				case 'O':
+					isMissingValue = !readArgValue(args.oomKillThreshold, argc, argv, i);
+					isFound = true;
+					break;
+				case 'P':
+					isMissingValue = !readArgValue(args.pssCandidateCount, argc, argv, i);
+					isFound = true;
+					break;
+				case 'e':
+					isMissingValue = !readArgValue(args.processEventsRescanSec, argc, argv, i);
+					isFound = true;
+					break;
+				case 'R':
+					isMissingValue = !readArgValue(args.statCacheSize, argc, argv, i);
+					isFound = true;
+					break;
+				case 'H':
+					isMissingValue = !readArgValue(args.topConsumerHistorySize, argc, argv, i);
+					isFound = true;
+					break;
+				case 'C':
+					isMissingValue = !readArgValue(args.configFilePath, argc, argv, i);
+					isFound = true;
+					break;
+				case 'L':
+					isMissingValue = !readArgValue(args.reportLogSegmentMb, argc, argv, i);
+					isFound = true;
+					break;
+				case 'f':
+				{
+					std::string formatName;
+					const std::optional<ReportFormat> format = readArgValue(formatName, argc, argv, i) ? parseReportFormat(formatName) : std::nullopt;
+					isMissingValue = !format.has_value();
+					args.reportFormat = format.value_or(ReportFormat::Text);
+					isFound = true;
+					break;
+				}
+				}
+			}
+		}
+
+		if (!isFound)
+		{
+			fprintf(stderr, "Unknown argument '%s'\n", argv[i]);
+			stopExecution(ExitReason::UnknownArgument);
+		}
+
+		if (isMissingValue)
+		{
+			fprintf(stderr, "Argument '%s' did not have a valid value\n", argv[i]);
+			stopExecution(ExitReason::MissingArgumentValue);
+		}
+	}
+
+	return args;
+}
+
+// a rule that fires when the metric reaches the threshold
+bool addThresholdRule(const MetricTable& metrics, size_t metricIndex, double threshold, RuleSet& outRuleSet, std::string& outError)
+{
+	Rule rule;
+	rule.name = metrics.getName(metricIndex);
+	if (metricIndex == MetricTable::DiskUsedPctMaxMetric)
+	{
+		rule.title = "Disk usage is high";
+		rule.valueLabel = "Usage";
+		rule.valueUnit = "%";
+	}
+	else if (metricIndex == MetricTable::DiskIoAwaitMsMaxMetric)
+	{
+		rule.title = "Disk I/O is slow";
+		rule.valueLabel = "Average wait";
+		rule.valueUnit = " ms";
+	}
+	else if (metricIndex == MetricTable::NetDropPctMetric)
+	{
+		rule.title = "Network packets are dropped";
+		rule.valueLabel = "Dropped";
+		rule.valueUnit = "%";
+	}
+	else if (metricIndex == MetricTable::TcpTotalMetric)
+	{
+		rule.title = "Too many TCP sockets";
+		rule.valueLabel = "Sockets";
+	}
+	else if (metricIndex == MetricTable::VmOomKillsMetric)
+	{
+		rule.title = "The OOM killer killed processes";
+		rule.valueLabel = "Killed";
+	}
+	else if (metricIndex == MetricTable::MemMetric || metricIndex == MetricTable::CpuMetric)
+	{
+		rule.title = (metricIndex == MetricTable::MemMetric) ? "Memory consumption is high" : "CPU consumption is high";
+		rule.valueLabel = "Consumption";
+		rule.valueUnit = "%";
+	}
+	else
+	{
+		rule.title = std::format("{} is high", rule.name);
+		rule.valueLabel = rule.name;
+	}
+
+	if (!std::isfinite(threshold))
+	{
+		outError = "threshold should be a finite number";
+		return false;
+	}
+
+	if (!RuleCompiler(metrics, std::format("{} >= {}", rule.name, threshold), outRuleSet).compile(rule, outError))
+	{
+		return false;
+	}
+	outRuleSet.rules.push_back(std::move(rule));
+	return true;
+}
+
+// the rules for the -m, -c, -d, -F, -w, -N, -o, -S and -O thresholds, used when the config file doesn't define any rules or thresholds
+bool addThresholdRules(const Args& args, const MetricTable& metrics, RuleSet& outRuleSet, std::string& outError)
+{
+	bool isValid = addThresholdRule(metrics, MetricTable::MemMetric, args.memThresholdPct, outRuleSet, outError)
+		&& addThresholdRule(metrics, MetricTable::CpuMetric, args.cpuThresholdPct, outRuleSet, outError);
+	if (isValid && args.diskThresholdPct > 0.0f)
+	{
+		isValid = addThresholdRule(metrics, MetricTable::DiskUsedPctMaxMetric, args.diskThresholdPct, outRuleSet, outError);
+	}
+	if (isValid && args.diskIoAwaitThresholdMs > 0)
+	{
+		isValid = addThresholdRule(metrics, MetricTable::DiskIoAwaitMsMaxMetric, double(args.diskIoAwaitThresholdMs), outRuleSet, outError);
+	}
+	if (isValid && args.netDropThresholdPct > 0.0f)
+	{
+		isValid = addThresholdRule(metrics, MetricTable::NetDropPctMetric, args.netDropThresholdPct, outRuleSet, outError);
+	}
+	if (isValid && args.tcpThreshold > 0)
+	{
+		isValid = addThresholdRule(metrics, MetricTable::TcpTotalMetric, double(args.tcpThreshold), outRuleSet, outError);
+	}
+	if (isValid && args.oomKillThreshold > 0)
+	{
+		isValid = addThresholdRule(metrics, MetricTable::VmOomKillsMetric, double(args.oomKillThreshold), outRuleSet, outError);
+	}
+	if (isValid && args.thrashingThreshold > 0)
+	{
+		// pages going both ways through swap, or reading pages back while allocations wait for reclaim
+		Rule rule;
+		rule.name = "thrashing";
+		rule.title = "Memory is thrashing";
+		rule.valueLabel = "Swap-ins per second";
+		isValid = RuleCompiler(metrics, std::format("vm.swap_in_per_sec >= {0} && vm.swap_out_per_sec >= {0} || vm.major_faults_per_sec >= {0} && vm.alloc_stalls_per_sec > 0 for 2 samples", args.thrashingThreshold), outRuleSet).compile(rule, outError);
+		if (isValid)
+		{
+			outRuleSet.rules.push_back(std::move(rule));
+		}
+	}
+	if (isValid && args.diskFullHoursThreshold > 0)
+	{
+		Rule rule;
+		rule.name = "disk_fill";
+		rule.title = "Disk is filling up";
+		rule.valueLabel = "Hours until full";
+		isValid = RuleCompiler(metrics, std::format("disk.hours_to_full_min < {}", args.diskFullHoursThreshold), outRuleSet).compile(rule, outError);
+		if (isValid)
+		{
+			outRuleSet.rules.push_back(std::move(rule));
+		}
+	}
+	return isValid;
+}
+
+// the first threshold argument that was changed from its default, it would have no effect with rules from the config file
+std::optional<std::string_view> findThresholdArgument(const Args& args) noexcept
+{
+	const Args defaults;
+	const std::array<std::pair<bool, std::string_view>, 9> arguments{{
+		{args.memThresholdPct != defaults.memThresholdPct, "-m"},
+		{args.cpuThresholdPct != defaults.cpuThresholdPct, "-c"},
+		{args.diskThresholdPct != defaults.diskThresholdPct, "-d"},
+		{args.diskFullHoursThreshold != defaults.diskFullHoursThreshold, "-F"},
+		{args.diskIoAwaitThresholdMs != defaults.diskIoAwaitThresholdMs, "-w"},
+		{args.netDropThresholdPct != defaults.netDropThresholdPct, "-N"},
+		{args.tcpThreshold != defaults.tcpThreshold, "-o"},
+		{args.thrashingThreshold != defaults.thrashingThreshold, "-S"},
+		{args.oomKillThreshold != defaults.oomKillThreshold, "-O"},
+	}};
+	const auto it = std::ranges::find(arguments, true, &std::pair<bool, std::string_view>::first);
+	return (it != arguments.end()) ? std::optional(it->second) : std::nullopt;
+}
+
+// the settings that only feed the built-in threshold rules
+constexpr std::array<std::string_view, 7> ThresholdSettingKeys{
+	"disk_threshold", "disk_full_hours", "diskio_await_threshold_ms", "net_drop_threshold_pct", "tcp_threshold", "thrashing_threshold", "oom_kill_threshold",
+};
+
+struct Config
+{
+	// the command line arguments with the values from the config file applied on top
+	Args args;
+	RuleSet ruleSet;
+	std::vector<ProcessWatch> watches;
+};
+
+std::string_view trimSpaces(std::string_view text) noexcept
+{
+	while (!text.empty() && (text.front() == ' ' || text.front() == '\t' || text.front() == '\r'))
+	{
+		text.remove_prefix(1);
+	}
+	while (!text.empty() && (text.back() == ' ' || text.back() == '\t' || text.back() == '\r'))
+	{
+		text.remove_suffix(1);
+	}
+	return text;
+}
+
+template<typename T>
+bool parseConfigNumber(std::string_view text, T& outValue) noexcept
+{
+	const auto [ptr, error] = std::from_chars(text.data(), text.data() + text.size(), outValue);
+	return error == std::errc() && ptr == text.data() + text.size();
+}
+
+// the range the command line accepts, from_chars also takes "inf" and "nan" for floats
+template<typename T>
+bool parseConfigSetting(std::string_view text, T& outValue) noexcept
+{
+	T value{};
+	if (!parseConfigNumber(text, value) || !(value >= T(0)) || !(value <= T(std::numeric_limits<int>::max())))
+	{
+		return false;
+	}
+	outValue = value;
+	return true;
+}
+
+bool parseConfigPercent(std::string_view text, float& outValue) noexcept
+{
+	return parseConfigSetting(text, outValue) && outValue <= 100.0f;
+}
+
+// parses the matchers of a watch: name=<command> user=<user name or uid> cgroup=<path prefix> cmdline~<regex>
+// the regex takes the rest of the line, so it can contain spaces
+bool parseProcessWatchMatchers(std::string_view text, ProcessWatch& outWatch, std::string& outError)
+{
+	bool hasMatcher = false;
+	while (true)
+	{
+		text = trimSpaces(text);
+		if (text.empty())
+		{
+			break;
+		}
+		hasMatcher = true;
+
+		if (text.starts_with("cmdline~"))
+		{
+			try
+			{
+				outWatch.commandLinePattern.emplace(std::string(text.substr(8)), std::regex::ECMAScript | std::regex::nosubs | std::regex::optimize);
+			}
+			catch (const std::regex_error& error)
+			{
+				outError = std::format("invalid cmdline regex: {}", error.what());
+				return false;
+			}
+			break;
+		}
+
+		const std::string_view matcher = text.substr(0, std::min(text.find_first_of(" \t"), text.size()));
+		text.remove_prefix(matcher.size());
+		const size_t equalsPosition = matcher.find('=');
+		const std::string_view key = matcher.substr(0, equalsPosition);
+		const std::string_view value = (equalsPosition == std::string_view::npos) ? std::string_view() : matcher.substr(equalsPosition + 1);
+		if (value.empty())
+		{
+			outError = std::format("expected '<matcher>=<value>' instead of '{}'", matcher);
+			return false;
+		}
+
+		if (key == "name")
+		{
+			if (value.size() > ProcessWatch::MaxCommandLength)
+			{
+				outError = std::format("name '{}' is longer than the {} characters the kernel keeps of a command, use cmdline~ instead", value, ProcessWatch::MaxCommandLength);
+				return false;
+			}
+			outWatch.command = value;
+		}
+		else if (key == "cgroup")
+		{
+			outWatch.cgroupPrefix = value;
+		}
+		else if (key == "user")
+		{
+			uid_t uid = 0;
+			if (parseConfigNumber(value, uid))
+			{
+				outWatch.uid = uid;
+				continue;
+			}
+
+			const std::string userName(value);
+			std::array<char, 1024> buffer;
+			passwd entry;
+			passwd* result = nullptr;
+			if (getpwnam_r(userName.c_str(), &entry, buffer.data(), buffer.size(), &result) != 0 || result == nullptr)
+			{
+				outError = std::format("unknown user '{}'", value);
+				return false;
+			}
+			outWatch.uid = result->pw_uid;
+		}
+		else
+		{
+			outError = std::format("unknown matcher '{}', expected name, user, cgroup or cmdline", key);
+			return false;
+		}
+	}
+
+	if (!hasMatcher)
+	{
+		outError = "expected at least one of name=, user=, cgroup= or cmdline~";
+		return false;
+	}
+	return true;
+}
+
+// reads and validates the whole config file, errors are printed with the line number
+// nothing changes if the file is invalid, otherwise the metrics of the new watches are registered
+// rules and threshold.<metric> lines replace all the built-in threshold rules, including the default -m, -c and -O ones,
+// so they can't be combined with the threshold settings below or the threshold arguments
+// every non-empty line that isn't a '#' comment is one of
+// rule <name>: <expression> [for <N> samples | for <N>s|m|h]
+// watch <name>: [name=<command>] [user=<user>] [cgroup=<path prefix>] [cmdline~<regex>]
+//   adds the metrics watch.<name>.count|rss_mb_max|rss_mb_total|cpu_pct_max|cpu_pct_total for the rules after it
+// threshold.<metric> = <value>
+// check_interval | command_timeout | notification_throttle = <seconds>
+// min_check_interval_ms = <milliseconds>
+// notification_script = <command>
+// report_file_limit = <count>
+// disk_threshold = <percent>
+// disk_full_hours = <hours>
+// diskio_await_threshold_ms = <milliseconds>
+// net_drop_threshold_pct = <percent>
+// tcp_threshold = <count>
+// thrashing_threshold = <pages per second>
+// oom_kill_threshold = <count>
+// pss_candidates = <count>
+std::optional<Config> loadConfig(const std::string& path, MetricTable& outMetrics, const Args& commandLineArgs)
+{
+	// the rules after a watch refer to its metrics, they are added to a copy until the whole file is valid
+	MetricTable metrics = outMetrics;
+	std::string text;
+	if (!readSmallFile(AT_FDCWD, path.c_str(), text))
+	{
+		fprintf(stderr, "Could not read config file '%s'\n", path.c_str());
+		return std::nullopt;
+	}
+
+	Config config;
+	config.args = commandLineArgs;
+	bool isValid = true;
+	size_t lineNumber = 0;
+	// the first rule or threshold.<metric> line, and the first setting of a built-in threshold rule
+	size_t ruleLineNumber = 0;
+	size_t thresholdSettingLineNumber = 0;
+	std::string_view thresholdSettingKey;
+	for (size_t lineStart = 0; lineStart < text.size();)
+	{
+		const size_t lineEnd = std::min(text.find('\n', lineStart), text.size());
+		const std::string_view rawLine = std::string_view(text).substr(lineStart, lineEnd - lineStart);
+		const std::string_view line = trimSpaces(rawLine);
+		lineStart = lineEnd + 1;
+		++lineNumber;
+
+		if (line.empty() || line.front() == '#')
+		{
+			continue;
+		}
+
+		auto reportError = [&](std::string_view error) {
+			fprintf(stderr, "%s:%zu: %.*s\n", path.c_str(), lineNumber, int(error.size()), error.data());
+			isValid = false;
+		};
+
+		if (line.starts_with("rule "))
+		{
+			ruleLineNumber = (ruleLineNumber != 0) ? ruleLineNumber : lineNumber;
+			const size_t colonPosition = line.find(':');
+			if (colonPosition == std::string_view::npos)
+			{
+				reportError("expected 'rule <name>: <expression>'");
+				continue;
+			}
+
+			Rule rule;
+			rule.name = trimSpaces(line.substr(5, colonPosition - 5));
+			if (rule.name.empty() || rule.name.find_first_of(" \t") != std::string::npos)
+			{
+				reportError("rule name should be a single word");
+				continue;
+			}
+			if (std::ranges::any_of(config.ruleSet.rules, [&](const Rule& other) { return other.name == rule.name; }))
+			{
+				reportError(std::format("rule '{}' is defined twice", rule.name));
+				continue;
+			}
+
+			std::string error;
+			const size_t expressionColumn = size_t(line.data() - rawLine.data()) + colonPosition + 1;
+			if (!RuleCompiler(metrics, line.substr(colonPosition + 1), config.ruleSet, expressionColumn).compile(rule, error))
+			{
+				reportError(error);
+				continue;
+			}
+
+			rule.title = std::format("Rule '{}' triggered", rule.name);
+			if (rule.valueMetric.has_value())
+			{
+				rule.valueLabel = metrics.getName(*rule.valueMetric);
+			}
+			config.ruleSet.rules.push_back(std::move(rule));
+			continue;
+		}
+
+		if (line.starts_with("watch "))
+		{
+			const size_t colonPosition = line.find(':');
+			if (colonPosition == std::string_view::npos)
+			{
+				reportError("expected 'watch <name>: <matchers>'");
+				continue;
+			}
+
+			ProcessWatch watch;
+			watch.name = trimSpaces(line.substr(6, colonPosition - 6));
+			if (watch.name.empty() || watch.name.find_first_of(" \t") != std::string::npos)
+			{
+				reportError("watch name should be a single word");
+				continue;
+			}
+			if (std::ranges::any_of(config.watches, [&](const ProcessWatch& other) { return other.name == watch.name; }))
+			{
+				reportError(std::format("watch '{}' is defined twice", watch.name));
+				continue;
+			}
+
+			std::string error;
+			if (!parseProcessWatchMatchers(line.substr(colonPosition + 1), watch, error))
+			{
+				reportError(error);
+				continue;
+			}
+
+			for (size_t i = 0; i < ProcessWatch::MetricKindCount; ++i)
+			{
+				watch.metrics[i] = metrics.addMetric(std::format("watch.{}.{}", watch.name, ProcessWatch::MetricNames[i]));
+			}
+			config.watches.push_back(std::move(watch));
+			continue;
+		}
+
+		const size_t equalsPosition = line.find('=');
+		if (equalsPosition == std::string_view::npos)
+		{
+			reportError("expected 'rule <name>: <expression>' or '<setting> = <value>'");
+			continue;
+		}
+
+		const std::string_view key = trimSpaces(line.substr(0, equalsPosition));
+		const std::string_view value = trimSpaces(line.substr(equalsPosition + 1));
+		bool isValueValid = true;
+		if (key.starts_with("threshold."))
+		{
+			ruleLineNumber = (ruleLineNumber != 0) ? ruleLineNumber : lineNumber;
+			const std::string_view metricName = key.substr(10);
+			const std::optional<size_t> metricIndex = metrics.findMetric(metricName);
+			if (!metricIndex.has_value())
+			{
+				reportError(std::format("unknown metric '{}'", metricName));
+				continue;
+			}
+			if (std::ranges::any_of(config.ruleSet.rules, [&](const Rule& other) { return other.name == metricName; }))
+			{
+				reportError(std::format("rule '{}' is defined twice", metricName));
+				continue;
+			}
+
+			double threshold = 0.0;
+			std::string error;
+			if (!parseConfigNumber(value, threshold))
+			{
+				isValueValid = false;
+			}
+			else if (!addThresholdRule(metrics, *metricIndex, threshold, config.ruleSet, error))
+			{
+				reportError(error);
+				continue;
+			}
+		}
+		else if (key == "check_interval")
+		{
+			isValueValid = parseConfigSetting(value, config.args.timeBetweenChecksSec);
+		}
+		else if (key == "min_check_interval_ms")
+		{
+			isValueValid = parseConfigSetting(value, config.args.minTimeBetweenChecksMs);
+		}
+		else if (key == "command_timeout")
+		{
+			isValueValid = parseConfigSetting(value, config.args.commandTimeoutSec);
+		}
+		else if (key == "notification_throttle")
+		{
+			isValueValid = parseConfigSetting(value, config.args.notificationThrottleSec);
+		}
+		else if (key == "notification_script")
+		{
+			config.args.runCustomScript = value;
+		}
+		else if (key == "report_file_limit")
+		{
+			isValueValid = parseConfigSetting(value, config.args.limitReportFiles);
+		}
+		else if (key == "disk_threshold")
+		{
+			isValueValid = parseConfigPercent(value, config.args.diskThresholdPct);
+		}
+		else if (key == "disk_full_hours")
+		{
+			isValueValid = parseConfigSetting(value, config.args.diskFullHoursThreshold);
+		}
+		else if (key == "diskio_await_threshold_ms")
+		{
+			isValueValid = parseConfigSetting(value, config.args.diskIoAwaitThresholdMs);
+		}
+		else if (key == "net_drop_threshold_pct")
+		{
+			isValueValid = parseConfigPercent(value, config.args.netDropThresholdPct);
+		}
+		else if (key == "tcp_threshold")
+		{
+			isValueValid = parseConfigSetting(value, config.args.tcpThreshold);
+		}
+		else if (key == "thrashing_threshold")
+		{
+			isValueValid = parseConfigSetting(value, config.args.thrashingThreshold);
+		}
+		else if (key == "oom_kill_threshold")
+		{
+			isValueValid = parseConfigSetting(value, config.args.oomKillThreshold);
+		}
+		else if (key == "pss_candidates")
+		{
+			isValueValid = parseConfigSetting(value, config.args.pssCandidateCount);
+		}
+		else
+		{
+			reportError(std::format("unknown setting '{}'", key));
+			continue;
+		}
+
+		if (!isValueValid)
+		{
+			reportError(std::format("invalid value '{}' for '{}'", value, key));
+		}
+		else if (thresholdSettingLineNumber == 0 && std::ranges::find(ThresholdSettingKeys, key) != ThresholdSettingKeys.end())
+		{
+			thresholdSettingLineNumber = lineNumber;
+			thresholdSettingKey = key;
+		}
+	}
+
+	if (isValid && ruleLineNumber != 0 && thresholdSettingLineNumber != 0)
+	{
+		fprintf(stderr, "%s:%zu: '%.*s' has no effect with the rule on line %zu, use a 'threshold.<metric>' line instead\n",
+			path.c_str(), thresholdSettingLineNumber, int(thresholdSettingKey.size()), thresholdSettingKey.data(), ruleLineNumber);
+		isValid = false;
+	}
+	const std::optional<std::string_view> thresholdArgument = findThresholdArgument(commandLineArgs);
+	if (isValid && ruleLineNumber != 0 && thresholdArgument.has_value())
+	{
+		fprintf(stderr, "%s:%zu: the %.*s argument has no effect with rules in the config file, use a 'threshold.<metric>' line instead\n",
+			path.c_str(), ruleLineNumber, int(thresholdArgument->size()), thresholdArgument->data());
+		isValid = false;
+	}
+
+	if (!isValid)
+	{
+		return std::nullopt;
+	}
+
+	std::string error;
+	if (config.ruleSet.rules.empty() && !addThresholdRules(config.args, metrics, config.ruleSet, error))
+	{
+		fprintf(stderr, "%s: invalid threshold: %s\n", path.c_str(), error.c_str());
+		return std::nullopt;
+	}
+
+	// the new metrics come after the existing ones in the copy, so they get the same indices
+	for (size_t i = outMetrics.getSize(); i < metrics.getSize(); ++i)
+	{
+		outMetrics.addMetric(metrics.getName(i));
+	}
+	return config;
+}
+
+// set from the SIGHUP handler
+volatile sig_atomic_t gIsConfigReloadRequested = 0;
+
+void onConfigReloadSignal(int) noexcept
+{
+	gIsConfigReloadRequested = 1;
+}
+
+// set from the SIGTERM and SIGINT handler, the monitor stops after the current check
+volatile sig_atomic_t gIsStopRequested = 0;
+
+void onStopSignal(int) noexcept
+{
+	gIsStopRequested = 1;
+}
+
+// swaps in the settings and the rules from the config file if it's valid, otherwise keeps the current ones
+// rule states are matched by name, so throttles and "for" conditions carry over
+void reloadConfig(const Args& commandLineArgs, Args& args, AppState& appState)
+{
+	gIsConfigReloadRequested = 0;
+	if (commandLineArgs.configFilePath.empty())
+	{
+		fprintf(stderr, "Config reload requested, but no config file was given\n");
+		return;
+	}
+
+	TraceSpan span("reloadConfig");
+	std::optional<Config> config = loadConfig(commandLineArgs.configFilePath, appState.metrics, commandLineArgs);
+	if (!config.has_value())
+	{
+		fprintf(stderr, "Config file is invalid, keeping the current settings\n");
+		return;
+	}
+
+	std::vector<RuleState> ruleStates(config->ruleSet.rules.size());
+	std::vector<bool> isOldRuleKept(appState.ruleStates.size());
+	for (size_t i = 0; i < ruleStates.size(); ++i)
+	{
+		const auto& oldRules = appState.ruleSet.rules;
+		const auto it = std::ranges::find(oldRules, config->ruleSet.rules[i].name, &Rule::name);
+		if (it == oldRules.end())
+		{
+			continue;
+		}
+
+		const size_t oldIndex = size_t(it - oldRules.begin());
+		ruleStates[i] = appState.ruleStates[oldIndex];
+		isOldRuleKept[oldIndex] = true;
+		// the timers keep running, only the rule index they refer to changes
+		if (ruleStates[i].cooldownTimer != TimingWheel::InvalidTimer)
+		{
+			appState.ruleTimers.setPayload(ruleStates[i].cooldownTimer, getRuleTimerPayload(i, RuleTimerKind::Cooldown));
+		}
+		if (config->ruleSet.rules[i].evaluationPeriod.count() == 0)
+		{
+			appState.ruleTimers.cancel(ruleStates[i].periodTimer);
+			ruleStates[i].periodTimer = TimingWheel::InvalidTimer;
+			ruleStates[i].isDue = true;
+		}
+		else if (ruleStates[i].periodTimer != TimingWheel::InvalidTimer)
+		{
+			appState.ruleTimers.setPayload(ruleStates[i].periodTimer, getRuleTimerPayload(i, RuleTimerKind::Period));
+		}
+	}
+
+	for (size_t i = 0; i < isOldRuleKept.size(); ++i)
+	{
+		if (!isOldRuleKept[i])
+		{
+			appState.ruleTimers.cancel(appState.ruleStates[i].cooldownTimer);
+			appState.ruleTimers.cancel(appState.ruleStates[i].periodTimer);
+		}
+	}
+
+	args = std::move(config->args);
+	appState.ruleSet = std::move(config->ruleSet);
+	appState.ruleStates = std::move(ruleStates);
+	appState.watchList.setWatches(std::move(config->watches), appState.metrics, appState.processTable.get());
+	fprintf(stderr, "Config reloaded with %zu rules\n", appState.ruleSet.rules.size());
+}
+
+void sendNotification(const Args& args, std::string_view message)
+{
+	TraceSpan span("sendNotification");
+	// the message is passed as one single-quoted argument
+	std::string quotedMessage;
+	for (const char c : message)
+	{
+		quotedMessage += (c == '\'') ? std::string_view("'\\''") : std::string_view(&c, 1);
+	}
+	const std::string command = std::format("{} '{}'", args.runCustomScript, quotedMessage);
+	const CommandResult result = runCommand(command, std::chrono::seconds(args.commandTimeoutSec), [](std::string_view output) {
+		fwrite(output.data(), 1, output.size(), stdout);
+		return true;
+	});
+	if (!result.hasStarted)
+	{
+		fprintf(stderr, "Could not start notification script\n");
+	}
+	else if (result.hasTimedOut)
+	{
+		fprintf(stderr, "Notification script timed out and was killed\n");
+	}
+	else if (result.exitCode != 0)
+	{
+		fprintf(stderr, "Notification script exited with non-zero code %d\n", result.exitCode);
+	}
+}
+
+int getFreePartValue(std::string& buffer, size_t partIndex)
+{
+	// free -L prints 4 blocks of the same size (usually 20 characters long each) + a '\n'
+	// the size of the longest header + one space after
+	const size_t longestHeaderLen = 8 + 1;
+	const size_t startOffset = (buffer.size() - 1) / 4 * partIndex + longestHeaderLen;
+	const size_t maxNumberLen = (buffer.size() - 1) / 4 - longestHeaderLen;
+
+	const size_t end = std::min(startOffset + maxNumberLen, buffer.size());
+	size_t numberStart = startOffset;
+	size_t numberLen = maxNumberLen;
+	for (size_t i = startOffset; i < end ; ++i)
+	{
+		--numberLen;
+		if (buffer[i] != ' ')
+		{
+			numberStart = i;
+			break;
+		}
+	}
+
+	// unfortunate allocation because we want a null-terminated string without butchering the original string
+	const std::string numberPart = buffer.substr(numberStart, numberLen);
+	std::optional<int> parsedNumber = parseInt(numberPart.data(), 10);
+	if (!parsedNumber.has_value())
+	{
+		fprintf(stderr, "Failed to parse number '%s' from 'free -L' output '%s'\n", numberPart.data(), buffer.data());
+		return 0;
+	}
+
+	return *parsedNumber;
+}
+
+float checkMemory(const Args& args, std::string& buffer)
+{
+	TraceSpan span("checkMemory");
+	buffer.clear();
+	const bool hasExecuted = readCommandOutput("free -L", std::chrono::seconds(args.commandTimeoutSec), buffer);
+	if (!hasExecuted)
+	{
+		fprintf(stderr, "Could not execute 'free -L'\n");
+	}
+
+	const int usedValue = getFreePartValue(buffer, 2);
+	const int freeValue = getFreePartValue(buffer, 3);
+
+	const float usedFraction = float(usedValue) / (float(freeValue) + float(usedValue));
+
+	return usedFraction * 100.0;
+}
+
+bool isSubstr(std::string_view string, std::string_view substring, size_t position)
+{
+	if (position + substring.size() >= string.size())
+	{
+		return false;
+	}
+
+	for (size_t i = 0, size = substring.size(); i < size; ++i)
+	{
+		if (string[position + i] != substring[i])
+		{
+			return false;
 		}
 	}
 
 	return true;
 }
 
-float checkCpu(std::string& buffer)
+float checkCpu(const Args& args, AppState& appState, std::string& buffer)
+{
+	TraceSpan span("checkCpu");
+	if (appState.cpuStreamReader)
+	{
+		appState.cpuStreamReader->update();
+		if (const std::optional<float> cpuPct = appState.cpuStreamReader->getLatestCpuPct(std::chrono::seconds(5)); cpuPct.has_value())
+		{
+			return *cpuPct;
+		}
+		// fall back to a one-time run while the streaming process is not providing samples
+	}
+
+	buffer.clear();
+	const bool hasExecuted = readCommandOutput("sar --dec=0 1 1 | tail -n 3", std::chrono::seconds(args.commandTimeoutSec), buffer);
+	if (!hasExecuted)
+	{
+		fprintf(stderr, "Could not execute 'sar --dec=0 1 1 | tail -n 3'\n");
+	}
+
+	// first find the offset of %idle column in the first line
+	int idleOffset = -1;
+	size_t secondLineStart = 0;
+	for (size_t i = 0; i < buffer.size(); ++i)
+	{
+		if (isSubstr(buffer, "%idle", i))
+		{
+			idleOffset = int(i);
+		}
+
+		if (buffer[i] == '\n')
+		{
+			secondLineStart = i + 1;
+			break;
+		}
+	}
+
+	if (idleOffset == -1)
+	{
+		fprintf(stderr, "Could not find idle column in 'sar --dec=0 1 1 | tail -n 3' output\n");
+		return 0;
+	}
+
+	// unfortunate allocation because we want a null-terminated string without butchering the original string
+	std::string numberPart = buffer.substr(secondLineStart + idleOffset + 2, 3);
+	std::optional<int> parsedNumber = parseInt(numberPart.data(), 10);
+
+	if (!parsedNumber.has_value())
+	{
+		fprintf(stderr, "Failed to parse number '%s' from 'sar --dec=0 1 1 | tail -n 3' output '%s'\n", numberPart.data(), buffer.data());
+		return 0;
+	}
+
+	return float(100 - *parsedNumber);
+}
+
+void collectMetrics(const Args& args, AppState& appState, std::string& readBuffer)
+{
+	TraceSpan span("collectMetrics");
+	const auto startTime = std::chrono::steady_clock::now();
+	appState.metrics.setValue(MetricTable::MemMetric, checkMemory(args, readBuffer));
+	appState.metrics.setValue(MetricTable::CpuMetric, checkCpu(args, appState, readBuffer));
+	appState.metrics.setValue(MetricTable::CpuCoreMaxMetric, appState.cpuCoreSampler.sampleMaxCorePct(readBuffer));
+	appState.diskCollector->collect(appState.metrics, startTime);
+	appState.diskIoCollector->collect(appState.metrics, startTime, readBuffer);
+	appState.netCollector->collect(appState.metrics, startTime, readBuffer);
+	appState.socketCollector->collect(appState.metrics);
+	appState.vmStatCollector.collect(appState.metrics, startTime, readBuffer);
+	if (!appState.watchList.isEmpty())
+	{
+		appState.watchList.collect(appState.metrics, appState.processTable.get());
+	}
+	appState.metrics.setValue(MetricTable::SelfCheckDurationMetric, std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count());
+}
+
+std::chrono::milliseconds getCheckInterval(const Args& args, const AppState& appState) noexcept
+{
+	const std::chrono::milliseconds maxInterval = std::chrono::seconds(args.timeBetweenChecksSec);
+	if (args.minTimeBetweenChecksMs == 0 || appState.adaptiveSampler.getInterval().count() == 0)
+	{
+		return maxInterval;
+	}
+	return std::clamp(appState.adaptiveSampler.getInterval(), std::min(std::chrono::milliseconds(args.minTimeBetweenChecksMs), maxInterval), maxInterval);
+}
+
+std::string getRuleNotificationMessage(const Rule& rule, const MetricTable& metrics)
+{
+	if (!rule.valueMetric.has_value())
+	{
+		return rule.title;
+	}
+	return std::format("{}. {} is {:.2f}{}", rule.title, rule.valueLabel, metrics.getValue(*rule.valueMetric), rule.valueUnit);
+}
+
+// calls the function with the index of every metric the firing rules read
+template<typename Func>
+void forEachFiringRuleMetric(const AppState& appState, Func&& func)
+{
+	for (const size_t ruleIndex : appState.firingRules)
+	{
+		const Rule& rule = appState.ruleSet.rules[ruleIndex];
+		for (uint32_t i = rule.codeBegin; i < rule.codeEnd; ++i)
+		{
+			const RuleInstruction instruction = appState.ruleSet.code[i];
+			if (instruction.opcode == RuleOpcode::PushMetric)
+			{
+				func(size_t(instruction.operand));
+			}
+		}
+	}
+}
+
+// the filesystems the firing rules are about, to capture where the space went
+// walking a filesystem is slow and where the space went changes slowly, so a mount is walked once per notification throttle
+void addDiskUsageMounts(const Args& args, AppState& appState, std::chrono::steady_clock::time_point timeNow, std::vector<std::string>& outMounts)
+{
+	outMounts.clear();
+	forEachFiringRuleMetric(appState, [&](size_t metricIndex) {
+		const std::optional<std::string_view> mountPath = appState.diskCollector->findMountForMetric(appState.metrics, metricIndex);
+		if (!mountPath.has_value() || std::ranges::find(outMounts, *mountPath) != outMounts.end())
+		{
+			return;
+		}
+
+		auto [it, isNew] = appState.diskUsageReportTimes.try_emplace(std::string(*mountPath), timeNow);
+		if (!isNew && timeNow < it->second + std::chrono::seconds(args.notificationThrottleSec))
+		{
+			return;
+		}
+		it->second = timeNow;
+		outMounts.emplace_back(*mountPath);
+	});
+}
+
+// the processes doing the I/O are worth reporting only when the alert is about disk I/O
+bool isAnyFiringRuleAboutDiskIo(const AppState& appState)
 {
-	buffer.clear();
-	const bool hasExecuted = readCommandOutput("sar --dec=0 1 1 | tail -n 3", buffer);
-	if (!hasExecuted)
+	bool isAboutDiskIo = false;
+	forEachFiringRuleMetric(appState, [&](size_t metricIndex) {
+		isAboutDiskIo = isAboutDiskIo || appState.diskIoCollector->isDiskIoMetric(metricIndex);
+	});
+	return isAboutDiskIo;
+}
+
+bool isAnyFiringRuleAboutSockets(const AppState& appState)
+{
+	bool isAboutSockets = false;
+	forEachFiringRuleMetric(appState, [&](size_t metricIndex) {
+		isAboutSockets = isAboutSockets || appState.socketCollector->isSocketMetric(metricIndex);
+	});
+	return isAboutSockets;
+}
+
+bool doPeriodicCheck(const Args& args, AppState& appState, std::string& readBuffer)
+{
+	TraceSpan span("doPeriodicCheck");
+	collectMetrics(args, appState, readBuffer);
+
+	appState.firingRules.clear();
+	const auto timeNow = std::chrono::steady_clock::now();
+	if (args.minTimeBetweenChecksMs > 0)
 	{
-		fprintf(stderr, "Could not execute 'sar --dec=0 1 1 | tail -n 3'\n");
+		appState.adaptiveSampler.update(appState.ruleSet, appState.metrics, timeNow, std::chrono::milliseconds(args.minTimeBetweenChecksMs), std::chrono::seconds(args.timeBetweenChecksSec));
 	}
+	const bool isFirstCheck = appState.previousCheckTime == std::chrono::steady_clock::time_point();
+	appState.metrics.setValue(MetricTable::SelfCheckIntervalMetric, isFirstCheck ? std::numeric_limits<double>::quiet_NaN() : std::chrono::duration<double>(timeNow - appState.previousCheckTime).count());
+	appState.previousCheckTime = timeNow;
+	{
+		TraceSpan rulesSpan("evaluateRules");
+		appState.ruleTimers.advance(timeNow, [&](TimingWheel::TimerId, uint32_t payload) {
+			RuleState& state = appState.ruleStates[payload >> 1];
+			if (static_cast<RuleTimerKind>(payload & 1) == RuleTimerKind::Cooldown)
+			{
+				state.cooldownTimer = TimingWheel::InvalidTimer;
+			}
+			else
+			{
+				state.periodTimer = TimingWheel::InvalidTimer;
+				state.isDue = true;
+			}
+		});
 
-	// first find the offset of %idle column in the first line
-	int idleOffset = -1;
-	size_t secondLineStart = 0;
-	for (size_t i = 0; i < buffer.size(); ++i)
+		const double* metricValues = appState.metrics.getValues();
+		for (size_t i = 0; i < appState.ruleSet.rules.size(); ++i)
+		{
+			const Rule& rule = appState.ruleSet.rules[i];
+			RuleState& state = appState.ruleStates[i];
+			if (!state.isDue)
+			{
+				continue;
+			}
+			if (rule.evaluationPeriod.count() > 0)
+			{
+				state.isDue = false;
+				state.periodTimer = appState.ruleTimers.schedule(timeNow + rule.evaluationPeriod, getRuleTimerPayload(i, RuleTimerKind::Period));
+			}
+
+			const bool isConditionTrue = isRuleValueTrue(evaluateRule(appState.ruleSet, rule, metricValues));
+			if (updateRuleState(rule, isConditionTrue, timeNow, state))
+			{
+				appState.firingRules.push_back(i);
+			}
+		}
+	}
+
+	if (appState.firingRules.empty())
 	{
-		if (isSubstr(buffer, "%idle", i))
+		return false;
+	}
+
+	if (timeNow >= appState.nextReportTime)
+	{
+		// checks close to the minimum interval would otherwise write a report each, and quickly reach the report file limit,
+		// the minimum interval is left as slack for the jitter of the check times
+		if (args.minTimeBetweenChecksMs > 0)
 		{
-			idleOffset = int(i);
+			const std::chrono::milliseconds maxInterval = std::chrono::seconds(args.timeBetweenChecksSec);
+			appState.nextReportTime = timeNow + maxInterval - std::min(std::chrono::milliseconds(args.minTimeBetweenChecksMs), maxInterval);
 		}
 
-		if (buffer[i] == '\n')
+		// one snapshot per alert cycle, both views are rendered from it on the writer thread
+		TraceSpan reportSpan("report");
+		if (ReportJob* job = appState.reportWriter->acquireJob())
 		{
-			secondLineStart = i + 1;
-			break;
+			ProcessReadOptions readOptions;
+			readOptions.shouldReadIo = isAnyFiringRuleAboutDiskIo(appState);
+			readOptions.shouldReadCgroup = true;
+			if (appState.processTable)
+			{
+				appState.processTable->collect(job->snapshot, readOptions);
+			}
+			else
+			{
+				collectProcessSnapshot(job->snapshot, readOptions);
+			}
+			collectProportionalMemory(job->snapshot, args.pssCandidateCount);
+			job->shouldReportSocketOwners = isAnyFiringRuleAboutSockets(appState);
+			job->memConsumptionPct = float(appState.metrics.getValue(MetricTable::MemMetric));
+			job->cpuConsumptionPct = float(appState.metrics.getValue(MetricTable::CpuMetric));
+			job->memoryPressure = appState.vmStatCollector.getStats();
+			addDiskUsageMounts(args, appState, timeNow, job->diskUsageMounts);
+			appState.reportWriter->submitJob();
 		}
+
+		const ReportWriterStats stats = appState.reportWriter->getStats();
+		if (stats.droppedCount != appState.reportWriterStats.droppedCount || stats.failedCount != appState.reportWriterStats.failedCount)
+		{
+			fprintf(stderr, "Report writer is falling behind: %llu reports dropped, %llu failed, %.3f s spent waiting, out of %llu\n",
+				static_cast<unsigned long long>(stats.droppedCount), static_cast<unsigned long long>(stats.failedCount),
+				double(stats.blockedTimeNs) / 1e9, static_cast<unsigned long long>(stats.submittedCount + stats.droppedCount));
+		}
+		appState.reportWriterStats = stats;
 	}
 
-	if (idleOffset == -1)
+	for (const size_t ruleIndex : appState.firingRules)
 	{
-		fprintf(stderr, "Could not find idle column in 'sar --dec=0 1 1 | tail -n 3' output\n");
-		return 0;
+		const Rule& rule = appState.ruleSet.rules[ruleIndex];
+		RuleState& state = appState.ruleStates[ruleIndex];
+		if (!args.runCustomScript.empty() && state.cooldownTimer == TimingWheel::InvalidTimer)
+		{
+			sendNotification(args, getRuleNotificationMessage(rule, appState.metrics));
+			const auto cooldownEndTime = timeNow + std::chrono::seconds(args.notificationThrottleSec);
+			state.cooldownTimer = appState.ruleTimers.schedule(cooldownEndTime, getRuleTimerPayload(ruleIndex, RuleTimerKind::Cooldown));
+		}
 	}
 
-	// unfortunate allocation because we want a null-terminated string without butchering the original string
-	std::string numberPart = buffer.substr(secondLineStart + idleOffset + 2, 3);
-	std::optional<int> parsedNumber = parseInt(numberPart.data(), 10);
+	return true;
+}
 
-	if (!parsedNumber.has_value())
+// sleeps until the deadline while processing the output of the streaming processes and the process events as they arrive
+// returns false early if a config reload or a stop was requested
+bool waitForNextCheck(AppState& appState, std::chrono::steady_clock::time_point deadline)
+{
+	while (true)
 	{
-		fprintf(stderr, "Failed to parse number '%s' from 'sar --dec=0 1 1 | tail -n 3' output '%s'\n", numberPart.data(), buffer.data());
-		return 0;
+		if (gIsConfigReloadRequested || gIsStopRequested)
+		{
+			return false;
+		}
+
+		const auto timeNow = std::chrono::steady_clock::now();
+		if (timeNow >= deadline)
+		{
+			return true;
+		}
+
+		// wake up at least once a second, so a dead streaming process gets restarted in time
+		// and a reload signal delivered to another thread is noticed
+		const int timeoutMs = int(std::chrono::ceil<std::chrono::milliseconds>(deadline - timeNow).count());
+		std::array<pollfd, 2> pollFds{
+			pollfd{appState.cpuStreamReader ? appState.cpuStreamReader->getFd() : -1, POLLIN, 0},
+			pollfd{appState.processTable ? appState.processTable->getFd() : -1, POLLIN, 0},
+		};
+		poll(pollFds.data(), pollFds.size(), std::min(timeoutMs, 1000));
+		if (appState.cpuStreamReader)
+		{
+			appState.cpuStreamReader->update();
+		}
+		// the events are applied as they arrive, so the socket buffer doesn't overflow during a burst of forks
+		if (appState.processTable)
+		{
+			appState.processTable->processEvents();
+		}
 	}
+}
 
-	return float(100 - *parsedNumber);
+void checkFileOverflow(const Args& args, AppState& appState)
+{
+	if (args.limitReportFiles == 0)
+	{
+		return;
+	}
+
+	TraceSpan span("checkFileOverflow");
+
+	// with the report log the limit applies to segments, and the oldest ones are dropped
+	if (appState.reportLogWriter)
+	{
+		appState.reportLogWriter->removeOldSegments(args.limitReportFiles);
+		return;
+	}
+
+	auto it = std::filesystem::directory_iterator{"reports"};
+	if (std::count_if(it, {}, [](auto& x){return x.is_regular_file(); }) > int(args.limitReportFiles))
+	{
+		fprintf(stderr, "Too many files in the report folder, stopping the service to not consume all the space\n");
+		stopExecution(ExitReason::TooManyReportFiles);
+	}
 }
 
-bool doPeriodicCheck(const Args& args, AppState& appState, std::string& readBuffer)
+struct DumpArgs
+{
+	// substring of the command or the command line
+	std::string processFilter;
+	int pidFilter = 0;
+	// unix time in seconds
+	int64_t fromTime = std::numeric_limits<int64_t>::min();
+	int64_t toTime = std::numeric_limits<int64_t>::max();
+	ProcessSortKey sortKey = ProcessSortKey::Memory;
+	std::vector<std::string> reportFiles;
+};
+
+// resource_alert dump [-p <command substring>] [-i <pid>] [-a <from unix time>] [-b <to unix time>] [-s mem|cpu] <report files...>
+DumpArgs readDumpArgs(int argc, char** argv)
 {
-	bool foundIssues = false;
-	const float memConsumptionPct = checkMemory(readBuffer);
-	if (memConsumptionPct >= args.memThresholdPct)
+	DumpArgs args;
+	// the first argument is the subcommand name
+	for (int i = 2; i < argc; ++i)
 	{
-		foundIssues = true;
-		const auto timeNow = std::chrono::system_clock::now();
-		const bool couldSavePs = saveCommandOutput("ps aux --sort=-%mem", std::format("reports/mem_report_ps_{:%y%m%d_%H%M%OS}_{}.txt", timeNow, int(memConsumptionPct)));
-		if (!couldSavePs)
+		if (argv[i][0] != '-')
+		{
+			args.reportFiles.emplace_back(argv[i]);
+			continue;
+		}
+
+		bool isFound = false;
+		bool isMissingValue = false;
+		if (argv[i][1] != '\0' && argv[i][2] == '\0')
+		{
+			switch (argv[i][1])
+			{
+			case 'p':
+				isMissingValue = !readArgValue(args.processFilter, argc, argv, i);
+				isFound = true;
+				break;
+			case 'i':
+				isMissingValue = !readArgValue(args.pidFilter, argc, argv, i);
+				isFound = true;
+				break;
+			case 'a':
+				isMissingValue = !readArgValue(args.fromTime, argc, argv, i);
+				isFound = true;
+				break;
+			case 'b':
+				isMissingValue = !readArgValue(args.toTime, argc, argv, i);
+				isFound = true;
+				break;
+			case 's':
+			{
+				std::string sortKeyName;
+				isMissingValue = !readArgValue(sortKeyName, argc, argv, i) || (sortKeyName != "mem" && sortKeyName != "cpu");
+				args.sortKey = (sortKeyName == "cpu") ? ProcessSortKey::Cpu : ProcessSortKey::Memory;
+				isFound = true;
+				break;
+			}
+			}
+		}
+
+		if (!isFound)
 		{
-			fprintf(stderr, "Could not save mem report from ps to file\n");
+			fprintf(stderr, "Unknown argument '%s'\n", argv[i]);
+			stopExecution(ExitReason::UnknownArgument);
 		}
 
-		const bool couldSaveTop = saveCommandOutput("top -b -n 1 -o =%MEM", std::format("reports/mem_report_top_{:%y%m%d_%H%M%OS}_{}.txt", timeNow, int(memConsumptionPct)));
-		if (!couldSaveTop)
+		if (isMissingValue)
 		{
-			fprintf(stderr, "Could not save mem report from top to file\n");
+			fprintf(stderr, "Argument '%s' did not have a valid value\n", argv[i]);
+			stopExecution(ExitReason::MissingArgumentValue);
 		}
+	}
+
+	return args;
+}
+
+bool isProcessMatchingDumpFilter(const DumpArgs& args, const ProcessRecord& process)
+{
+	if (args.pidFilter != 0 && process.pid != args.pidFilter)
+	{
+		return false;
+	}
 
-		trySendNotification(args, appState.lastMemAlertSentTime, "Memory consumption is high", memConsumptionPct);
+	if (!args.processFilter.empty())
+	{
+		return process.command.find(args.processFilter) != std::string::npos || process.commandLine.find(args.processFilter) != std::string::npos;
 	}
 
-	const float cpuConsumptionPct = checkCpu(readBuffer);
-	if (cpuConsumptionPct >= args.cpuThresholdPct)
+	return true;
+}
+
+bool isProcessMatchingDumpFilter(const DumpArgs& args, const BinaryReportView& report, size_t processIndex, const std::vector<bool>& matchingStrings)
+{
+	if (args.pidFilter != 0)
 	{
-		foundIssues = true;
-		const auto timeNow = std::chrono::system_clock::now();
-		const bool couldSave = saveCommandOutput("ps aux --sort=-%cpu", std::format("reports/cpu_report_{:%y%m%d_%H%M%OS}_{}.txt", timeNow, int(cpuConsumptionPct)));
-		if (!couldSave)
+		ProcessRecord record;
+		report.fillProcessRecord(processIndex, record);
+		if (record.pid != args.pidFilter)
 		{
-			fprintf(stderr, "Could not save cpu report to file\n");
+			return false;
 		}
+	}
 
-		trySendNotification(args, appState.lastCpuAlertSentTime, "CPU consumption is high", cpuConsumptionPct);
+	if (!args.processFilter.empty())
+	{
+		return matchingStrings[report.getCommandIndex(processIndex)] || matchingStrings[report.getCommandLineIndex(processIndex)];
 	}
 
-	return foundIssues;
+	return true;
 }
 
-void checkFileOverflow(const Args& args)
+// hands the report to the decoder (a delta is applied to the previous ones) and renders it if it's in the time range
+// a keyframe is rendered from its own data, so only the matching processes are read from it
+void dumpBinaryReport(const DumpArgs& args, std::string_view label, const BinaryReportView& report, bool isInRange, BinaryReportDecoder& decoder, std::string& output)
 {
-	if (args.limitReportFiles == 0)
+	if (!decoder.apply(report))
 	{
+		fprintf(stderr, "Skipping '%.*s', it is a delta report without a keyframe before it\n", int(label.size()), label.data());
 		return;
 	}
 
-	auto it = std::filesystem::directory_iterator{"reports"};
-	if (std::count_if(it, {}, [](auto& x){return x.is_regular_file(); }) > int(args.limitReportFiles))
+	if (!isInRange)
 	{
-		fprintf(stderr, "Too many files in the report folder, stopping the service to not consume all the space\n");
-		stopExecution(ExitReason::TooManyReportFiles);
+		return;
+	}
+
+	ProcessSnapshot snapshot;
+	if (report.isDelta())
+	{
+		const ProcessSnapshot& fullSnapshot = decoder.getSnapshot();
+		snapshot.time = fullSnapshot.time;
+		snapshot.uptimeSec = fullSnapshot.uptimeSec;
+		snapshot.memoryTotalKb = fullSnapshot.memoryTotalKb;
+		snapshot.clockTicksPerSec = fullSnapshot.clockTicksPerSec;
+		for (const ProcessRecord& process : fullSnapshot.processes)
+		{
+			if (isProcessMatchingDumpFilter(args, process))
+			{
+				snapshot.processes.push_back(process);
+			}
+		}
+
+		output += std::format("==> {} <==\n", label);
+		renderReportHeader(snapshot, decoder.getMemConsumptionPct(), decoder.getCpuConsumptionPct(), output);
+		renderProcessTable(snapshot, args.sortKey, decoder.getUserNames(), output);
+		output += '\n';
+		return;
+	}
+
+	// the filter is matched against the string table once instead of for each process
+	const uint32_t stringCount = report.getHeader().stringCount;
+	std::vector<bool> matchingStrings(stringCount, false);
+	if (!args.processFilter.empty())
+	{
+		for (uint32_t i = 0; i < stringCount; ++i)
+		{
+			matchingStrings[i] = report.getString(i).find(args.processFilter) != std::string_view::npos;
+		}
+	}
+
+	report.fillSnapshotInfo(snapshot);
+	for (size_t i = 0; i < report.getHeader().processCount; ++i)
+	{
+		if (isProcessMatchingDumpFilter(args, report, i, matchingStrings))
+		{
+			report.fillProcessRecord(i, snapshot.processes.emplace_back());
+		}
+	}
+
+	UserNameCache userNames;
+	report.fillUserNames(userNames);
+	output += std::format("==> {} <==\n", label);
+	renderReportHeader(snapshot, report.getHeader().memConsumptionPct, report.getHeader().cpuConsumptionPct, output);
+	renderProcessTable(snapshot, args.sortKey, userNames, output);
+	output += '\n';
+}
+
+// text reports are printed as they are, only the lines containing the process filter are kept
+void dumpTextReport(const DumpArgs& args, std::string_view label, std::string_view report, std::string& output)
+{
+	output += std::format("==> {} <==\n", label);
+	if (args.processFilter.empty())
+	{
+		output += report;
+	}
+	else
+	{
+		for (size_t lineStart = 0; lineStart < report.size();)
+		{
+			const size_t lineEnd = std::min(report.find('\n', lineStart), report.size());
+			const std::string_view line = report.substr(lineStart, lineEnd - lineStart);
+			if (line.find(args.processFilter) != std::string_view::npos)
+			{
+				output += line;
+				output += '\n';
+			}
+			lineStart = lineEnd + 1;
+		}
+	}
+	output += '\n';
+}
+
+// renders the reports matching the filters in ps-like text format
+// accepts separate binary report files and report log segments, delta reports are decoded in the given order
+int runDumpCommand(const DumpArgs& args)
+{
+	std::string fileData;
+	std::string output;
+	bool hasErrors = false;
+	BinaryReportDecoder decoder;
+	for (const std::string& filePath : args.reportFiles)
+	{
+		if (filePath.ends_with(".log"))
+		{
+			const int64_t fromTimeMs = args.fromTime == std::numeric_limits<int64_t>::min() ? args.fromTime : args.fromTime * 1000;
+			const int64_t toTimeMs = args.toTime == std::numeric_limits<int64_t>::max() ? args.toTime : args.toTime * 1000 + 999;
+			std::string decompressedPayload;
+			// every segment starts with a keyframe
+			decoder = BinaryReportDecoder();
+			const bool isValid = readReportLogRange(filePath, fromTimeMs, toTimeMs, [&](const ReportLogRecordHeader& header, std::string_view payload, bool isInRange) {
+				output.clear();
+				const std::string label = std::format("{} at {:%Y-%m-%d %H:%M:%OS}", filePath, std::chrono::system_clock::time_point(std::chrono::milliseconds(header.unixTimeMs)));
+				const uint32_t format = header.format & ~ReportLogFlagsMask;
+				bool isPayloadValid = true;
+				if ((header.format & ReportLogCompressedFlag) != 0)
+				{
+					isPayloadValid = decompressGzip(payload, decompressedPayload);
+					payload = decompressedPayload;
+				}
+
+				BinaryReportView report;
+				if (isPayloadValid && format == static_cast<uint32_t>(ReportFormat::Binary) && report.parse(payload))
+				{
+					dumpBinaryReport(args, label, report, isInRange, decoder, output);
+				}
+				else if (isPayloadValid && format == static_cast<uint32_t>(ReportFormat::Text))
+				{
+					if (isInRange)
+					{
+						dumpTextReport(args, label, payload, output);
+					}
+				}
+				else
+				{
+					fprintf(stderr, "Could not read a record from '%s'\n", filePath.c_str());
+					hasErrors = true;
+				}
+				fwrite(output.data(), 1, output.size(), stdout);
+			});
+
+			if (!isValid)
+			{
+				fprintf(stderr, "Could not read report log '%s'\n", filePath.c_str());
+				hasErrors = true;
+			}
+			continue;
+		}
+
+		bool isRead = readSmallFile(AT_FDCWD, filePath.c_str(), fileData);
+		if (isRead && filePath.ends_with(".gz"))
+		{
+			std::string compressedData = std::move(fileData);
+			isRead = decompressGzip(compressedData, fileData);
+		}
+
+		BinaryReportView report;
+		if (!isRead || !report.parse(fileData))
+		{
+			fprintf(stderr, "Could not read binary report '%s'\n", filePath.c_str());
+			hasErrors = true;
+			continue;
+		}
+
+		// reports out of the range still have to be decoded if deltas follow them
+		const int64_t reportTime = report.getHeader().unixTimeMs / 1000;
+		output.clear();
+		dumpBinaryReport(args, filePath, report, reportTime >= args.fromTime && reportTime <= args.toTime, decoder, output);
+		fwrite(output.data(), 1, output.size(), stdout);
+	}
+
+	return hasErrors ? static_cast<int>(ExitReason::CouldNotReadReport) : 0;
+}
+
+// resource_alert offenders [<history file>]
+int runOffendersCommand(int argc, char** argv)
+{
+	if (argc > 3)
+	{
+		fprintf(stderr, "Usage: resource_alert offenders [<history file>]\n");
+		return 1;
+	}
+
+	const std::string filePath = (argc == 3) ? argv[2] : TopConsumerHistoryPath;
+	TopConsumerHistory history(filePath, std::numeric_limits<size_t>::max());
+	if (!history.load())
+	{
+		return 1;
+	}
+	if (access(filePath.c_str(), F_OK) != 0)
+	{
+		fprintf(stderr, "No top consumer history at '%s'\n", filePath.c_str());
+		return 1;
 	}
+
+	std::string output;
+	history.render(output);
+	fwrite(output.data(), 1, output.size(), stdout);
+	return 0;
 }
 
+// tests.cpp includes this file to test the internals and has its own main
+#ifndef RESOURCE_MONITOR_TESTS
 int main(int argc, char** argv)
 {
-	const Args args = readArgs(argc, argv);
+	if (argc > 1 && std::string_view(argv[1]) == "dump")
+	{
+		return runDumpCommand(readDumpArgs(argc, argv));
+	}
+	if (argc > 1 && std::string_view(argv[1]) == "offenders")
+	{
+		return runOffendersCommand(argc, argv);
+	}
+
+	const Args commandLineArgs = readArgs(argc, argv);
+	Args args = commandLineArgs;
 	AppState appState;
+	// registers the disk, disk I/O, network and socket metrics, before any rule is compiled
+	appState.diskCollector = std::make_unique<DiskCollector>(appState.metrics, args.diskMounts);
+	appState.diskIoCollector = std::make_unique<DiskIoCollector>(appState.metrics);
+	appState.netCollector = std::make_unique<NetCollector>(appState.metrics);
+	appState.socketCollector = std::make_unique<SocketCollector>(appState.metrics);
+
+	if (!args.configFilePath.empty())
+	{
+		std::optional<Config> config = loadConfig(args.configFilePath, appState.metrics, commandLineArgs);
+		if (!config.has_value())
+		{
+			stopExecution(ExitReason::InvalidConfig);
+		}
+		args = std::move(config->args);
+		appState.ruleSet = std::move(config->ruleSet);
+		appState.watchList.setWatches(std::move(config->watches), appState.metrics, appState.processTable.get());
+	}
+	else
+	{
+		std::string error;
+		if (!addThresholdRules(args, appState.metrics, appState.ruleSet, error))
+		{
+			fprintf(stderr, "Invalid threshold: %s\n", error.c_str());
+			stopExecution(ExitReason::MissingArgumentValue);
+		}
+	}
+	appState.ruleStates.resize(appState.ruleSet.rules.size());
+
+	// no SA_RESTART, so the wait between checks is interrupted to apply the new config right away
+	struct sigaction reloadAction{};
+	reloadAction.sa_handler = onConfigReloadSignal;
+	sigemptyset(&reloadAction.sa_mask);
+	sigaction(SIGHUP, &reloadAction, nullptr);
+	struct sigaction stopAction{};
+	stopAction.sa_handler = onStopSignal;
+	sigemptyset(&stopAction.sa_mask);
+	sigaction(SIGTERM, &stopAction, nullptr);
+	sigaction(SIGINT, &stopAction, nullptr);
 
 	if (!std::filesystem::is_directory("reports"))
 	{
 		std::filesystem::create_directory("reports");
 	}
 
+	std::unique_ptr<TraceWriter> traceWriter;
+	if (!args.traceFilePath.empty())
+	{
+		gIsTracingEnabled = true;
+		traceWriter = std::make_unique<TraceWriter>(args.traceFilePath);
+		setTraceThreadName("main");
+	}
+
+	if (args.reportLogSegmentMb > 0)
+	{
+		appState.reportLogWriter = std::make_unique<ReportLogWriter>("reports", uint64_t(args.reportLogSegmentMb) * 1024 * 1024);
+	}
+
+	ReportWriterSettings reportWriterSettings;
+	reportWriterSettings.format = args.reportFormat;
+	reportWriterSettings.compressionLevel = args.compressionLevel;
+	reportWriterSettings.keyframeInterval = args.keyframeInterval;
+	reportWriterSettings.overflowPolicy = args.reportQueueOverflowPolicy;
+	reportWriterSettings.syncBatchSize = args.syncBatchSize;
+	reportWriterSettings.logWriter = appState.reportLogWriter.get();
+	if (args.topConsumerHistorySize > 0)
+	{
+		appState.topConsumerHistory = std::make_unique<TopConsumerHistory>(TopConsumerHistoryPath, args.topConsumerHistorySize);
+		appState.topConsumerHistory->load();
+		reportWriterSettings.topConsumerHistory = appState.topConsumerHistory.get();
+	}
+	appState.reportWriter = std::make_unique<ReportWriter>(reportWriterSettings);
+
+	if (!args.cpuStreamTool.empty())
+	{
+		appState.cpuStreamReader = std::make_unique<StreamingCpuReader>(*StreamingCpuReader::parseTool(args.cpuStreamTool));
+	}
+
+	if (args.processEventsRescanSec > 0)
+	{
+		appState.processTable = std::make_unique<ProcessEventTable>(std::chrono::seconds(args.processEventsRescanSec), args.statCacheSize);
+		if (!appState.processTable->isValid())
+		{
+			appState.processTable.reset();
+		}
+	}
+
 	std::string readBuffer;
 	readBuffer.reserve(256);
 
-	while (true)
+	while (!gIsStopRequested)
 	{
+		const auto checkStartTime = std::chrono::steady_clock::now();
 		const bool foundIssues = doPeriodicCheck(args, appState, readBuffer);
 		if (foundIssues)
 		{
-			checkFileOverflow(args);
+			checkFileOverflow(args, appState);
+		}
+
+		if (traceWriter)
+		{
+			traceWriter->flush();
 		}
 
-		sleep(args.timeBetweenChecksSec);
+		// the check interval can change with the config, the next check is planned from the same start time
+		while (!waitForNextCheck(appState, checkStartTime + getCheckInterval(args, appState)) && !gIsStopRequested)
+		{
+			reloadConfig(commandLineArgs, args, appState);
+		}
 	}
+
+	// the writer finishes the queued reports and saves the top consumer history before it stops
+	appState.reportWriter.reset();
+	return 0;
 }
+#endif
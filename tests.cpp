@@ -0,0 +1,297 @@
+// g++ -std=c++2b -O2 tests.cpp -o tests -lz && ./tests
+// randomized checks of the parts with invariants that are hard to see from a running monitor
+#define RESOURCE_MONITOR_TESTS
+#include "main.cpp"
+
+#include <random>
+
+size_t gFailureCount = 0;
+
+void check(bool condition, std::string_view message)
+{
+	if (!condition)
+	{
+		fprintf(stderr, "FAILED: %.*s\n", int(message.size()), message.data());
+		++gFailureCount;
+	}
+}
+
+// every timer has to fire in the advance() call that first reaches its expiry tick, cancelled ones never
+void testTimingWheel()
+{
+	static constexpr size_t TimerCount = 200'000;
+	// past the 64^4 ticks the levels cover, so some timers wait in the top level
+	static constexpr uint64_t MaxDelayTicks = 20'000'000;
+
+	const std::chrono::steady_clock::time_point startTime{};
+	auto getTime = [startTime](uint64_t tick) { return startTime + tick * TimingWheel::TickDuration; };
+
+	std::mt19937_64 random(1);
+	TimingWheel wheel(startTime);
+	// indexed by the payload
+	std::vector<uint64_t> expiryTicks;
+	std::vector<TimingWheel::TimerId> timerIds;
+	std::vector<bool> isCancelled;
+	std::vector<bool> isFired;
+	uint64_t currentTick = 0;
+	uint64_t firedCount = 0;
+	uint64_t earlyCount = 0;
+	uint64_t lateCount = 0;
+
+	auto advance = [&](uint64_t targetTick) {
+		wheel.advance(getTime(targetTick), [&](TimingWheel::TimerId, uint32_t payload) {
+			earlyCount += expiryTicks[payload] > targetTick;
+			lateCount += expiryTicks[payload] <= currentTick;
+			check(!isCancelled[payload] && !isFired[payload], "a cancelled or fired timer fires again");
+			isFired[payload] = true;
+			++firedCount;
+		});
+		currentTick = std::max(currentTick, targetTick);
+	};
+
+	// the wheel is now at tick 1, like the expiry ticks of the timers in the past expect
+	advance(0);
+	while (expiryTicks.size() < TimerCount)
+	{
+		const uint64_t operation = random() % 100;
+		if (operation < 70)
+		{
+			// mostly short delays, like cooldowns of seconds to minutes
+			const uint64_t delay = (random() % 4 == 0) ? random() % MaxDelayTicks : random() % 5000;
+			const uint32_t payload = uint32_t(expiryTicks.size());
+			// a timer in the past fires on the next tick
+			expiryTicks.push_back(std::max(currentTick + delay, currentTick + 1));
+			timerIds.push_back(wheel.schedule(getTime(currentTick + delay), payload));
+			isCancelled.push_back(false);
+			isFired.push_back(false);
+		}
+		else if (operation < 80 && !expiryTicks.empty())
+		{
+			const uint32_t payload = uint32_t(random() % expiryTicks.size());
+			if (!isFired[payload] && !isCancelled[payload])
+			{
+				wheel.cancel(timerIds[payload]);
+				isCancelled[payload] = true;
+			}
+		}
+		else
+		{
+			advance(currentTick + random() % 200);
+		}
+	}
+	advance(currentTick + MaxDelayTicks + 1);
+
+	const uint64_t cancelledCount = uint64_t(std::ranges::count(isCancelled, true));
+	check(earlyCount == 0, "a timer fired early");
+	check(lateCount == 0, "a timer fired late");
+	check(firedCount + cancelledCount == TimerCount, "a timer was missed");
+}
+
+bool isSameRecord(const ProcessRecord& a, const ProcessRecord& b)
+{
+	return a.pid == b.pid && a.parentPid == b.parentPid && a.uid == b.uid && a.state == b.state && a.threadCount == b.threadCount
+		&& a.cpuTimeTicks == b.cpuTimeTicks && a.startTimeTicks == b.startTimeTicks && a.virtualMemoryKb == b.virtualMemoryKb
+		&& a.residentMemoryKb == b.residentMemoryKb && a.command == b.command && a.commandLine == b.commandLine;
+}
+
+// every decoded report has to give back the snapshot it was encoded from, through pid reuse, exec, reparenting, setuid and exits
+void testBinaryReportDeltas()
+{
+	static constexpr size_t ReportCount = 2000;
+	// few pids, so they get reused
+	static constexpr pid_t MaxPid = 400;
+
+	std::mt19937_64 random(2);
+	auto chance = [&random](int percent) { return int(random() % 100) < percent; };
+	uint64_t startTimeTicks = 0;
+	auto makeProcess = [&](pid_t pid) {
+		ProcessRecord process;
+		process.pid = pid;
+		process.parentPid = pid_t(random() % MaxPid);
+		process.uid = uid_t(random() % 3 * 1000);
+		process.state = "RSD"[random() % 3];
+		process.threadCount = int(1 + random() % 8);
+		process.startTimeTicks = ++startTimeTicks;
+		process.command = std::format("cmd{}", random() % 20);
+		process.commandLine = std::format("/usr/bin/{} --flag {}", process.command, random() % 5);
+		return process;
+	};
+
+	ProcessSnapshot snapshot;
+	snapshot.time = std::chrono::system_clock::time_point(std::chrono::seconds(1'700'000'000));
+	UserNameCache userNames;
+	BinaryReportDeltaEncoder encoder(8);
+	BinaryReportDecoder decoder;
+	std::string data;
+	size_t deltaCount = 0;
+	for (size_t reportIndex = 0; reportIndex < ReportCount; ++reportIndex)
+	{
+		std::vector<ProcessRecord>& processes = snapshot.processes;
+		std::erase_if(processes, [&](const ProcessRecord&) { return chance(5); });
+		for (ProcessRecord& process : processes)
+		{
+			if (chance(3))
+			{
+				// pid reuse, often by a restarted service where only the start time differs
+				const ProcessRecord previous = process;
+				process = makeProcess(process.pid);
+				if (chance(50))
+				{
+					process.parentPid = previous.parentPid;
+					process.uid = previous.uid;
+					process.command = previous.command;
+					process.commandLine = previous.commandLine;
+				}
+				continue;
+			}
+			if (chance(3))
+			{
+				process.command = std::format("exec{}", random() % 20);
+				process.commandLine = process.command;
+			}
+			if (chance(3))
+			{
+				// the parent exited and the orphan was reparented
+				process.parentPid = 1;
+			}
+			if (chance(2))
+			{
+				process.uid = 65534;
+			}
+			if (chance(50))
+			{
+				process.cpuTimeTicks += random() % 100;
+				process.residentMemoryKb = random() % 100'000;
+				process.virtualMemoryKb = process.residentMemoryKb * 4;
+			}
+			if (chance(10))
+			{
+				process.state = "RSD"[random() % 3];
+				process.threadCount = int(1 + random() % 8);
+			}
+		}
+		for (size_t i = random() % 10; i > 0; --i)
+		{
+			const pid_t pid = pid_t(1 + random() % MaxPid);
+			if (std::ranges::find(processes, pid, &ProcessRecord::pid) == processes.end())
+			{
+				processes.push_back(makeProcess(pid));
+			}
+		}
+		// the encoder sorts them itself
+		std::shuffle(processes.begin(), processes.end(), random);
+		snapshot.time += std::chrono::seconds(10);
+
+		const BinaryReportKind kind = encoder.encode(snapshot, 50.0f, 20.0f, userNames, data);
+		BinaryReportView view;
+		if (!view.parse(data) || !decoder.apply(view))
+		{
+			check(false, "an encoded report can't be decoded");
+			return;
+		}
+
+		std::vector<ProcessRecord> decoded;
+		if (kind == BinaryReportKind::Keyframe)
+		{
+			for (size_t i = 0; i < view.getHeader().processCount; ++i)
+			{
+				view.fillProcessRecord(i, decoded.emplace_back());
+			}
+		}
+		else
+		{
+			decoded = decoder.getSnapshot().processes;
+			++deltaCount;
+		}
+
+		std::vector<ProcessRecord> expected = processes;
+		std::ranges::sort(expected, {}, &ProcessRecord::pid);
+		std::ranges::sort(decoded, {}, &ProcessRecord::pid);
+		const bool isSame = std::ranges::equal(expected, decoded, isSameRecord);
+		check(isSame, std::format("report {} ({}) doesn't decode to its snapshot", reportIndex, (kind == BinaryReportKind::Keyframe) ? "keyframe" : "delta"));
+		if (!isSame)
+		{
+			return;
+		}
+	}
+	check(deltaCount > ReportCount / 2, "most reports should be deltas");
+}
+
+// a metric without a value is NaN, and no rule should fire because of it, not even through "!" or "!="
+void testRuleNaN()
+{
+	MetricTable metrics;
+	const size_t a = metrics.addMetric("test.a");
+	const size_t b = metrics.addMetric("test.b");
+	const double nan = std::numeric_limits<double>::quiet_NaN();
+
+	struct Case
+	{
+		std::string_view expression;
+		double aValue;
+		double bValue;
+		// NaN if the result should be NaN
+		double result;
+	};
+	static const std::array cases{
+		Case{"test.a > 1", nan, 0.0, nan},
+		Case{"test.a != 1", nan, 0.0, nan},
+		Case{"test.a == test.a", nan, 0.0, nan},
+		Case{"!(test.a > 1)", nan, 0.0, nan},
+		Case{"!(test.a != 1)", nan, 0.0, nan},
+		Case{"!test.a", nan, 0.0, nan},
+		Case{"!!test.a", nan, 0.0, nan},
+		Case{"test.a + 1 >= 0", nan, 0.0, nan},
+		Case{"-test.a < 0", nan, 0.0, nan},
+		Case{"test.a > 1 && test.b > 1", nan, 2.0, 0.0},
+		Case{"test.a > 1 || test.b > 1", nan, 2.0, 1.0},
+		Case{"test.a > 1 || test.b > 1", nan, nan, 0.0},
+		Case{"!(test.a > 1)", 2.0, 0.0, 0.0},
+		Case{"!(test.a > 1)", 0.0, 0.0, 1.0},
+		Case{"!test.a", 0.0, 0.0, 1.0},
+		Case{"test.a != 1", 2.0, 0.0, 1.0},
+		Case{"-test.a < 0", 2.0, 0.0, 1.0},
+		Case{"test.a * 2 > test.b", 2.0, 3.0, 1.0},
+	};
+
+	for (const Case& testCase : cases)
+	{
+		RuleSet ruleSet;
+		Rule rule;
+		std::string error;
+		if (!RuleCompiler(metrics, testCase.expression, ruleSet).compile(rule, error))
+		{
+			check(false, std::format("'{}' doesn't compile: {}", testCase.expression, error));
+			continue;
+		}
+
+		metrics.setValue(a, testCase.aValue);
+		metrics.setValue(b, testCase.bValue);
+		const double result = evaluateRule(ruleSet, rule, metrics.getValues());
+		const bool isExpected = std::isnan(testCase.result) ? std::isnan(result) : result == testCase.result;
+		check(isExpected, std::format("'{}' with test.a = {} and test.b = {} gives {} instead of {}", testCase.expression, testCase.aValue, testCase.bValue, result, testCase.result));
+		check(!isRuleValueTrue(result) || !std::isnan(testCase.result), std::format("'{}' fires without a value", testCase.expression));
+	}
+
+	// the errors point at the column in the config line, where the expression starts after "rule <name>:"
+	RuleSet ruleSet;
+	Rule rule;
+	std::string error;
+	check(!RuleCompiler(metrics, " test.a > ", ruleSet, 12).compile(rule, error) && error.ends_with("at column 23"), std::format("unexpected error '{}'", error));
+	check(!RuleCompiler(metrics, " test.c > 1", ruleSet, 12).compile(rule, error) && error.ends_with("at column 14"), std::format("unexpected error '{}'", error));
+}
+
+int main()
+{
+	testTimingWheel();
+	testBinaryReportDeltas();
+	testRuleNaN();
+
+	if (gFailureCount > 0)
+	{
+		fprintf(stderr, "%zu checks failed\n", gFailureCount);
+		return 1;
+	}
+	printf("All tests passed\n");
+	return 0;
+}